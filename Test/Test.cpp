@@ -1,13 +1,147 @@
 #include <thread>
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <random>
+#include <functional>
+#include <atomic>
+#include <memory_resource>
+#include <cmath>
+#include <numeric>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <new>
+#include <cstddef>
 
 #include "TimedCache.h"
+#include "ShardedTimedCache.h"
+#include "TwoTierCache.h"
+#include "LatencyHistogram.h"
+#include "Workload.h"
 
 #define T_CHECK_EQUAL( l, r ) if( !((l) == (r)) ) throw std::runtime_error(std::to_string(__LINE__));
 #define T_ERROR( msg ) throw std::runtime_error( msg + std::string(" - line = ")+  std::to_string(__LINE__));
 
+// Выделения памяти в текущем потоке, для проверок "без лишних копий".
+// Заменен весь набор глобальных operator new / delete, включая массивы, nothrow
+// и выровненные формы: все они выделяют и освобождают одной парой функций.
+thread_local size_t t_allocations = 0;
+
+static void* allocate( size_t size, size_t align ) noexcept
+{
+    ++t_allocations;
+    if( size == 0 )
+        size = 1;
+    if( align <= alignof( std::max_align_t ) )
+        return std::malloc( size );
+#ifdef _WIN32
+    return _aligned_malloc( size, align );
+#else
+    return std::aligned_alloc( align, ( size + align - 1 ) / align * align );
+#endif
+}
+static void deallocate( void* p, size_t align ) noexcept
+{
+#ifdef _WIN32
+    if( align > alignof( std::max_align_t ) )
+    {
+        _aligned_free( p );
+        return;
+    }
+#else
+    ( void )align;
+#endif
+    std::free( p );
+}
+static void* allocateOrThrow( size_t size, size_t align )
+{
+    if( void* p = allocate( size, align ) )
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new( size_t size )
+{
+    return allocateOrThrow( size, alignof( std::max_align_t ) );
+}
+void* operator new[]( size_t size )
+{
+    return allocateOrThrow( size, alignof( std::max_align_t ) );
+}
+void* operator new( size_t size, std::align_val_t align )
+{
+    return allocateOrThrow( size, size_t( align ) );
+}
+void* operator new[]( size_t size, std::align_val_t align )
+{
+    return allocateOrThrow( size, size_t( align ) );
+}
+void* operator new( size_t size, const std::nothrow_t& ) noexcept
+{
+    return allocate( size, alignof( std::max_align_t ) );
+}
+void* operator new[]( size_t size, const std::nothrow_t& ) noexcept
+{
+    return allocate( size, alignof( std::max_align_t ) );
+}
+void* operator new( size_t size, std::align_val_t align, const std::nothrow_t& ) noexcept
+{
+    return allocate( size, size_t( align ) );
+}
+void* operator new[]( size_t size, std::align_val_t align, const std::nothrow_t& ) noexcept
+{
+    return allocate( size, size_t( align ) );
+}
+void operator delete( void* p ) noexcept
+{
+    deallocate( p, alignof( std::max_align_t ) );
+}
+void operator delete[]( void* p ) noexcept
+{
+    deallocate( p, alignof( std::max_align_t ) );
+}
+void operator delete( void* p, size_t ) noexcept
+{
+    deallocate( p, alignof( std::max_align_t ) );
+}
+void operator delete[]( void* p, size_t ) noexcept
+{
+    deallocate( p, alignof( std::max_align_t ) );
+}
+void operator delete( void* p, std::align_val_t align ) noexcept
+{
+    deallocate( p, size_t( align ) );
+}
+void operator delete[]( void* p, std::align_val_t align ) noexcept
+{
+    deallocate( p, size_t( align ) );
+}
+void operator delete( void* p, size_t, std::align_val_t align ) noexcept
+{
+    deallocate( p, size_t( align ) );
+}
+void operator delete[]( void* p, size_t, std::align_val_t align ) noexcept
+{
+    deallocate( p, size_t( align ) );
+}
+void operator delete( void* p, const std::nothrow_t& ) noexcept
+{
+    deallocate( p, alignof( std::max_align_t ) );
+}
+void operator delete[]( void* p, const std::nothrow_t& ) noexcept
+{
+    deallocate( p, alignof( std::max_align_t ) );
+}
+void operator delete( void* p, std::align_val_t align, const std::nothrow_t& ) noexcept
+{
+    deallocate( p, size_t( align ) );
+}
+void operator delete[]( void* p, std::align_val_t align, const std::nothrow_t& ) noexcept
+{
+    deallocate( p, size_t( align ) );
+}
+
 void test_set_get()
 {
     std::cout << __func__ << std::endl;
@@ -58,6 +192,80 @@ void test_set_get()
         T_ERROR( "find element, that dont add" );
 }
 
+void test_eviction_order()
+{
+    std::cout << __func__ << std::endl;
+    TimedCache< int, std::string > cache( 3, std::chrono::seconds( 10000 ) );
+
+    // Ключи добавляются подряд и могут получить одинаковое время,
+    // порядок вытеснения при этом должен определяться порядком вставки
+    cache.set( 1, "1" );
+    cache.set( 2, "2" );
+    cache.set( 3, "3" );
+    T_CHECK_EQUAL( cache.size(), 3 );
+
+    // Обращение к 1 делает его самым свежим, вытесняться должен 2
+    if( !cache.get( 1 ).has_value() )
+        T_ERROR( "dont find element from cache!" );
+    cache.set( 4, "4" );
+    T_CHECK_EQUAL( cache.size(), 3 );
+    if( cache.get( 2 ).has_value() )
+        T_ERROR( "find element, that should be evicted" );
+    for( int key : { 1, 3, 4 } )
+    {
+        if( auto fv = cache.get( key ); fv.has_value() )
+        {
+            T_CHECK_EQUAL( fv.value(), std::to_string( key ) );
+        }
+        else
+        {
+            T_ERROR( "dont find element from cache!" );
+        }
+    }
+
+    // Повторный set существующего ключа не увеличивает размер
+    cache.set( 3, "33" );
+    T_CHECK_EQUAL( cache.size(), 3 );
+    T_CHECK_EQUAL( cache.get( 3 ).value(), "33" );
+
+    cache.clear();
+    T_CHECK_EQUAL( cache.size(), 0 );
+    if( cache.get( 1 ).has_value() )
+        T_ERROR( "find element after clear" );
+}
+
+void test_handle()
+{
+    std::cout << __func__ << std::endl;
+    TimedCache< int, std::string > cache( 2, std::chrono::seconds( 10000 ) );
+    cache.set( 1, std::string( 4096, 'a' ) );
+
+    auto h = cache.get_handle( 1 );
+    if( !h )
+        T_ERROR( "dont find element from cache!" );
+    // Повторный запрос отдает тот же объект, без копирования
+    T_CHECK_EQUAL( cache.get_handle( 1 ).get(), h.get() );
+
+    size_t calls = 0;
+    bool found = cache.get_with( 1, [&]( const std::string& v )
+    {
+        ++calls;
+        T_CHECK_EQUAL( &v, h.get() );
+    } );
+    T_CHECK_EQUAL( found, true );
+    T_CHECK_EQUAL( calls, 1 );
+    T_CHECK_EQUAL( cache.get_with( 2, [&]( const std::string& ) { ++calls; } ), false );
+    T_CHECK_EQUAL( calls, 1 );
+
+    // Замена и вытеснение не портят уже выданный handle
+    cache.set( 1, "new" );
+    T_CHECK_EQUAL( *cache.get_handle( 1 ), "new" );
+    cache.clear();
+    T_CHECK_EQUAL( *h, std::string( 4096, 'a' ) );
+    if( cache.get_handle( 1 ) )
+        T_ERROR( "find element after clear" );
+}
+
 void test_timer()
 {
     std::cout << __func__ << std::endl;
@@ -200,7 +408,7 @@ void test_multithreading()
         }
         void execute()
         {
-            std::mt19937 mt{ std::default_random_engine() };
+            std::mt19937 mt{ std::default_random_engine()() };
             std::uniform_int_distribution dist( 0, 1000 );
             for( size_t i = 0; i < m_CountIteration; ++i )
             {
@@ -227,15 +435,1716 @@ void test_multithreading()
         T_ERROR( "incorect work cache!" );
 }
 
+void test_sharded()
+{
+    std::cout << __func__ << std::endl;
+    ShardedTimedCache< int, std::string > cache( 1000, std::chrono::seconds( 1 ), 8 );
+    T_CHECK_EQUAL( cache.shards(), 8 );
+    T_CHECK_EQUAL( cache.capacity(), 1000 );
+
+    // Сегментов не может быть больше, чем емкость
+    ShardedTimedCache< int, std::string > small( 3, std::chrono::seconds( 1 ), 8 );
+    T_CHECK_EQUAL( small.shards(), 2 );
+
+    // Заполняем с запасом, суммарный размер не должен превысить общую емкость
+    for( int i = 0; i < 5000; ++i )
+        cache.set( i, std::to_string( i ) );
+    if( cache.size() > cache.capacity() )
+        T_ERROR( "sharded cache exceeds capacity" );
+
+    cache.set( 100000, "100000" );
+    T_CHECK_EQUAL( cache.get( 100000 ).value(), "100000" );
+
+    std::vector< std::thread > threads;
+    for( size_t t = 0; t < 4; ++t )
+    {
+        threads.emplace_back( [&cache, t]()
+        {
+            std::mt19937 mt{ unsigned( t ) };
+            std::uniform_int_distribution dist( 0, 2000 );
+            for( size_t i = 0; i < 10000; ++i )
+            {
+                int v = dist( mt );
+                if( auto fv = cache.get( v ); fv.has_value() )
+                {
+                    if( fv.value() != std::to_string( v ) )
+                        throw std::runtime_error( "sharded cache returns wrong value" );
+                }
+                else
+                {
+                    cache.set( v, std::to_string( v ) );
+                }
+            }
+        } );
+    }
+    for( auto& t : threads )
+        t.join();
+    if( cache.size() > cache.capacity() )
+        T_ERROR( "sharded cache exceeds capacity" );
+
+    // Ждем чтобы все объекты "протухли"
+    std::this_thread::sleep_for( std::chrono::seconds( 2 ) );
+    T_CHECK_EQUAL( cache.size(), 0 );
+}
+
+void test_timing_wheel()
+{
+    std::cout << __func__ << std::endl;
+    TimingWheel wheel( 8 );
+    std::vector< std::pair< TimingWheel::index, uint64_t > > fired;
+    auto advance = [&]( uint64_t target )
+    {
+        wheel.advance( target, [&]( TimingWheel::index i ){ fired.emplace_back( i, wheel.now() ); } );
+    };
+
+    // 1 мс, 1 секунда и час при шаге 1 мс
+    wheel.schedule( 0, 1 );
+    wheel.schedule( 1, 1000 );
+    wheel.schedule( 2, 3600 * 1000 );
+    wheel.schedule( 3, 70 );
+    T_CHECK_EQUAL( wheel.size(), 4 );
+    T_CHECK_EQUAL( wheel.nextEvent(), 1 );
+
+    // Перестановка и снятие
+    wheel.schedule( 3, 500 );
+    wheel.schedule( 4, 200 );
+    wheel.cancel( 4 );
+    wheel.cancel( 4 );
+    T_CHECK_EQUAL( wheel.size(), 4 );
+
+    advance( 499 );
+    T_CHECK_EQUAL( fired.size(), 1 );
+    T_CHECK_EQUAL( fired[0].first, 0 );
+    T_CHECK_EQUAL( fired[0].second, 1 );
+    advance( 999 );
+    T_CHECK_EQUAL( fired.size(), 2 );
+    T_CHECK_EQUAL( fired[1].first, 3 );
+    T_CHECK_EQUAL( fired[1].second, 500 );
+    advance( 3600 * 1000 - 1 );
+    T_CHECK_EQUAL( fired.size(), 3 );
+    T_CHECK_EQUAL( fired[2].second, 1000 );
+    if( wheel.nextEvent() == 0 || wheel.nextEvent() > 1 )
+        T_ERROR( "wrong next event of timing wheel" );
+    advance( 3600 * 1000 );
+    T_CHECK_EQUAL( fired.size(), 4 );
+    T_CHECK_EQUAL( fired[3].first, 2 );
+    T_CHECK_EQUAL( fired[3].second, 3600 * 1000 );
+    T_CHECK_EQUAL( wheel.size(), 0 );
+
+    // Случайные сроки срабатывают ровно в свой тик
+    std::mt19937_64 mt{ 5 };
+    std::uniform_int_distribution< uint64_t > dist( 1, 1 << 20 );
+    TimingWheel big( 1000 );
+    std::vector< uint64_t > deadlines( 1000 );
+    for( TimingWheel::index i = 0; i < 1000; ++i )
+    {
+        deadlines[i] = dist( mt );
+        big.schedule( i, deadlines[i] );
+    }
+    size_t count = 0;
+    for( uint64_t t = 0; t <= ( 1 << 20 ); t += 777 )
+    {
+        big.advance( t, [&]( TimingWheel::index i )
+        {
+            ++count;
+            if( deadlines[i] != big.now() )
+                throw std::runtime_error( "timing wheel fired at wrong tick" );
+        } );
+    }
+    big.advance( 1 << 20, [&]( TimingWheel::index ){ ++count; } );
+    T_CHECK_EQUAL( count, 1000 );
+
+    // Сроки дальше 64^6 тиков паркуются на верхнем уровне и перекладываются,
+    // пока не попадут в диапазон колеса. Срабатывают все равно ровно в свой тик.
+    const uint64_t range = uint64_t( 1 ) << ( TimingWheel::bits * TimingWheel::levels );
+    TimingWheel far( 4, 12345 );
+    std::vector< uint64_t > farDeadlines = { 12345 + range + 1, 12345 + 3 * range + 777, 12345 + range / 2, 12345 + 20 * range };
+    for( TimingWheel::index i = 0; i < farDeadlines.size(); ++i )
+        far.schedule( i, farDeadlines[i] );
+    std::vector< uint64_t > farFired( farDeadlines.size(), 0 );
+    auto farAdvance = [&]( uint64_t target )
+    {
+        far.advance( target, [&]( TimingWheel::index i ) { farFired[i] = far.now(); } );
+    };
+    for( uint64_t t = 12345; t < 12345 + 21 * range; t += range / 7 )
+    {
+        farAdvance( t );
+        for( size_t i = 0; i < farDeadlines.size(); ++i )
+        {
+            if( ( farFired[i] != 0 ) != ( farDeadlines[i] <= t ) )
+                T_ERROR( "far timer fired at wrong time" );
+        }
+    }
+    farAdvance( 12345 + 21 * range );
+    for( size_t i = 0; i < farDeadlines.size(); ++i )
+        T_CHECK_EQUAL( farFired[i], farDeadlines[i] );
+    T_CHECK_EQUAL( far.size(), 0 );
+}
+
+void test_wheel_cleaner()
+{
+    std::cout << __func__ << std::endl;
+    CacheOptions options;
+    options.wheelTick = std::chrono::milliseconds( 10 );
+    TimedCache< int, std::string > cache( 100, std::chrono::milliseconds( 300 ), options );
+
+    for( int i = 0; i < 10; ++i )
+        cache.set( i, std::to_string( i ) );
+
+    // Обращение продлевает жизнь объекта
+    for( size_t i = 0; i < 4; ++i )
+    {
+        std::this_thread::sleep_for( std::chrono::milliseconds( 150 ) );
+        if( !cache.get( 1 ).has_value() )
+            T_ERROR( "dont update timer!" );
+    }
+    T_CHECK_EQUAL( cache.size(), 1 );
+
+    std::this_thread::sleep_for( std::chrono::milliseconds( 500 ) );
+    if( cache.size() != 0 )
+        T_ERROR( "cleaner doesn't work!" );
+}
+
+void test_expiration_service()
+{
+    std::cout << __func__ << std::endl;
+    ExpirationService service( 2 );
+    CacheOptions options;
+    options.service = &service;
+
+    // Много кэшей обслуживаются двумя потоками планировщика
+    std::vector< std::unique_ptr< TimedCache< int, std::string > > > caches;
+    for( size_t i = 0; i < 100; ++i )
+    {
+        caches.push_back( std::make_unique< TimedCache< int, std::string > >(
+            10, std::chrono::milliseconds( 100 + 10 * ( i % 10 ) ), options ) );
+        for( int key = 0; key < 10; ++key )
+            caches.back()->set( key, std::to_string( key ) );
+    }
+    T_CHECK_EQUAL( service.threads(), 2 );
+
+    // Кэши снимаются с планировщика при разрушении, в том числе непустые
+    caches.resize( 50 );
+    for( size_t i = 0; i < 20; ++i )
+    {
+        TimedCache< int, std::string > temp( 10, std::chrono::milliseconds( 1 ), options );
+        temp.set( 1, "1" );
+        std::this_thread::sleep_for( std::chrono::milliseconds( i % 3 ) );
+    }
+
+    std::this_thread::sleep_for( std::chrono::milliseconds( 400 ) );
+    for( auto& cache : caches )
+    {
+        if( cache->size() != 0 )
+            T_ERROR( "expiration service doesn't clean cache!" );
+    }
+
+    // Задачи запускаются в порядке сроков
+    std::mutex lock;
+    std::vector< int > order;
+    std::vector< ExpirationService::id > ids;
+    for( int i = 0; i < 3; ++i )
+    {
+        ids.push_back( service.add( [&, i]()
+        {
+            std::lock_guard lg( lock );
+            order.push_back( i );
+            return ExpirationService::never;
+        } ) );
+    }
+    service.schedule( ids[0], std::chrono::milliseconds( 60 ) );
+    service.schedule( ids[1], std::chrono::milliseconds( 20 ) );
+    service.schedule( ids[2], std::chrono::milliseconds( 40 ) );
+    // Более поздний срок не отменяет назначенный
+    service.schedule( ids[1], std::chrono::seconds( 10 ) );
+    std::this_thread::sleep_for( std::chrono::milliseconds( 200 ) );
+    for( auto id : ids )
+        service.remove( id );
+    std::lock_guard lg( lock );
+    T_CHECK_EQUAL( order.size(), 3 );
+    T_CHECK_EQUAL( order[0], 1 );
+    T_CHECK_EQUAL( order[1], 2 );
+    T_CHECK_EQUAL( order[2], 0 );
+}
+
+void test_lazy_expiry()
+{
+    std::cout << __func__ << std::endl;
+    CacheOptions options;
+    options.expiry = ExpiryMode::Lazy;
+    TimedCache< int, std::string > cache( 100, std::chrono::milliseconds( 100 ), options );
+
+    for( int i = 0; i < 10; ++i )
+        cache.set( i, std::to_string( i ) );
+    std::this_thread::sleep_for( std::chrono::milliseconds( 200 ) );
+
+    // Фоновой чистки нет
+    T_CHECK_EQUAL( cache.size(), 10 );
+    // Удаление при обращении
+    if( cache.get( 0 ).has_value() )
+        T_ERROR( "find expired element" );
+    T_CHECK_EQUAL( cache.size(), 9 );
+    // Каждый set() удаляет не более двух самых старых
+    cache.set( 100, "100" );
+    T_CHECK_EQUAL( cache.size(), 8 );
+    for( int i = 101; i < 105; ++i )
+        cache.set( i, std::to_string( i ) );
+    T_CHECK_EQUAL( cache.size(), 5 );
+    T_CHECK_EQUAL( cache.get( 104 ).value(), "104" );
+}
+
+template< class Clock >
+void check_clock( typename Clock::duration accuracy )
+{
+    auto start = Clock::now();
+    auto startPrecise = PreciseClock::now();
+    std::this_thread::sleep_for( std::chrono::milliseconds( 50 ) );
+    auto dt = Clock::now() - start;
+    auto dtPrecise = PreciseClock::now() - startPrecise;
+    auto diff = dt > dtPrecise ? dt - dtPrecise : dtPrecise - dt;
+    if( diff > accuracy )
+        T_ERROR( std::string( Clock::name() ) + " clock is inaccurate" );
+    for( size_t i = 0; i < 1000; ++i )
+    {
+        auto prev = Clock::now();
+        if( Clock::now() < prev )
+            T_ERROR( std::string( Clock::name() ) + " clock isn't monotonic" );
+    }
+}
+
+void test_clocks()
+{
+    std::cout << __func__ << std::endl;
+    check_clock< PreciseClock >( std::chrono::milliseconds( 1 ) );
+    check_clock< TscClock >( std::chrono::milliseconds( 2 ) );
+    check_clock< CoarseClock >( std::chrono::milliseconds( 20 ) );
+    check_clock< TickerClock >( std::chrono::milliseconds( 20 ) );
+
+    TimedCache< int, std::string, CoarseClock > cache( 100, std::chrono::milliseconds( 200 ) );
+    for( int i = 0; i < 10; ++i )
+        cache.set( i, std::to_string( i ) );
+    if( !cache.get( 1 ).has_value() )
+        T_ERROR( "dont find element from cache!" );
+    std::this_thread::sleep_for( std::chrono::milliseconds( 400 ) );
+    T_CHECK_EQUAL( cache.size(), 0 );
+}
+
+void test_multi_get_set()
+{
+    std::cout << __func__ << std::endl;
+    TimedCache< int, std::string > cache( 100, std::chrono::seconds( 10000 ) );
+    ShardedTimedCache< int, std::string > sharded( 100, std::chrono::seconds( 10000 ), 4 );
+
+    // Больше одной части пакета, с повтором ключа
+    std::vector< std::pair< int, std::string > > items;
+    for( int i = 0; i < 70; ++i )
+        items.emplace_back( i, std::to_string( i ) );
+    items.emplace_back( 5, "five" );
+    cache.multi_set( items.data(), items.size() );
+    sharded.multi_set( items.data(), items.size() );
+    T_CHECK_EQUAL( cache.size(), 70 );
+    T_CHECK_EQUAL( sharded.size(), 70 );
+
+    std::vector< int > keys;
+    for( int i = -10; i < 80; ++i )
+        keys.push_back( i );
+    std::vector< TimedCache< int, std::string >::handle > out( keys.size() );
+    std::vector< ShardedTimedCache< int, std::string >::handle > shardedOut( keys.size() );
+    T_CHECK_EQUAL( cache.multi_get( keys.data(), keys.size(), out.data() ), 70 );
+    T_CHECK_EQUAL( sharded.multi_get( keys.data(), keys.size(), shardedOut.data() ), 70 );
+    for( size_t i = 0; i < keys.size(); ++i )
+    {
+        int key = keys[i];
+        bool expected = key >= 0 && key < 70;
+        T_CHECK_EQUAL( bool( out[i] ), expected );
+        T_CHECK_EQUAL( bool( shardedOut[i] ), expected );
+        if( expected )
+        {
+            std::string value = key == 5 ? "five" : std::to_string( key );
+            T_CHECK_EQUAL( *out[i], value );
+            T_CHECK_EQUAL( *shardedOut[i], value );
+            T_CHECK_EQUAL( cache.get( key ).value(), value );
+        }
+    }
+
+    // Пакетная запись тоже вытесняет самые старые
+    items.clear();
+    for( int i = 100; i < 150; ++i )
+        items.emplace_back( i, std::to_string( i ) );
+    cache.multi_set( items.data(), items.size() );
+    T_CHECK_EQUAL( cache.size(), 100 );
+    if( cache.get( 0 ).has_value() || !cache.get( 149 ).has_value() )
+        T_ERROR( "multi_set evicts wrong element" );
+}
+
+void test_read_buffer()
+{
+    std::cout << __func__ << std::endl;
+    CacheOptions options;
+    options.readBuffer = true;
+    TimedCache< int, std::string > cache( 4, std::chrono::milliseconds( 300 ), options );
+
+    for( int i = 0; i < 4; ++i )
+        cache.set( i, std::to_string( i ) );
+    // Чтение под блокировкой чтения, продление записано только в буфер
+    std::this_thread::sleep_for( std::chrono::milliseconds( 150 ) );
+    T_CHECK_EQUAL( cache.get( 0 ).value(), "0" );
+    T_CHECK_EQUAL( *cache.get_handle( 1 ), "1" );
+    if( cache.get( 10 ).has_value() )
+        T_ERROR( "find not exist element" );
+    // set() применяет буфер: прочитанные стали новее и вытесняется 2
+    cache.set( 4, "4" );
+    if( cache.get( 2 ).has_value() || !cache.get( 0 ).has_value() )
+        T_ERROR( "read buffer dont update eviction order" );
+    // Фоновая чистка тоже применяет буфер: 0 и 1 продлены, 3 удален
+    std::this_thread::sleep_for( std::chrono::milliseconds( 200 ) );
+    T_CHECK_EQUAL( cache.size(), 3 );
+    if( cache.get( 3 ).has_value() || !cache.get( 1 ).has_value() )
+        T_ERROR( "read buffer dont update expire time" );
+
+    // Конкурентные чтения и записи, чтений больше, чем мест в буфере
+    TimedCache< int, std::string > shared( 100, std::chrono::seconds( 10000 ), options );
+    for( int i = 0; i < 100; ++i )
+        shared.set( i, std::to_string( i ) );
+    std::atomic_bool failed{ false };
+    std::vector< std::thread > threads;
+    for( int t = 0; t < 4; ++t )
+    {
+        threads.emplace_back( [&, t]()
+        {
+            for( int i = 0; i < 20000; ++i )
+            {
+                int key = ( i * 7 + t ) % 150;
+                if( t == 0 && i % 10 == 0 )
+                    shared.set( key, std::to_string( key ) );
+                else if( auto value = shared.get( key ) )
+                    failed = failed || *value != std::to_string( key );
+            }
+        } );
+    }
+    for( auto& thread : threads )
+        thread.join();
+    if( failed )
+        T_ERROR( "wrong value from read buffered cache" );
+    T_CHECK_EQUAL( shared.size(), 100 );
+}
+
+void test_flat_index()
+{
+    std::cout << __func__ << std::endl;
+    // Ключи хранятся снаружи, таблица хранит только номера
+    std::vector< size_t > keys;
+    for( size_t i = 0; i < 100; ++i )
+        keys.push_back( i * 1000 );
+    FlatIndex index( keys.size() );
+    auto find = [&]( size_t key )
+    {
+        return index.find( std::hash< size_t >()( key ), [&]( FlatIndex::index i ) { return keys[i] == key; } );
+    };
+    for( size_t i = 0; i < keys.size(); ++i )
+        index.insert( std::hash< size_t >()( keys[i] ), FlatIndex::index( i ) );
+    for( size_t i = 0; i < keys.size(); ++i )
+        T_CHECK_EQUAL( find( keys[i] ), i );
+    if( find( 1 ) != FlatIndex::npos )
+        T_ERROR( "find not exist key" );
+    for( size_t i = 0; i < keys.size(); i += 2 )
+        index.erase( std::hash< size_t >()( keys[i] ), FlatIndex::index( i ) );
+    for( size_t i = 0; i < keys.size(); ++i )
+        T_CHECK_EQUAL( find( keys[i] ), i % 2 ? FlatIndex::index( i ) : FlatIndex::npos );
+
+    // Постоянная замена ключей в заполненной таблице: ничего не копится, после удаления
+    // всех ключей поиск снова останавливается на первой же группе
+    {
+        const size_t capacity = 1000;
+        FlatIndex churn( capacity );
+        std::vector< size_t > stored( capacity );
+        std::mt19937_64 rnd{ 7 };
+        auto churnFind = [&]( size_t key )
+        {
+            return churn.find( std::hash< size_t >()( key ), [&]( FlatIndex::index i ) { return stored[i] == key; } );
+        };
+        for( size_t i = 0; i < capacity; ++i )
+        {
+            stored[i] = rnd();
+            churn.insert( std::hash< size_t >()( stored[i] ), FlatIndex::index( i ) );
+        }
+        for( size_t n = 0; n < 200000; ++n )
+        {
+            size_t i = size_t( rnd() % capacity );
+            churn.erase( std::hash< size_t >()( stored[i] ), FlatIndex::index( i ) );
+            stored[i] = rnd();
+            churn.insert( std::hash< size_t >()( stored[i] ), FlatIndex::index( i ) );
+        }
+        for( size_t i = 0; i < capacity; ++i )
+            T_CHECK_EQUAL( churnFind( stored[i] ), i );
+        for( size_t i = 0; i < capacity; ++i )
+            churn.erase( std::hash< size_t >()( stored[i] ), FlatIndex::index( i ) );
+        T_CHECK_EQUAL( churn.overflowed(), size_t( 0 ) );
+        T_CHECK_EQUAL( churnFind( stored[0] ), FlatIndex::npos );
+    }
+
+    // Ключи в хранилище кэша, много удалений
+    TimedCache< std::string, int > cache( 50, std::chrono::seconds( 10000 ) );
+    TimedCache< size_t, int > intCache( 50, std::chrono::seconds( 10000 ) );
+    std::mt19937 mt{ 42 };
+    std::uniform_int_distribution< size_t > dist( 0, 200 );
+    for( int i = 0; i < 100000; ++i )
+    {
+        size_t key = dist( mt );
+        if( auto value = cache.get( std::to_string( key ) ) )
+        {
+            T_CHECK_EQUAL( size_t( *value ), key );
+        }
+        else
+            cache.set( std::to_string( key ), int( key ) );
+        if( auto value = intCache.get( key ) )
+        {
+            T_CHECK_EQUAL( size_t( *value ), key );
+        }
+        else
+            intCache.set( key, int( key ) );
+    }
+    T_CHECK_EQUAL( cache.size(), 50 );
+    T_CHECK_EQUAL( intCache.size(), 50 );
+}
+
+// Считает обращения к куче через memory_resource
+class CountingResource : public std::pmr::memory_resource
+{
+public:
+    std::atomic< size_t > allocations{ 0 };
+    std::atomic< size_t > deallocations{ 0 };
+private:
+    void* do_allocate( size_t bytes, size_t alignment ) override
+    {
+        ++allocations;
+        return std::pmr::new_delete_resource()->allocate( bytes, alignment );
+    }
+    void do_deallocate( void* p, size_t bytes, size_t alignment ) override
+    {
+        ++deallocations;
+        std::pmr::new_delete_resource()->deallocate( p, bytes, alignment );
+    }
+    bool do_is_equal( const std::pmr::memory_resource& other ) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+void test_slab_pool()
+{
+    std::cout << __func__ << std::endl;
+    CountingResource counting;
+    {
+        // Без пула каждое значение - одно выделение
+        CacheOptions options;
+        options.resource = &counting;
+        TimedCache< int, std::string > cache( 100, std::chrono::seconds( 10000 ), options );
+        for( int i = 0; i < 1000; ++i )
+            cache.set( i, std::to_string( i ) );
+        T_CHECK_EQUAL( counting.allocations.load(), 1000 );
+        T_CHECK_EQUAL( counting.deallocations.load(), 900 );
+    }
+    T_CHECK_EQUAL( counting.deallocations.load(), 1000 );
+
+    counting.allocations = 0;
+    counting.deallocations = 0;
+    TimedCache< int, std::string >::handle kept;
+    {
+        CacheOptions options;
+        options.resource = &counting;
+        options.slabPool = true;
+        TimedCache< int, std::string > cache( 100, std::chrono::seconds( 10000 ), options );
+        std::vector< std::pair< int, std::string > > items;
+        for( int i = 0; i < 100; ++i )
+            items.emplace_back( i, std::to_string( i ) );
+        cache.multi_set( items.data(), items.size() );
+        // Установившийся режим: кэш полон, каждый set() вытесняет, а куча не нужна -
+        // ни upstream пула, ни глобальная (строки короткие, без своего буфера)
+        T_CHECK_EQUAL( counting.allocations.load(), 1 );
+        size_t before = t_allocations;
+        for( int i = 100; i < 10000; ++i )
+        {
+            cache.set( i, std::to_string( i ) );
+            if( !cache.get( i ).has_value() )
+                T_ERROR( "dont find element from cache!" );
+        }
+        T_CHECK_EQUAL( counting.allocations.load(), 1 );
+        T_CHECK_EQUAL( t_allocations - before, size_t( 0 ) );
+        T_CHECK_EQUAL( cache.size(), 100 );
+        kept = cache.get_handle( 9999 );
+    }
+    // Значение пережило кэш, пул вместе с slab освобождается последним значением
+    T_CHECK_EQUAL( *kept, "9999" );
+    T_CHECK_EQUAL( counting.deallocations.load(), 0 );
+    kept.reset();
+    T_CHECK_EQUAL( counting.deallocations.load(), 1 );
+
+    // Больше значений, чем блоков в пуле, - лишние берутся из upstream
+    counting.allocations = 0;
+    counting.deallocations = 0;
+    {
+        SlabPool pool( 4, &counting );
+        CacheOptions options;
+        options.resource = &pool;
+        TimedCache< int, std::string > cache( 10, std::chrono::seconds( 10000 ), options );
+        for( int i = 0; i < 10; ++i )
+            cache.set( i, std::to_string( i ) );
+        T_CHECK_EQUAL( pool.used(), 10 );
+        T_CHECK_EQUAL( counting.allocations.load(), 7 );
+        cache.clear();
+        T_CHECK_EQUAL( pool.used(), 0 );
+        T_CHECK_EQUAL( counting.deallocations.load(), 6 );
+    }
+    T_CHECK_EQUAL( counting.deallocations.load(), 7 );
+
+    // Длинное значение со своим буфером: std::pmr::string получает тот же memory_resource,
+    // и мимо него в глобальную кучу set() ничего не выделяет
+    counting.allocations = 0;
+    counting.deallocations = 0;
+    {
+        CacheOptions options;
+        options.resource = &counting;
+        options.expiry = ExpiryMode::Lazy;
+        TimedCache< int, std::pmr::string > cache( 10, std::chrono::seconds( 10000 ), options );
+        const std::pmr::string value( 100, 'v' );
+        size_t before = t_allocations;
+        for( int i = 0; i < 100; ++i )
+            cache.set( i, value );
+        // Блок значения и буфер строки
+        T_CHECK_EQUAL( counting.allocations.load(), 200 );
+        // Вся глобальная куча - это upstream счетчика (new_delete_resource)
+        T_CHECK_EQUAL( t_allocations - before, counting.allocations.load() );
+        T_CHECK_EQUAL( *cache.get_handle( 99 ), value );
+    }
+    T_CHECK_EQUAL( counting.deallocations.load(), 200 );
+}
+
+void test_weighted_size()
+{
+    std::cout << __func__ << std::endl;
+    CacheOptions options;
+    options.maxWeight = 1000;
+    TimedCache< int, std::string > cache( 100, std::chrono::seconds( 10000 ), options );
+    const std::string big( 300, 'x' );
+
+    // Вес - ключ плюс capacity() значения, помещаются только три значения по 300 байт
+    for( int i = 0; i < 5; ++i )
+        cache.set( i, big );
+    T_CHECK_EQUAL( cache.size(), 3 );
+    CacheWeigher< int, std::string > weigher;
+    T_CHECK_EQUAL( cache.weighted_size(), 3 * weigher( 0, *cache.get_handle( 4 ) ) );
+    if( cache.get( 0 ).has_value() || cache.get( 1 ).has_value() || !cache.get( 2 ).has_value() )
+        T_ERROR( "weighted eviction order is wrong" );
+    if( cache.weighted_size() > 1000 )
+        T_ERROR( "weighted size is over budget" );
+
+    // Маленькие значения: помещается больше, пока хватает бюджета
+    size_t small = weigher( 0, std::string( "v" ) );
+    for( int i = 100; i < 300; ++i )
+        cache.set( i, "v" );
+    T_CHECK_EQUAL( cache.size(), std::min< size_t >( 100, 1000 / small ) );
+    T_CHECK_EQUAL( cache.weighted_size(), cache.size() * small );
+
+    // Замена на тяжелое значение вытесняет старые, но не сам объект
+    cache.set( 299, std::string( 900, 'y' ) );
+    T_CHECK_EQUAL( cache.get( 299 ).value().size(), 900 );
+    if( cache.weighted_size() > 1000 )
+        T_ERROR( "weighted size is over budget" );
+
+    // Тяжелее всего бюджета - не сохраняется, старое значение удаляется
+    cache.set( 299, std::string( 2000, 'z' ) );
+    if( cache.get( 299 ).has_value() )
+        T_ERROR( "find element heavier than cache" );
+    cache.clear();
+    T_CHECK_EQUAL( cache.weighted_size(), 0 );
+
+    // Бюджет делится между сегментами
+    options.maxWeight = 4000;
+    ShardedTimedCache< int, std::string > sharded( 100, std::chrono::seconds( 10000 ), 4, options );
+    std::vector< std::pair< int, std::string > > items;
+    for( int i = 0; i < 50; ++i )
+        items.emplace_back( i, big );
+    sharded.multi_set( items.data(), items.size() );
+    if( sharded.weighted_size() > 4000 || sharded.size() == 0 )
+        T_ERROR( "sharded weighted size is wrong" );
+}
+
+void test_tiny_lfu()
+{
+    std::cout << __func__ << std::endl;
+    FrequencySketch sketch( 100 );
+    for( int i = 0; i < 10; ++i )
+        sketch.increment( 1 );
+    sketch.increment( 2 );
+    T_CHECK_EQUAL( sketch.frequency( 3 ), 0 );
+    // Первое обращение - только в doorkeeper
+    T_CHECK_EQUAL( sketch.frequency( 2 ), 1 );
+    if( sketch.frequency( 1 ) < 10 )
+        T_ERROR( "sketch underestimates frequency" );
+    // Старение: после 10 * capacity обращений частоты делятся пополам
+    for( size_t i = 0; i < 1000; ++i )
+        sketch.increment( 1000 + i );
+    if( sketch.frequency( 1 ) > 6 )
+        T_ERROR( "sketch is not aged" );
+
+    CacheOptions options;
+    options.admission = Admission::TinyLfu;
+    TimedCache< int, std::string > cache( 10, std::chrono::seconds( 10000 ), options );
+    TimedCache< int, std::string > lru( 10, std::chrono::seconds( 10000 ) );
+    for( int round = 0; round < 3; ++round )
+    {
+        for( int i = 0; i < 10; ++i )
+        {
+            for( auto c : { &cache, &lru } )
+            {
+                if( !c->get( i ).has_value() )
+                    c->set( i, std::to_string( i ) );
+            }
+        }
+    }
+    // Разовый проход по 100 ключам
+    for( int i = 100; i < 200; ++i )
+    {
+        for( auto c : { &cache, &lru } )
+        {
+            if( !c->get( i ).has_value() )
+                c->set( i, std::to_string( i ) );
+        }
+    }
+    int hits = 0;
+    int lruHits = 0;
+    for( int i = 0; i < 10; ++i )
+    {
+        hits += cache.get( i ).has_value() ? 1 : 0;
+        lruHits += lru.get( i ).has_value() ? 1 : 0;
+    }
+    T_CHECK_EQUAL( hits, 10 );
+    T_CHECK_EQUAL( lruHits, 0 );
+    T_CHECK_EQUAL( cache.size(), 10 );
+
+    // "Протухший" самый старый вытесняется и без допуска
+    TimedCache< int, std::string > shortLived( 2, std::chrono::milliseconds( 50 ), options );
+    shortLived.set( 1, "1" );
+    shortLived.set( 2, "2" );
+    std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) );
+    shortLived.set( 3, "3" );
+    T_CHECK_EQUAL( shortLived.get( 3 ).value(), "3" );
+}
+
+void test_get_or_load()
+{
+    std::cout << __func__ << std::endl;
+    TimedCache< int, std::string > cache( 100, std::chrono::seconds( 10000 ) );
+    std::atomic< int > loads{ 0 };
+    auto slowLoader = [&]( int key )
+    {
+        ++loads;
+        std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) );
+        return std::to_string( key );
+    };
+
+    // Одновременные промахи по одному ключу - одна загрузка
+    std::atomic_bool failed{ false };
+    std::vector< std::thread > threads;
+    for( int t = 0; t < 8; ++t )
+    {
+        threads.emplace_back( [&]()
+        {
+            auto value = cache.get_or_load( 7, slowLoader );
+            failed = failed || !value || *value != "7";
+        } );
+    }
+    for( auto& thread : threads )
+        thread.join();
+    threads.clear();
+    if( failed )
+        T_ERROR( "get_or_load returns wrong value" );
+    T_CHECK_EQUAL( loads.load(), 1 );
+    T_CHECK_EQUAL( cache.get( 7 ).value(), "7" );
+    // Попадание загрузчик не вызывает
+    T_CHECK_EQUAL( *cache.get_or_load( 7, slowLoader ), "7" );
+    T_CHECK_EQUAL( loads.load(), 1 );
+
+    // Исключение получают все ожидающие, в кэш оно не попадает
+    std::atomic< int > errors{ 0 };
+    loads = 0;
+    auto failingLoader = [&]( int ) -> std::string
+    {
+        ++loads;
+        std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) );
+        throw std::runtime_error( "backend is down" );
+    };
+    for( int t = 0; t < 8; ++t )
+    {
+        threads.emplace_back( [&]()
+        {
+            try
+            {
+                cache.get_or_load( 8, failingLoader );
+            }
+            catch( const std::runtime_error& )
+            {
+                ++errors;
+            }
+        } );
+    }
+    for( auto& thread : threads )
+        thread.join();
+    T_CHECK_EQUAL( errors.load(), 8 );
+    T_CHECK_EQUAL( loads.load(), 1 );
+    if( cache.get( 8 ).has_value() )
+        T_ERROR( "failed load is cached" );
+    // Следующий вызов загружает заново
+    T_CHECK_EQUAL( *cache.get_or_load( 8, slowLoader ), "8" );
+    T_CHECK_EQUAL( loads.load(), 2 );
+
+    ShardedTimedCache< int, std::string > sharded( 100, std::chrono::seconds( 10000 ), 4 );
+    T_CHECK_EQUAL( *sharded.get_or_load( 9, slowLoader ), "9" );
+    T_CHECK_EQUAL( sharded.get( 9 ).value(), "9" );
+}
+
+void test_refresh_ahead()
+{
+    std::cout << __func__ << std::endl;
+    BoundedExecutor executor( 1, 16 );
+    CacheOptions options;
+    options.refreshAhead = 0.5;
+    options.executor = &executor;
+    TimedCache< int, int > cache( 10, std::chrono::milliseconds( 400 ), options );
+    std::atomic< int > version{ 1 };
+    std::atomic< int > loads{ 0 };
+    auto loader = [&]( int ) { ++loads; return version.load(); };
+
+    T_CHECK_EQUAL( *cache.get_or_load( 1, loader ), 1 );
+    // До окна обновления загрузчик не вызывается
+    T_CHECK_EQUAL( *cache.get_or_load( 1, loader ), 1 );
+    T_CHECK_EQUAL( loads.load(), 1 );
+
+    // В окне: сразу старое значение, новое загружается в фоне
+    std::this_thread::sleep_for( std::chrono::milliseconds( 250 ) );
+    version = 2;
+    T_CHECK_EQUAL( *cache.get_or_load( 1, loader ), 1 );
+    std::this_thread::sleep_for( std::chrono::milliseconds( 50 ) );
+    T_CHECK_EQUAL( loads.load(), 2 );
+    T_CHECK_EQUAL( cache.get( 1 ).value(), 2 );
+
+    // Окно после перезагрузки считается заново: до него загрузчик не вызывается
+    std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) );
+    T_CHECK_EQUAL( *cache.get_or_load( 1, loader ), 2 );
+    T_CHECK_EQUAL( loads.load(), 2 );
+}
+
+void test_stale_grace()
+{
+    std::cout << __func__ << std::endl;
+    CacheOptions options;
+    options.staleGrace = std::chrono::seconds( 1 );
+    TimedCache< int, std::string > cache( 10, std::chrono::milliseconds( 100 ), options );
+    bool fail = false;
+    auto loader = [&]( int key ) -> std::string
+    {
+        if( fail )
+            throw std::runtime_error( "backend is down" );
+        return std::to_string( key );
+    };
+
+    T_CHECK_EQUAL( *cache.get_or_load( 1, loader ), "1" );
+    std::this_thread::sleep_for( std::chrono::milliseconds( 150 ) );
+    // Срок прошел: get() объект не видит, но при отказе источника он еще отдается
+    if( cache.get( 1 ).has_value() )
+        T_ERROR( "expired object is visible" );
+    fail = true;
+    T_CHECK_EQUAL( *cache.get_or_load( 1, loader ), "1" );
+    // Без старого значения исключение доходит до вызывающего
+    bool thrown = false;
+    try
+    {
+        cache.get_or_load( 2, loader );
+    }
+    catch( const std::runtime_error& )
+    {
+        thrown = true;
+    }
+    if( !thrown )
+        T_ERROR( "loader error is lost" );
+    // Удачная загрузка заменяет старое значение
+    fail = false;
+    T_CHECK_EQUAL( *cache.get_or_load( 1, loader ), "1" );
+    T_CHECK_EQUAL( cache.get( 1 ).value(), "1" );
+    T_CHECK_EQUAL( cache.size(), size_t( 1 ) );
+}
+
+void test_latency_histogram()
+{
+    std::cout << __func__ << std::endl;
+    LatencyHistogram first;
+    LatencyHistogram second;
+    // Малые значения хранятся точно
+    for( uint64_t v = 1; v <= 20; ++v )
+        first.record( v );
+    T_CHECK_EQUAL( first.percentile( 0.5 ), uint64_t( 10 ) );
+    T_CHECK_EQUAL( first.max(), uint64_t( 20 ) );
+
+    // Большие - с относительной погрешностью не больше 1 / subBuckets
+    for( uint64_t v = 1; v <= 100000; ++v )
+        second.record( v * 1000 );
+    for( double q : { 0.5, 0.99, 0.999 } )
+    {
+        double expected = q * 100000 * 1000;
+        double error = std::abs( double( second.percentile( q ) ) - expected ) / expected;
+        if( error > 1.0 / LatencyHistogram::subBuckets )
+            T_ERROR( "percentile is out of precision" );
+    }
+    T_CHECK_EQUAL( second.percentile( 1.0 ), uint64_t( 100000000 ) );
+
+    // Сложение гистограмм потоков
+    first.merge( second );
+    T_CHECK_EQUAL( first.count(), uint64_t( 100020 ) );
+    T_CHECK_EQUAL( first.max(), uint64_t( 100000000 ) );
+    T_CHECK_EQUAL( first.percentile( 0.0001 ), uint64_t( 10 ) );
+}
+
+void test_workload()
+{
+    std::cout << __func__ << std::endl;
+    const size_t size = 1000;
+    for( const Workload& workload : { Workload::uniform(), Workload::zipf( 0.99 ), Workload::hotspot( 0.1, 0.9 ),
+        Workload::scan(), Workload::scanZipf( 0.99, 0.3 ), Workload::shifting( 0.99, 1000 ) } )
+    {
+        // Одинаковый seed - одинаковая последовательность
+        KeyStream first( workload, size, 7 );
+        KeyStream second( workload, size, 7 );
+        std::vector< size_t > counts( size );
+        size_t beyond = 0;
+        for( size_t i = 0; i < 100000; ++i )
+        {
+            size_t key = first();
+            T_CHECK_EQUAL( key, second() );
+            if( key < size )
+                ++counts[key];
+            else
+                ++beyond;
+        }
+        switch( workload.kind )
+        {
+        case Workload::Kind::Zipf:
+        {
+            // p( 1 ) = 1 / H( 1000, 0.99 ), около 0.13
+            double top = double( counts[0] ) / 100000;
+            if( top < 0.11 || top > 0.15 || counts[0] < counts[9] * 5 )
+                T_ERROR( "zipf is out of distribution" );
+            break;
+        }
+        case Workload::Kind::Hotspot:
+        {
+            size_t hot = std::accumulate( counts.begin(), counts.begin() + 100, size_t( 0 ) );
+            if( hot < 88000 || hot > 92000 )
+                T_ERROR( "hotspot is out of distribution" );
+            break;
+        }
+        case Workload::Kind::Scan:
+            for( size_t c : counts )
+                T_CHECK_EQUAL( c, size_t( 100 ) );
+            break;
+        case Workload::Kind::ScanZipf:
+            // Ключи прохода не повторяются и лежат за диапазоном
+            if( beyond < 28000 || beyond > 32000 )
+                T_ERROR( "scan share is wrong" );
+            break;
+        case Workload::Kind::Shifting:
+            // Популярный ключ сдвигается, поэтому обращения размазаны сильнее, чем у Zipf
+            if( counts[0] > 100000 / 20 )
+                T_ERROR( "working set doesn't shift" );
+            break;
+        default:
+            break;
+        }
+        if( workload.kind != Workload::Kind::ScanZipf )
+            T_CHECK_EQUAL( beyond, size_t( 0 ) );
+    }
+}
+
+void test_trace()
+{
+    std::cout << __func__ << std::endl;
+    std::string path = ( std::filesystem::temp_directory_path() / "timed_cache_test.trace" ).string();
+    std::vector< TraceRecord > records;
+    // Ключ 1 читается каждые 50 ms, ключ 2 - через 300 ms после записи
+    records.emplace_back( 0, 2, TraceOp::Set );
+    for( uint64_t t = 0; t <= 400; t += 50 )
+        records.emplace_back( t * 1000000, 1, TraceOp::Get );
+    records.emplace_back( 300 * 1000000, 2, TraceOp::Get );
+    WriteTrace( path, records.data(), records.size() );
+
+    size_t hits = 0;
+    {
+        TraceFile trace( path );
+        T_CHECK_EQUAL( trace.size(), records.size() );
+        T_CHECK_EQUAL( trace[1].key, uint64_t( 1 ) );
+        T_CHECK_EQUAL( trace[0].op() == TraceOp::Set, true );
+        T_CHECK_EQUAL( trace[records.size() - 1].time(), uint64_t( 300000000 ) );
+
+        // Время кэша задает трасса
+        CacheOptions options;
+        options.expiry = ExpiryMode::Lazy;
+        TimedCache< uint64_t, int, ManualClock > cache( 10, std::chrono::milliseconds( 100 ), options );
+        auto start = ManualClock::now();
+        for( const TraceRecord& record : trace )
+        {
+            ManualClock::set( start + std::chrono::nanoseconds( record.time() ) );
+            if( record.op() == TraceOp::Set )
+                cache.set( record.key, 0 );
+            else if( cache.get( record.key ) )
+                ++hits;
+            else
+                cache.set( record.key, 0 );
+        }
+    }
+    std::remove( path.c_str() );
+    // Ключ 1: промах и 8 попаданий, ключ 2 устарел
+    T_CHECK_EQUAL( hits, size_t( 8 ) );
+
+    bool thrown = false;
+    try
+    {
+        TraceFile missing( path );
+    }
+    catch( const std::runtime_error& )
+    {
+        thrown = true;
+    }
+    if( !thrown )
+        T_ERROR( "missing trace is opened" );
+}
+
+void test_stats()
+{
+    std::cout << __func__ << std::endl;
+    {
+        // Без статистики - нули
+        TimedCache< int, int > cache( 2, std::chrono::seconds( 10000 ) );
+        cache.set( 1, 1 );
+        cache.get( 1 );
+        T_CHECK_EQUAL( cache.stats().hits, uint64_t( 0 ) );
+    }
+    {
+        TimedCache< int, int, PreciseClock, CacheStats > cache( 2, std::chrono::milliseconds( 100 ) );
+        cache.set( 1, 1 );
+        cache.set( 2, 2 );
+        cache.get( 1 );
+        cache.get( 3 );
+        // Вытесняет 2: к 1 обращались позже
+        cache.set( 3, 3 );
+        auto stats = cache.stats();
+        T_CHECK_EQUAL( stats.hits, uint64_t( 1 ) );
+        T_CHECK_EQUAL( stats.misses, uint64_t( 1 ) );
+        T_CHECK_EQUAL( stats.evictions, uint64_t( 1 ) );
+        T_CHECK_EQUAL( stats.expirations, uint64_t( 0 ) );
+        T_CHECK_EQUAL( stats.hitRate(), 0.5 );
+
+        // Фоновая чистка
+        std::this_thread::sleep_for( std::chrono::milliseconds( 300 ) );
+        stats = cache.stats();
+        T_CHECK_EQUAL( cache.size(), size_t( 0 ) );
+        T_CHECK_EQUAL( stats.expirations, uint64_t( 2 ) );
+        if( stats.sweeps == 0 )
+            T_ERROR( "sweeps aren't counted" );
+        T_CHECK_EQUAL( stats.lockHold.count(), uint64_t( 0 ) );
+    }
+    {
+        CacheOptions options;
+        options.admission = Admission::TinyLfu;
+        TimedCache< int, int, PreciseClock, DetailedCacheStats > cache( 1, std::chrono::seconds( 10000 ), options );
+        cache.set( 1, 1 );
+        for( int i = 0; i < 5; ++i )
+            cache.get( 1 );
+        cache.set( 2, 2 );
+        auto stats = cache.stats();
+        T_CHECK_EQUAL( stats.rejections, uint64_t( 1 ) );
+        T_CHECK_EQUAL( stats.hits, uint64_t( 5 ) );
+        // Каждая исключительная блокировка до вызова stats()
+        T_CHECK_EQUAL( stats.lockHold.count(), uint64_t( 7 ) );
+    }
+    {
+        // Несколько потоков под блокировкой чтения, счетчики сегментов складываются
+        CacheOptions options;
+        options.readBuffer = true;
+        ShardedTimedCache< int, int, PreciseClock, CacheStats > cache( 1000, std::chrono::seconds( 10000 ), 4, options );
+        for( int i = 0; i < 100; ++i )
+            cache.set( i, i );
+        std::vector< std::thread > threads;
+        for( int t = 0; t < 4; ++t )
+        {
+            threads.emplace_back( [&]()
+            {
+                for( int i = 0; i < 10000; ++i )
+                    cache.get( i % 200 );
+            } );
+        }
+        for( auto& thread : threads )
+            thread.join();
+        auto stats = cache.stats();
+        T_CHECK_EQUAL( stats.hits, uint64_t( 20000 ) );
+        T_CHECK_EQUAL( stats.misses, uint64_t( 20000 ) );
+    }
+}
+
+void test_snapshot()
+{
+    std::cout << __func__ << std::endl;
+    std::string path = ( std::filesystem::temp_directory_path() / "timed_cache_test.snapshot" ).string();
+    {
+        TimedCache< int, std::string > cache( 10, std::chrono::milliseconds( 400 ) );
+        for( int i = 1; i <= 5; ++i )
+            cache.set( i, std::string( size_t( i ) * 10, char( '0' + i ) ) );
+        std::this_thread::sleep_for( std::chrono::milliseconds( 200 ) );
+        // 1 - самый свежий, у остальных осталось около 200 ms
+        cache.get( 1 );
+        T_CHECK_EQUAL( cache.save_snapshot( path ), size_t( 5 ) );
+    }
+    {
+        // Емкость 4: из снимка загружаются самые свежие
+        TimedCache< int, std::string > cache( 4, std::chrono::milliseconds( 400 ) );
+        T_CHECK_EQUAL( cache.load_snapshot( path ), size_t( 4 ) );
+        T_CHECK_EQUAL( cache.size(), size_t( 4 ) );
+        if( cache.get( 2 ).has_value() )
+            T_ERROR( "the oldest object is loaded" );
+        T_CHECK_EQUAL( cache.get( 5 ).value(), std::string( 50, '5' ) );
+        // Порядок давности сохранен: новый объект вытесняет 3
+        cache.set( 6, "6" );
+        if( cache.get( 3 ).has_value() )
+            T_ERROR( "recency order is lost" );
+        // Остаток жизни сохранен: 4 не читали, он "протухнет" раньше 1
+        std::this_thread::sleep_for( std::chrono::milliseconds( 300 ) );
+        if( cache.get( 4 ).has_value() )
+            T_ERROR( "remaining time isn't kept" );
+        T_CHECK_EQUAL( cache.get( 1 ).value(), std::string( 10, '1' ) );
+    }
+    {
+        // Уже лежащие объекты не заменяются
+        TimedCache< int, std::string > cache( 10, std::chrono::seconds( 10000 ) );
+        cache.set( 1, "live" );
+        T_CHECK_EQUAL( cache.load_snapshot( path ), size_t( 4 ) );
+        T_CHECK_EQUAL( cache.get( 1 ).value(), "live" );
+        T_CHECK_EQUAL( cache.size(), size_t( 5 ) );
+    }
+    {
+        // Обрезанный снимок
+        std::filesystem::resize_file( path, std::filesystem::file_size( path ) - 1 );
+        TimedCache< int, std::string > cache( 10, std::chrono::seconds( 10000 ) );
+        bool thrown = false;
+        try
+        {
+            cache.load_snapshot( path );
+        }
+        catch( const std::runtime_error& )
+        {
+            thrown = true;
+        }
+        if( !thrown )
+            T_ERROR( "truncated snapshot is loaded" );
+        T_CHECK_EQUAL( cache.size(), size_t( 0 ) );
+    }
+    std::remove( path.c_str() );
+}
+
+void test_move_and_emplace()
+{
+    std::cout << __func__ << std::endl;
+    // Без фонового потока: планировщик сам выделяет память
+    CacheOptions options;
+    options.expiry = ExpiryMode::Lazy;
+    TimedCache< std::string, std::string > cache( 10, std::chrono::seconds( 10000 ), options );
+    // Длиннее буфера короткой строки, чтобы каждая копия выделяла память
+    const std::string key1( 100, '1' );
+    const std::string value( 100, 'v' );
+
+    // Копии ключа и значения плюс блок значения со счетчиком ссылок
+    size_t before = t_allocations;
+    cache.set( key1, value );
+    T_CHECK_EQUAL( t_allocations - before, size_t( 3 ) );
+
+    // Перемещение: только блок значения
+    std::string key2( 100, '2' );
+    std::string value2( 100, 'w' );
+    before = t_allocations;
+    cache.set( std::move( key2 ), std::move( value2 ) );
+    T_CHECK_EQUAL( t_allocations - before, size_t( 1 ) );
+
+    // Замена: ключ уже хранится, не копируется
+    before = t_allocations;
+    cache.set( key1, std::string( value ) );
+    T_CHECK_EQUAL( t_allocations - before, size_t( 2 ) );
+
+    // emplace: значение строится на месте, плюс буфер самой строки
+    before = t_allocations;
+    cache.emplace( std::string( 100, '3' ), size_t( 100 ), 'x' );
+    T_CHECK_EQUAL( t_allocations - before, size_t( 3 ) );
+    T_CHECK_EQUAL( cache.get( std::string( 100, '3' ) ).value(), std::string( 100, 'x' ) );
+
+    // try_emplace по существующему ключу не трогает аргументы и не выделяет память
+    std::string arg( 100, 'a' );
+    before = t_allocations;
+    T_CHECK_EQUAL( cache.try_emplace( key1, std::move( arg ) ), false );
+    T_CHECK_EQUAL( t_allocations - before, size_t( 0 ) );
+    T_CHECK_EQUAL( arg.size(), size_t( 100 ) );
+    T_CHECK_EQUAL( cache.get( key1 ).value(), value );
+    T_CHECK_EQUAL( cache.try_emplace( std::string( 100, '4' ), std::move( arg ) ), true );
+    T_CHECK_EQUAL( cache.get( std::string( 100, '4' ) ).value(), std::string( 100, 'a' ) );
+
+    // Разнородный поиск без временной строки
+    std::string_view view( key1 );
+    before = t_allocations;
+    auto h = cache.get_handle( view );
+    T_CHECK_EQUAL( t_allocations - before, size_t( 0 ) );
+    if( !h || *h != std::string( value ) )
+        T_ERROR( "string_view lookup failed" );
+    cache.set( "short", "s" );
+    before = t_allocations;
+    bool found = cache.get_with( "short", []( const std::string& v ) { if( v != "s" ) throw std::runtime_error( "wrong value" ); } );
+    T_CHECK_EQUAL( found, true );
+    T_CHECK_EQUAL( t_allocations - before, size_t( 0 ) );
+    if( cache.get( std::string_view( "missing" ) ).has_value() )
+        T_ERROR( "missing key is found" );
+
+    ShardedTimedCache< std::string, std::string > sharded( 100, std::chrono::seconds( 10000 ), 4, options );
+    sharded.emplace( key1, size_t( 5 ), 'z' );
+    T_CHECK_EQUAL( sharded.try_emplace( key1, "other" ), false );
+    before = t_allocations;
+    h = sharded.get_handle( view );
+    T_CHECK_EQUAL( t_allocations - before, size_t( 0 ) );
+    T_CHECK_EQUAL( *h, "zzzzz" );
+}
+
+void test_policies()
+{
+    std::cout << __func__ << std::endl;
+    using Local = TimedCache< int, std::string, ManualClock, NoStats, SingleThreadedPolicy >;
+    using Fifo = TimedCache< int, std::string, ManualClock, NoStats, CachePolicy< NoLocking, LazyExpiry, FifoEviction > >;
+    using Lru = TimedCache< int, std::string, ManualClock, NoStats, CachePolicy< NoLocking, NoExpiry > >;
+    // Без блокировки в кэше нет ни мьютекса, ни его полос
+    if( sizeof( Local ) >= sizeof( TimedCache< int, std::string > ) )
+        T_ERROR( "single-threaded cache still has a lock" );
+
+    // Ленивое удаление: срок от обращения
+    Local local( 3, std::chrono::milliseconds( 100 ) );
+    local.set( 1, "1" );
+    local.set( 2, "2" );
+    ManualClock::advance( std::chrono::milliseconds( 60 ) );
+    T_CHECK_EQUAL( local.get( 1 ).value(), "1" );
+    ManualClock::advance( std::chrono::milliseconds( 60 ) );
+    T_CHECK_EQUAL( local.get( 1 ).value(), "1" );
+    if( local.get( 2 ).has_value() )
+        T_ERROR( "expired object is visible" );
+    local.set( 3, "3" );
+    local.set( 4, "4" );
+    T_CHECK_EQUAL( local.size(), size_t( 3 ) );
+
+    // FIFO: попадание не продлевает жизнь и не спасает от вытеснения
+    Fifo fifo( 3, std::chrono::milliseconds( 100 ) );
+    fifo.set( 1, "1" );
+    fifo.set( 2, "2" );
+    fifo.set( 3, "3" );
+    T_CHECK_EQUAL( fifo.get( 1 ).value(), "1" );
+    fifo.set( 4, "4" );
+    if( fifo.get( 1 ).has_value() )
+        T_ERROR( "fifo evicted wrong object" );
+    T_CHECK_EQUAL( fifo.get( 2 ).value(), "2" );
+    ManualClock::advance( std::chrono::milliseconds( 60 ) );
+    T_CHECK_EQUAL( fifo.get( 2 ).value(), "2" );
+    ManualClock::advance( std::chrono::milliseconds( 60 ) );
+    if( fifo.get( 2 ).has_value() )
+        T_ERROR( "fifo object lives after write time" );
+
+    // Без срока жизни: чистый LRU
+    Lru lru( 3, std::chrono::milliseconds( 1 ) );
+    lru.set( 1, "1" );
+    lru.set( 2, "2" );
+    lru.set( 3, "3" );
+    ManualClock::advance( std::chrono::seconds( 1000 ) );
+    T_CHECK_EQUAL( lru.get( 1 ).value(), "1" );
+    lru.set( 4, "4" );
+    if( lru.get( 2 ).has_value() )
+        T_ERROR( "lru evicted wrong object" );
+    T_CHECK_EQUAL( lru.get( 3 ).value(), "3" );
+    T_CHECK_EQUAL( lru.size(), size_t( 3 ) );
+
+    // Чтение под блокировкой чтения без CacheOptions::readBuffer и сегменты с политикой
+    TimedCache< int, int, PreciseClock, NoStats, CachePolicy< SharedLocking > > shared( 100, std::chrono::seconds( 10000 ) );
+    ShardedTimedCache< int, int, PreciseClock, NoStats, CachePolicy< MutexLocking, LazyExpiry > > sharded( 1000, std::chrono::seconds( 10000 ), 4 );
+    std::vector< std::thread > threads;
+    for( int t = 0; t < 4; ++t )
+    {
+        threads.emplace_back( [&, t]()
+        {
+            for( int i = 0; i < 1000; ++i )
+            {
+                int key = ( i * 7 + t ) % 50;
+                shared.set( key, key );
+                sharded.set( key, key );
+                auto a = shared.get( key );
+                auto b = sharded.get( key );
+                if( ( a && *a != key ) || ( b && *b != key ) )
+                    throw std::runtime_error( "wrong value" );
+            }
+        } );
+    }
+    for( auto& thread : threads )
+        thread.join();
+    T_CHECK_EQUAL( shared.size(), size_t( 50 ) );
+    T_CHECK_EQUAL( sharded.size(), size_t( 50 ) );
+}
+
+// Значение, которое при разрушении обращается к своему кэшу. Под блокировкой кэша это была бы взаимоблокировка.
+struct ReentrantValue
+{
+    explicit ReentrantValue( std::function< void() > fn )
+        : onDestroy( std::move( fn ) )
+    {
+    }
+    ~ReentrantValue()
+    {
+        if( onDestroy )
+            onDestroy();
+    }
+    std::function< void() > onDestroy;
+};
+
+void test_sweep_batch()
+{
+    std::cout << __func__ << std::endl;
+    for( auto tick : { std::chrono::milliseconds( 0 ), std::chrono::milliseconds( 5 ) } )
+    {
+        ExpirationService service;
+        CacheOptions options;
+        options.service = &service;
+        options.wheelTick = tick;
+        options.sweepBatch = 100;
+        using Cache = TimedCache< int, ReentrantValue, PreciseClock, CacheStats >;
+        Cache cache( 10000, std::chrono::milliseconds( 50 ), options );
+        std::atomic< size_t > destroyed{ 0 };
+        for( int i = 0; i < 5000; ++i )
+            cache.emplace( i, [&]() { cache.get_handle( -1 ); ++destroyed; } );
+
+        std::this_thread::sleep_for( std::chrono::milliseconds( 500 ) );
+        T_CHECK_EQUAL( cache.size(), size_t( 0 ) );
+        T_CHECK_EQUAL( destroyed.load(), size_t( 5000 ) );
+        auto stats = cache.stats();
+        T_CHECK_EQUAL( stats.expirations, uint64_t( 5000 ) );
+        // Не меньше 50 блокировок по 100 объектов
+        if( stats.sweeps < 50 )
+            T_ERROR( "sweep isn't split into batches" );
+    }
+    // Со слушателем значения уходят в его очередь, а не в retired: бюджет прохода тот же
+    for( auto tick : { std::chrono::milliseconds( 0 ), std::chrono::milliseconds( 5 ) } )
+    {
+        std::atomic< size_t > removed{ 0 };
+        RemovalListener< int, std::string > listener( [&]( const int&, const std::shared_ptr< const std::string >&, RemovalCause )
+        {
+            ++removed;
+        }, 8192 );
+        ExpirationService service;
+        CacheOptions options;
+        options.service = &service;
+        options.wheelTick = tick;
+        options.sweepBatch = 100;
+        using Cache = TimedCache< int, std::string, PreciseClock, CacheStats >;
+        Cache cache( 10000, std::chrono::milliseconds( 50 ), options );
+        cache.set_removal_listener( &listener );
+        for( int i = 0; i < 5000; ++i )
+            cache.set( i, std::to_string( i ) );
+
+        std::this_thread::sleep_for( std::chrono::milliseconds( 500 ) );
+        listener.flush();
+        T_CHECK_EQUAL( cache.size(), size_t( 0 ) );
+        T_CHECK_EQUAL( removed.load(), size_t( 5000 ) );
+        auto stats = cache.stats();
+        T_CHECK_EQUAL( stats.expirations, uint64_t( 5000 ) );
+        if( stats.sweeps < 50 )
+            T_ERROR( "sweep with a listener isn't split into batches" );
+    }
+}
+
+void test_removal_listener()
+{
+    std::cout << __func__ << std::endl;
+    using Cache = TimedCache< int, std::string >;
+    std::mutex lock;
+    std::vector< std::pair< int, RemovalCause > > events;
+    Cache* self = nullptr;
+    RemovalListener< int, std::string > listener( [&]( const int& key, const Cache::handle& value, RemovalCause cause )
+    {
+        // Обработчик вызывается без блокировки кэша и может к нему обращаться
+        self->get( key );
+        if( !value || *value != std::to_string( key ) + ( cause == RemovalCause::Replaced ? "" : "!" ) )
+            throw std::runtime_error( "wrong removed value" );
+        std::lock_guard lg( lock );
+        events.emplace_back( key, cause );
+    } );
+    {
+        Cache cache( 2, std::chrono::milliseconds( 100 ) );
+        self = &cache;
+        cache.set_removal_listener( &listener );
+        cache.set( 1, "1" );
+        cache.set( 1, "1!" );
+        cache.set( 2, "2!" );
+        cache.set( 3, "3!" );
+        T_CHECK_EQUAL( cache.erase( 2 ), true );
+        T_CHECK_EQUAL( cache.erase( 2 ), false );
+        listener.flush();
+        {
+            std::lock_guard lg( lock );
+            T_CHECK_EQUAL( events.size(), size_t( 3 ) );
+            if( events[0] != std::make_pair( 1, RemovalCause::Replaced ) || events[1] != std::make_pair( 1, RemovalCause::Capacity ) ||
+                events[2] != std::make_pair( 2, RemovalCause::Explicit ) )
+                T_ERROR( "wrong removal causes" );
+            events.clear();
+        }
+        // Удаление по времени
+        std::this_thread::sleep_for( std::chrono::milliseconds( 300 ) );
+        listener.flush();
+        {
+            std::lock_guard lg( lock );
+            T_CHECK_EQUAL( events.size(), size_t( 1 ) );
+            if( events[0] != std::make_pair( 3, RemovalCause::Expired ) )
+                T_ERROR( "expiration isn't reported" );
+        }
+    }
+
+    // Переполнение очереди: обработчик задерживается, в очереди 2 места
+    std::atomic< size_t > delivered{ 0 };
+    std::atomic< size_t > inlined{ 0 };
+    std::atomic_bool slow{ true };
+    auto mainThread = std::this_thread::get_id();
+    auto callback = [&]( const int&, const Cache::handle&, RemovalCause )
+    {
+        if( std::this_thread::get_id() == mainThread )
+            ++inlined;
+        else
+        {
+            while( slow )
+                std::this_thread::yield();
+        }
+        ++delivered;
+    };
+    for( ListenerOverflow overflow : { ListenerOverflow::Drop, ListenerOverflow::Inline } )
+    {
+        delivered = 0;
+        slow = true;
+        RemovalListener< int, std::string > small( callback, 2, overflow );
+        Cache cache( 1, std::chrono::seconds( 10000 ) );
+        cache.set_removal_listener( &small );
+        for( int i = 0; i <= 100; ++i )
+            cache.set( i, "x" );
+        slow = false;
+        small.flush();
+        if( overflow == ListenerOverflow::Drop )
+        {
+            if( small.dropped() == 0 || delivered + small.dropped() != 100 )
+                T_ERROR( "events aren't dropped" );
+        }
+        else
+        {
+            T_CHECK_EQUAL( delivered.load(), size_t( 100 ) );
+            if( inlined == 0 )
+                T_ERROR( "events aren't delivered inline" );
+        }
+    }
+    // Block: ни одно событие не теряется, сегменты пишут в одну очередь
+    delivered = 0;
+    {
+        RemovalListener< int, std::string > blocking( callback, 2, ListenerOverflow::Block );
+        ShardedTimedCache< int, std::string > sharded( 4, std::chrono::seconds( 10000 ), 4 );
+        sharded.set_removal_listener( &blocking );
+        std::vector< std::thread > threads;
+        for( int t = 0; t < 4; ++t )
+        {
+            threads.emplace_back( [&, t]()
+            {
+                for( int i = 0; i < 1000; ++i )
+                    sharded.set( t * 1000 + i, "x" );
+            } );
+        }
+        for( auto& thread : threads )
+            thread.join();
+        blocking.flush();
+    }
+    T_CHECK_EQUAL( delivered.load(), size_t( 4000 - 4 ) );
+}
+
+void test_front_cache()
+{
+    std::cout << __func__ << std::endl;
+    using Cache = TimedCache< int, std::string, ManualClock, CacheStats, CachePolicy< MutexLocking, LazyExpiry > >;
+    {
+        Cache plain( 10, std::chrono::milliseconds( 100 ) );
+        bool thrown = false;
+        try
+        {
+            FrontCache< Cache > front( plain );
+        }
+        catch( const std::invalid_argument& )
+        {
+            thrown = true;
+        }
+        if( !thrown )
+            T_ERROR( "front cache over a cache without versions" );
+    }
+    CacheOptions options;
+    options.frontCache = true;
+    Cache cache( 2, std::chrono::milliseconds( 100 ), options );
+    FrontCache< Cache > front( cache, std::chrono::seconds( 10 ) );
+    if( front.get( 1 ).has_value() )
+        T_ERROR( "empty cache hit" );
+    front.set( 1, "a" );
+    T_CHECK_EQUAL( front.get( 1 ).value(), "a" );
+    // Попадание первого уровня: без обращения к общему кэшу и без выделения памяти
+    auto sharedHits = cache.stats().hits;
+    size_t allocations = t_allocations;
+    T_CHECK_EQUAL( *front.get_handle( 1 ), "a" );
+    T_CHECK_EQUAL( t_allocations, allocations );
+    T_CHECK_EQUAL( cache.stats().hits, sharedHits );
+    T_CHECK_EQUAL( front.hits(), uint64_t( 1 ) );
+
+    // Замена и удаление в общем кэше
+    cache.set( 1, "b" );
+    T_CHECK_EQUAL( front.get( 1 ).value(), "b" );
+    cache.erase( 1 );
+    if( front.get( 1 ).has_value() )
+        T_ERROR( "erased object is visible" );
+    // Вытеснение
+    cache.set( 1, "c" );
+    T_CHECK_EQUAL( front.get( 1 ).value(), "c" );
+    cache.set( 2, "2" );
+    cache.set( 3, "3" );
+    if( front.get( 1 ).has_value() )
+        T_ERROR( "evicted object is visible" );
+    // Срок: к половине оставшегося срока объект снова берется из общего кэша и продлевается
+    T_CHECK_EQUAL( front.get( 2 ).value(), "2" );
+    ManualClock::advance( std::chrono::milliseconds( 60 ) );
+    uint64_t misses = front.misses();
+    T_CHECK_EQUAL( front.get( 2 ).value(), "2" );
+    T_CHECK_EQUAL( front.misses(), misses + 1 );
+    ManualClock::advance( std::chrono::milliseconds( 60 ) );
+    T_CHECK_EQUAL( front.get( 2 ).value(), "2" );
+    ManualClock::advance( std::chrono::milliseconds( 200 ) );
+    if( front.get( 2 ).has_value() )
+        T_ERROR( "expired object is visible" );
+
+    // Потоки со своими FrontCache над сегментами: значения ключа не идут назад,
+    // после записи все видят последнее
+    using Sharded = ShardedTimedCache< int, int >;
+    Sharded sharded( 1000, std::chrono::seconds( 10000 ), 4, options );
+    for( int k = 0; k < 100; ++k )
+        sharded.set( k, 0 );
+    std::atomic_bool stop{ false };
+    std::atomic< int > errors{ 0 };
+    std::vector< std::thread > readers;
+    for( int t = 0; t < 3; ++t )
+    {
+        readers.emplace_back( [&]()
+        {
+            FrontCache< Sharded > local( sharded );
+            std::vector< int > last( 100, 0 );
+            while( !stop )
+            {
+                for( int k = 0; k < 100; ++k )
+                {
+                    auto value = local.get_handle( k );
+                    if( !value || *value < last[k] )
+                        ++errors;
+                    else
+                        last[k] = *value;
+                }
+            }
+            for( int k = 0; k < 100; ++k )
+            {
+                auto value = local.get_handle( k );
+                if( !value || *value != 1000 )
+                    ++errors;
+            }
+        } );
+    }
+    for( int v = 1; v <= 1000; ++v )
+    {
+        for( int k = 0; k < 100; ++k )
+            sharded.set( k, v );
+    }
+    stop = true;
+    for( auto& thread : readers )
+        thread.join();
+    T_CHECK_EQUAL( errors.load(), 0 );
+}
+
+void test_two_tier()
+{
+    std::cout << __func__ << std::endl;
+    std::string path = ( std::filesystem::temp_directory_path() / "timed_cache_test.spill" ).string();
+    using Lazy = CachePolicy< MutexLocking, LazyExpiry >;
+    {
+        TwoTierCache< int, std::string, ManualClock, NoStats, Lazy > cache( 2, std::chrono::milliseconds( 100 ), path, 4096 );
+        cache.set( 1, "1" );
+        cache.set( 2, "2" );
+        cache.set( 3, "3" );
+        // 1 вытеснен на второй уровень и возвращается оттуда, вытесняя 2
+        T_CHECK_EQUAL( cache.get( 1 ).value(), "1" );
+        T_CHECK_EQUAL( cache.get( 3 ).value(), "3" );
+        TierStats stats = cache.tier_stats();
+        T_CHECK_EQUAL( stats.memoryHits, uint64_t( 1 ) );
+        T_CHECK_EQUAL( stats.spillHits, uint64_t( 1 ) );
+        T_CHECK_EQUAL( stats.demotions, uint64_t( 2 ) );
+        T_CHECK_EQUAL( stats.spillSize, size_t( 1 ) );
+        // Срок на втором уровне тот же, что был бы в памяти
+        ManualClock::advance( std::chrono::milliseconds( 120 ) );
+        if( cache.get( 2 ).has_value() )
+            T_ERROR( "expired object is returned from the spill tier" );
+        T_CHECK_EQUAL( cache.tier_stats().spillExpired, uint64_t( 1 ) );
+        // Запись и удаление забывают копию на втором уровне
+        cache.set( 4, "4" );
+        cache.set( 5, "5" );
+        cache.set( 6, "6" );
+        cache.set( 4, "4!" );
+        T_CHECK_EQUAL( cache.get( 4 ).value(), "4!" );
+        cache.set( 7, "7" );
+        cache.set( 8, "8" );
+        T_CHECK_EQUAL( cache.erase( 5 ), true );
+        if( cache.get( 5 ).has_value() )
+            T_ERROR( "erased object is returned from the spill tier" );
+        if( !std::filesystem::exists( path ) )
+            T_ERROR( "spill file isn't created" );
+    }
+    if( std::filesystem::exists( path ) )
+        T_ERROR( "spill file isn't removed" );
+
+    // Журнал по кругу: старые записи затираются, уцелевшие читаются без искажений
+    {
+        TwoTierCache< int, std::string, ManualClock, NoStats, Lazy > cache( 10, std::chrono::seconds( 1000 ), path, 1000, 32 );
+        for( int i = 0; i < 500; ++i )
+            cache.set( i, std::string( size_t( i % 37 ), char( 'a' + i % 26 ) ) );
+        size_t found = 0;
+        for( int i = 0; i < 500; ++i )
+        {
+            auto value = cache.get( i );
+            if( !value )
+                continue;
+            ++found;
+            T_CHECK_EQUAL( *value, std::string( size_t( i % 37 ), char( 'a' + i % 26 ) ) );
+        }
+        if( found < 10 || cache.tier_stats().overwritten == 0 )
+            T_ERROR( "spill log doesn't wrap around" );
+    }
+
+    // FIFO: возврат со второго уровня не продлевает срок от записи
+    {
+        TwoTierCache< int, std::string, ManualClock, NoStats, CachePolicy< MutexLocking, LazyExpiry, FifoEviction > >
+            cache( 2, std::chrono::milliseconds( 100 ), path, 4096 );
+        cache.set( 1, "1" );
+        ManualClock::advance( std::chrono::milliseconds( 10 ) );
+        cache.set( 2, "2" );
+        cache.set( 3, "3" );
+        ManualClock::advance( std::chrono::milliseconds( 60 ) );
+        T_CHECK_EQUAL( cache.get( 1 ).value(), "1" );
+        // 1 записан раньше всех и снова вытесняется первым
+        cache.set( 4, "4" );
+        T_CHECK_EQUAL( cache.memory().get( 3 ).value(), "3" );
+        T_CHECK_EQUAL( cache.get( 1 ).value(), "1" );
+        ManualClock::advance( std::chrono::milliseconds( 35 ) );
+        if( cache.get( 1 ).has_value() )
+            T_ERROR( "restored fifo object lives after write time" );
+        T_CHECK_EQUAL( cache.get( 4 ).value(), "4" );
+    }
+
+    // Обработчик вытеснений вызывается без блокировки кэша, метка снята в момент вытеснения
+    {
+        using Cache = TimedCache< int, std::string, ManualClock, NoStats, Lazy >;
+        Cache cache( 1, std::chrono::seconds( 1000 ) );
+        uint64_t current = 1;
+        std::vector< std::pair< int, uint64_t > > evicted;
+        cache.set_eviction_handler( [&]( const int& key, const Cache::handle& value, Cache::time_point, uint64_t stamp )
+        {
+            // Обращение к кэшу из обработчика не блокируется
+            cache.get_handle( key );
+            T_CHECK_EQUAL( *value, std::to_string( key ) );
+            evicted.emplace_back( key, stamp );
+            ++current;
+        },
+        [&]( size_t ) { return current; } );
+        cache.set( 1, "1" );
+        cache.set( 2, "2" );
+        cache.set( 3, "3" );
+        T_CHECK_EQUAL( evicted.size(), size_t( 2 ) );
+        if( evicted[0] != std::make_pair( 1, uint64_t( 1 ) ) || evicted[1] != std::make_pair( 2, uint64_t( 2 ) ) )
+            T_ERROR( "wrong evictions" );
+
+        // restore по живому ключу отдает значение из кэша, а не вернувшееся со второго уровня
+        auto h = cache.restore( 3, "old", Cache::now() + std::chrono::seconds( 1000 ) );
+        T_CHECK_EQUAL( *h, "3" );
+        T_CHECK_EQUAL( cache.get( 3 ).value(), "3" );
+    }
+
+    // FIFO: место вернувшегося объекта ищется не дальше restoreSteps от головы очереди
+    {
+        using Cache = TimedCache< int, int, ManualClock, NoStats, CachePolicy< MutexLocking, LazyExpiry, FifoEviction > >;
+        Cache cache( 1000, std::chrono::seconds( 1000 ) );
+        auto start = Cache::now();
+        for( int i = 0; i < 999; ++i )
+        {
+            cache.set( i, i );
+            ManualClock::advance( std::chrono::milliseconds( 1 ) );
+        }
+        // По времени записи место в середине очереди, объект встает раньше
+        T_CHECK_EQUAL( *cache.restore( -1, 0, start + std::chrono::milliseconds( 1000500 ) ), 0 );
+        T_CHECK_EQUAL( cache.size(), size_t( 1000 ) );
+        // Вытесняются сначала 64 самых старых, затем вернувшийся объект
+        for( int i = 0; i < 64; ++i )
+            cache.set( 1000 + i, i );
+        if( !cache.get( -1 ).has_value() || cache.get( 63 ).has_value() )
+            T_ERROR( "restored fifo object is out of place" );
+        cache.set( 2000, 0 );
+        if( cache.get( -1 ).has_value() )
+            T_ERROR( "restored fifo object isn't evicted" );
+        T_CHECK_EQUAL( cache.get( 64 ).value(), 64 );
+    }
+}
+
 int main()
 {
     try
     {
         test_set_get();
+        test_eviction_order();
+        test_handle();
         test_timer();
         test_update();
         test_thread_cleaner();
         test_multithreading();
+        test_sharded();
+        test_timing_wheel();
+        test_wheel_cleaner();
+        test_expiration_service();
+        test_lazy_expiry();
+        test_clocks();
+        test_multi_get_set();
+        test_read_buffer();
+        test_flat_index();
+        test_slab_pool();
+        test_weighted_size();
+        test_tiny_lfu();
+        test_get_or_load();
+        test_refresh_ahead();
+        test_stale_grace();
+        test_latency_histogram();
+        test_workload();
+        test_trace();
+        test_stats();
+        test_snapshot();
+        test_move_and_emplace();
+        test_policies();
+        test_sweep_batch();
+        test_removal_listener();
+        test_front_cache();
+        test_two_tier();
     }
     catch( const std::exception& err )
     {
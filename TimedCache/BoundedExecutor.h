@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков с ограниченной очередью для фоновых загрузок (обновление значений заранее).
+// Если очередь заполнена, задача не принимается: лучше пропустить обновление, чем копить
+// неограниченную очередь, когда источник данных не успевает.
+class BoundedExecutor
+{
+public:
+    using task = std::function< void() >;
+
+    explicit BoundedExecutor( size_t threads = 2, size_t capacity = 1024 )
+        : m_capacity( std::max< size_t >( capacity, 1 ) )
+    {
+        m_threads.reserve( std::max< size_t >( threads, 1 ) );
+        for( size_t i = 0; i < std::max< size_t >( threads, 1 ); ++i )
+            m_threads.emplace_back( &BoundedExecutor::worker, this );
+    }
+    BoundedExecutor( const BoundedExecutor& ) = delete;
+    BoundedExecutor& operator = ( const BoundedExecutor& ) = delete;
+    // Принятые задачи выполняются до конца: их могут ждать кэши
+    ~BoundedExecutor()
+    {
+        {
+            std::lock_guard lg( m_lock );
+            m_working = false;
+        }
+        m_cond.notify_all();
+        for( auto& t : m_threads )
+            t.join();
+    }
+
+    // Общий на процесс пул с двумя потоками
+    static BoundedExecutor& instance()
+    {
+        static BoundedExecutor executor;
+        return executor;
+    }
+
+    // @return false, если очередь заполнена или пул останавливается
+    bool try_submit( task fn )
+    {
+        {
+            std::lock_guard lg( m_lock );
+            if( !m_working || m_queue.size() >= m_capacity )
+                return false;
+            m_queue.push_back( std::move( fn ) );
+        }
+        m_cond.notify_one();
+        return true;
+    }
+    size_t threads() const
+    {
+        return m_threads.size();
+    }
+private:
+    void worker()
+    {
+        std::unique_lock ul( m_lock );
+        while( true )
+        {
+            m_cond.wait( ul, [this]() { return !m_queue.empty() || !m_working; } );
+            if( m_queue.empty() )
+                return;
+            task fn = std::move( m_queue.front() );
+            m_queue.pop_front();
+            ul.unlock();
+            fn();
+            ul.lock();
+        }
+    }
+
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    bool m_working = true;
+    const size_t m_capacity;
+    std::deque< task > m_queue;
+    std::vector< std::thread > m_threads;
+};
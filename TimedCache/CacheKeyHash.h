@@ -0,0 +1,45 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// Хэш ключей кэша. По умолчанию - std::hash< K >.
+// Если у хэша есть is_transparent, кэш ищет и по другим типам ключа Q, для которых
+// определены hash( q ) и K == Q, не создавая временный K.
+template< class K >
+struct CacheKeyHash
+{
+    size_t operator()( const K& key ) const
+    {
+        return std::hash< K >()( key );
+    }
+};
+
+// Строки ищутся по std::string_view и по строковым литералам. std::hash< std::string >
+// и std::hash< std::string_view > по стандарту совпадают, так что хэш тот же.
+template< class C, class Traits, class Alloc >
+struct CacheKeyHash< std::basic_string< C, Traits, Alloc > >
+{
+    using is_transparent = void;
+
+    size_t operator()( std::basic_string_view< C, Traits > key ) const
+    {
+        return std::hash< std::basic_string_view< C, Traits > >()( key );
+    }
+};
+
+template< class Hash, class = void >
+struct IsTransparentHash : std::false_type
+{
+};
+template< class Hash >
+struct IsTransparentHash< Hash, std::void_t< typename Hash::is_transparent > > : std::true_type
+{
+};
+
+// Можно ли искать ключ K по значению типа Q без преобразования в K
+template< class K, class Q >
+constexpr bool isLookupKey = !std::is_same_v< std::decay_t< Q >, K > &&
+    IsTransparentHash< CacheKeyHash< K > >::value && std::is_invocable_v< const CacheKeyHash< K >&, const Q& >;
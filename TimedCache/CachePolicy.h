@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+
+#include "ReadBuffer.h"
+
+// Политики TimedCache времени компиляции - последний параметр шаблона:
+// TimedCache< K, T, Clock, Stats, CachePolicy< Locking, Expiry, Eviction > >.
+// То, что политика не использует, в кэш не компилируется: без блокировки нет ни мьютекса,
+// ни буфера чтений, без фоновой чистки нет задачи в ExpirationService, без срока жизни
+// не читаются часы. Часы и статистика - свои параметры шаблона (Clock.h, CacheStats.h).
+
+// Мьютекс, который ничего не делает, для NoLocking
+struct NullMutex
+{
+    explicit NullMutex( bool = false ) {}
+
+    void lock() {}
+    bool try_lock()
+    {
+        return true;
+    }
+    void unlock() {}
+    size_t lock_shared()
+    {
+        return 0;
+    }
+    void unlock_shared( size_t ) {}
+};
+
+// Блокировка.
+// Без блокировки: кэш для одного потока (например, цикла событий). Фоновой чистки
+// и перезагрузок в executor (CacheOptions::refreshAhead) нет - им нужен второй поток.
+struct NoLocking
+{
+    using mutex = NullMutex;
+    static constexpr bool threadSafe = false;
+    static constexpr bool sharedReads = false;
+};
+// Исключительная блокировка на каждую операцию (ReadBiasedMutex без readBias - это std::mutex).
+// CacheOptions::readBuffer включает чтение под блокировкой чтения.
+struct MutexLocking
+{
+    using mutex = ReadBiasedMutex;
+    static constexpr bool threadSafe = true;
+    static constexpr bool sharedReads = false;
+};
+// Попадания - всегда под распределенной блокировкой чтения, как с CacheOptions::readBuffer
+struct SharedLocking
+{
+    using mutex = ReadBiasedMutex;
+    static constexpr bool threadSafe = true;
+    static constexpr bool sharedReads = true;
+};
+// Блокировка по сегментам - это ShardedTimedCache: у каждого сегмента своя блокировка
+// из политики (обычно MutexLocking или SharedLocking).
+
+// Удаление "протухших" объектов.
+// Фоновой чисткой или, с CacheOptions::expiry == ExpiryMode::Lazy, понемногу на каждом set()
+struct BackgroundExpiry
+{
+    static constexpr bool background = true;
+    static constexpr bool expires = true;
+};
+// Только понемногу на каждом set() и при обращении, CacheOptions::expiry не смотрится
+struct LazyExpiry
+{
+    static constexpr bool background = false;
+    static constexpr bool expires = true;
+};
+// Объекты не "протухают", relTime не используется, часы не читаются: чистый LRU (или FIFO)
+struct NoExpiry
+{
+    static constexpr bool background = false;
+    static constexpr bool expires = false;
+};
+
+// Порядок вытеснения.
+// LRU: попадание переносит объект в конец очереди и продлевает его жизнь (срок - от обращения)
+struct LruEviction
+{
+    static constexpr bool promote = true;
+};
+// FIFO: вытесняется самый давно записанный, срок - от записи. Попадание ничего не пишет
+// в кэш, поэтому чтение дешевле, а с буфером чтений события нужны только для TinyLfu.
+struct FifoEviction
+{
+    static constexpr bool promote = false;
+};
+
+template< class Locking = MutexLocking, class Expiry = BackgroundExpiry, class Eviction = LruEviction >
+struct CachePolicy
+{
+    using locking = Locking;
+    using expiry = Expiry;
+    using eviction = Eviction;
+
+    static_assert( Locking::threadSafe || !Expiry::background,
+        "TimedCache: background expiry needs a thread-safe locking policy, use LazyExpiry or NoExpiry" );
+};
+
+// Кэш для одного потока: без блокировок и без фонового потока
+using SingleThreadedPolicy = CachePolicy< NoLocking, LazyExpiry >;
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+// Запись ключей и значений в снимок кэша (TimedCache::save_snapshot).
+// write( out, x ) дописывает байты в out, read( p, end ) читает объект с позиции p
+// и сдвигает p, при нехватке данных бросает std::runtime_error.
+// Для своих типов специализируйте CacheSerializer, как std::hash.
+template< class X, class = void >
+struct CacheSerializer;
+
+// Тривиально копируемые типы - как есть, в порядке байт платформы
+template< class X >
+struct CacheSerializer< X, std::enable_if_t< std::is_trivially_copyable_v< X > > >
+{
+    static void write( std::string& out, const X& value )
+    {
+        out.append( reinterpret_cast< const char* >( &value ), sizeof( X ) );
+    }
+    static X read( const char*& p, const char* end )
+    {
+        if( size_t( end - p ) < sizeof( X ) )
+            throw std::runtime_error( "CacheSerializer: unexpected end of data" );
+        X value;
+        std::memcpy( &value, p, sizeof( X ) );
+        p += sizeof( X );
+        return value;
+    }
+};
+
+// Строка - длина и символы
+template<>
+struct CacheSerializer< std::string >
+{
+    static void write( std::string& out, const std::string& value )
+    {
+        CacheSerializer< uint64_t >::write( out, uint64_t( value.size() ) );
+        out.append( value );
+    }
+    static std::string read( const char*& p, const char* end )
+    {
+        uint64_t size = CacheSerializer< uint64_t >::read( p, end );
+        if( uint64_t( end - p ) < size )
+            throw std::runtime_error( "CacheSerializer: unexpected end of data" );
+        std::string value( p, size_t( size ) );
+        p += size;
+        return value;
+    }
+};
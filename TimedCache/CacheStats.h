@@ -0,0 +1,181 @@
+#pragma once
+
+#include <cstdint>
+
+#include <array>
+#include <atomic>
+
+#include "LatencyHistogram.h"
+#include "ReadBuffer.h"
+
+// Снимок статистики кэша, TimedCache::stats()
+struct CacheStatsSnapshot
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    // Вытеснены, чтобы освободить место (size или maxWeight)
+    uint64_t evictions = 0;
+    // Новый ключ не прошел допуск Admission::TinyLfu
+    uint64_t rejections = 0;
+    // Удалены по времени: фоновой чисткой, понемногу в ExpiryMode::Lazy или при обращении
+    uint64_t expirations = 0;
+    // Проходы фоновой чистки updateCached()
+    uint64_t sweeps = 0;
+    // Сколько раз исключительная блокировка оказалась занята и сколько всего ее ждали
+    uint64_t lockWaits = 0;
+    uint64_t lockWaitNs = 0;
+    // Только у DetailedCacheStats: время удержания исключительной блокировки и прохода чистки, нс
+    LatencyHistogram lockHold;
+    LatencyHistogram sweepTime;
+
+    double hitRate() const
+    {
+        return hits + misses == 0 ? 0.0 : double( hits ) / double( hits + misses );
+    }
+    CacheStatsSnapshot& operator += ( const CacheStatsSnapshot& other )
+    {
+        hits += other.hits;
+        misses += other.misses;
+        evictions += other.evictions;
+        rejections += other.rejections;
+        expirations += other.expirations;
+        sweeps += other.sweeps;
+        lockWaits += other.lockWaits;
+        lockWaitNs += other.lockWaitNs;
+        lockHold.merge( other.lockHold );
+        sweepTime.merge( other.sweepTime );
+        return *this;
+    }
+};
+
+// Политики статистики - последний параметр шаблона TimedCache.
+// NoStats - по умолчанию: все методы пустые и встраиваются в ничто, часы для замеров
+// не читаются (проверки по enabled и histograms - if constexpr).
+struct NoStats
+{
+    static constexpr bool enabled = false;
+    static constexpr bool histograms = false;
+
+    void hit() {}
+    void miss() {}
+    void eviction() {}
+    void rejection() {}
+    void expiration() {}
+    void sweep( uint64_t ) {}
+    void lockWait( uint64_t ) {}
+    void lockHold( uint64_t ) {}
+    void snapshot( CacheStatsSnapshot& ) const {}
+};
+
+// Счетчики. Каждый поток пишет в свою полосу (отдельная строка кэша процессора),
+// поэтому попадания под блокировкой чтения не пишут в общую память. Полосы складываются
+// только в snapshot(). Ожидание блокировки замеряется, только если она занята.
+class CacheStats
+{
+public:
+    static constexpr bool enabled = true;
+    static constexpr bool histograms = false;
+
+    void hit()
+    {
+        add( Hits );
+    }
+    void miss()
+    {
+        add( Misses );
+    }
+    void eviction()
+    {
+        add( Evictions );
+    }
+    void rejection()
+    {
+        add( Rejections );
+    }
+    void expiration()
+    {
+        add( Expirations );
+    }
+    void sweep( uint64_t )
+    {
+        add( Sweeps );
+    }
+    void lockWait( uint64_t ns )
+    {
+        add( LockWaits );
+        add( LockWaitNs, ns );
+    }
+    void lockHold( uint64_t ) {}
+    void snapshot( CacheStatsSnapshot& result ) const
+    {
+        std::array< uint64_t, counters > sum{};
+        for( auto& stripe : m_stripes )
+        {
+            for( size_t c = 0; c < counters; ++c )
+                sum[c] += stripe.values[c].load( std::memory_order_relaxed );
+        }
+        result.hits = sum[Hits];
+        result.misses = sum[Misses];
+        result.evictions = sum[Evictions];
+        result.rejections = sum[Rejections];
+        result.expirations = sum[Expirations];
+        result.sweeps = sum[Sweeps];
+        result.lockWaits = sum[LockWaits];
+        result.lockWaitNs = sum[LockWaitNs];
+    }
+private:
+    enum Counter
+    {
+        Hits,
+        Misses,
+        Evictions,
+        Rejections,
+        Expirations,
+        Sweeps,
+        LockWaits,
+        LockWaitNs,
+        counters
+    };
+    static constexpr size_t stripes = 16;
+
+    // 8 счетчиков по 8 байт - ровно строка кэша
+    struct alignas( cacheLineSize ) Stripe
+    {
+        std::atomic< uint64_t > values[counters] = {};
+    };
+
+    void add( Counter c, uint64_t n = 1 )
+    {
+        m_stripes[threadStripe() % stripes].values[c].fetch_add( n, std::memory_order_relaxed );
+    }
+
+    std::array< Stripe, stripes > m_stripes;
+};
+
+// Счетчики и гистограммы времени удержания исключительной блокировки и прохода чистки.
+// Два чтения часов на каждую исключительную блокировку. Гистограммы пишутся
+// под исключительной блокировкой кэша, поэтому сами ничего не синхронизируют.
+class DetailedCacheStats : public CacheStats
+{
+public:
+    static constexpr bool histograms = true;
+
+    void sweep( uint64_t ns )
+    {
+        CacheStats::sweep( ns );
+        m_sweepTime.record( ns );
+    }
+    void lockHold( uint64_t ns )
+    {
+        m_lockHold.record( ns );
+    }
+    void snapshot( CacheStatsSnapshot& result ) const
+    {
+        CacheStats::snapshot( result );
+        result.lockHold = m_lockHold;
+        result.sweepTime = m_sweepTime;
+    }
+private:
+    LatencyHistogram m_lockHold;
+    LatencyHistogram m_sweepTime;
+};
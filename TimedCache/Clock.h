@@ -0,0 +1,227 @@
+#pragma once
+
+#include <cstdint>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#if defined( __linux__ )
+#include <time.h>
+#endif
+#if defined( _MSC_VER ) && ( defined( _M_X64 ) || defined( _M_IX86 ) )
+#include <intrin.h>
+#define TIMED_CACHE_HAS_TSC 1
+#elif ( defined( __GNUC__ ) || defined( __clang__ ) ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#include <x86intrin.h>
+#define TIMED_CACHE_HAS_TSC 1
+#endif
+
+// Источники времени для TimedCache (параметр шаблона Clock).
+// Все часы монотонные, с интерфейсом std::chrono: duration, time_point, now().
+// Точность удаления по времени равна точности часов: объект живет от relTime
+// до relTime + погрешность часов.
+
+// Точные часы, std::chrono::steady_clock. Погрешность - доли микросекунды,
+// зато каждый вызов - это clock_gettime / QueryPerformanceCounter (~20-30 ns).
+struct PreciseClock
+{
+    using duration = std::chrono::nanoseconds;
+    using rep = duration::rep;
+    using period = duration::period;
+    using time_point = std::chrono::time_point< PreciseClock >;
+    static constexpr bool is_steady = true;
+
+    static time_point now()
+    {
+        return time_point( std::chrono::duration_cast< duration >(
+            std::chrono::steady_clock::now().time_since_epoch() ) );
+    }
+    static const char* name()
+    {
+        return "Precise";
+    }
+};
+
+// Часы, которые обновляет общий фоновый поток раз в миллисекунду.
+// Чтение - одна атомарная загрузка. Погрешность - 1 ms плюс задержка планировщика ОС
+// (на Windows без timeBeginPeriod до ~15 ms). Поток запускается при первом обращении.
+struct TickerClock
+{
+    using duration = std::chrono::nanoseconds;
+    using rep = duration::rep;
+    using period = duration::period;
+    using time_point = std::chrono::time_point< TickerClock >;
+    static constexpr bool is_steady = true;
+
+    static time_point now()
+    {
+        return time_point( duration( ticker().m_now.load( std::memory_order_relaxed ) ) );
+    }
+    static const char* name()
+    {
+        return "Ticker";
+    }
+private:
+    struct Ticker
+    {
+        Ticker()
+        {
+            update();
+            m_thread = std::thread( [this]()
+            {
+                while( m_working.load( std::memory_order_relaxed ) )
+                {
+                    std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+                    update();
+                }
+            } );
+        }
+        ~Ticker()
+        {
+            m_working = false;
+            m_thread.join();
+        }
+        void update()
+        {
+            m_now.store( PreciseClock::now().time_since_epoch().count(), std::memory_order_relaxed );
+        }
+
+        std::atomic< rep > m_now{ 0 };
+        std::atomic_bool m_working{ true };
+        std::thread m_thread;
+    };
+    static Ticker& ticker()
+    {
+        static Ticker instance;
+        return instance;
+    }
+};
+
+#if defined( __linux__ ) && defined( CLOCK_MONOTONIC_COARSE )
+// Грубые часы ядра CLOCK_MONOTONIC_COARSE, читаются через vDSO без системного вызова (~5 ns).
+// Погрешность - один тик ядра, обычно 1-4 ms (CONFIG_HZ).
+struct CoarseClock
+{
+    using duration = std::chrono::nanoseconds;
+    using rep = duration::rep;
+    using period = duration::period;
+    using time_point = std::chrono::time_point< CoarseClock >;
+    static constexpr bool is_steady = true;
+
+    static time_point now()
+    {
+        timespec ts;
+        clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+        return time_point( duration( rep( ts.tv_sec ) * 1000000000 + ts.tv_nsec ) );
+    }
+    static const char* name()
+    {
+        return "Coarse";
+    }
+};
+#else
+// Где нет CLOCK_MONOTONIC_COARSE, грубые часы - это TickerClock
+struct CoarseClock : TickerClock
+{
+    using time_point = std::chrono::time_point< CoarseClock >;
+
+    static time_point now()
+    {
+        return time_point( TickerClock::now().time_since_epoch() );
+    }
+    static const char* name()
+    {
+        return "Coarse";
+    }
+};
+#endif
+
+// Часы по счетчику тактов процессора (rdtsc), ~7-10 ns на вызов без обращения к ОС.
+// Частота калибруется по steady_clock при первом обращении (10 ms), относительная
+// погрешность калибровки порядка 1e-4, т.е. ~0.1 ms на секунду времени жизни.
+// Требует инвариантного TSC (все современные x86); на других архитектурах - PreciseClock.
+struct TscClock
+{
+    using duration = std::chrono::nanoseconds;
+    using rep = duration::rep;
+    using period = duration::period;
+    using time_point = std::chrono::time_point< TscClock >;
+    static constexpr bool is_steady = true;
+
+    static time_point now()
+    {
+#if defined( TIMED_CACHE_HAS_TSC )
+        const Calibration& c = calibration();
+        return time_point( duration( c.base + rep( double( __rdtsc() - c.tsc ) * c.nsPerTick ) ) );
+#else
+        return time_point( PreciseClock::now().time_since_epoch() );
+#endif
+    }
+    static const char* name()
+    {
+        return "Tsc";
+    }
+private:
+#if defined( TIMED_CACHE_HAS_TSC )
+    struct Calibration
+    {
+        Calibration()
+        {
+            auto start = std::chrono::steady_clock::now();
+            uint64_t tscStart = __rdtsc();
+            std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+            auto end = std::chrono::steady_clock::now();
+            uint64_t tscEnd = __rdtsc();
+            nsPerTick = double( std::chrono::duration_cast< duration >( end - start ).count() ) / double( tscEnd - tscStart );
+            tsc = tscEnd;
+            base = std::chrono::duration_cast< duration >( end.time_since_epoch() ).count();
+        }
+
+        uint64_t tsc = 0;
+        rep base = 0;
+        double nsPerTick = 1.0;
+    };
+    static const Calibration& calibration()
+    {
+        static const Calibration instance;
+        return instance;
+    }
+#endif
+};
+
+// Часы, которые переставляет сам пользователь: воспроизведение трассы по ее меткам времени
+// и тесты. Время общее на процесс. Фоновый поток ExpirationService спит по настоящим часам,
+// поэтому кэшам на этих часах нужен ExpiryMode::Lazy.
+struct ManualClock
+{
+    using duration = std::chrono::nanoseconds;
+    using rep = duration::rep;
+    using period = duration::period;
+    using time_point = std::chrono::time_point< ManualClock >;
+    static constexpr bool is_steady = true;
+
+    static time_point now()
+    {
+        return time_point( duration( current().load( std::memory_order_relaxed ) ) );
+    }
+    static const char* name()
+    {
+        return "Manual";
+    }
+    // Время не должно идти назад
+    static void set( time_point time )
+    {
+        current().store( time.time_since_epoch().count(), std::memory_order_relaxed );
+    }
+    static void advance( duration dt )
+    {
+        current().fetch_add( dt.count(), std::memory_order_relaxed );
+    }
+private:
+    static std::atomic< rep >& current()
+    {
+        static std::atomic< rep > instance{ 0 };
+        return instance;
+    }
+};
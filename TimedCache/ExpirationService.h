@@ -0,0 +1,183 @@
+#pragma once
+
+#include <cstdint>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Общий планировщик удаления по времени для многих кэшей.
+// Каждый кэш регистрирует задачу, задача чистит кэш и возвращает, через сколько
+// ее нужно запустить снова. Небольшой пул потоков обслуживает все задачи:
+// по таймеру спит только один поток (ведущий) и только до самого раннего срока,
+// остальные ждут, пока ведущий заберет задачу.
+class ExpirationService
+{
+    using clock = std::chrono::steady_clock;
+public:
+    using tick = std::chrono::nanoseconds;
+    using id = uint64_t;
+    // Задача чистки. Возвращает время до следующего запуска, never - если запуск не нужен.
+    using task = std::function< tick() >;
+    static constexpr tick never = tick::max();
+
+    explicit ExpirationService( size_t threads = 1 )
+    {
+        m_threads.reserve( std::max< size_t >( threads, 1 ) );
+        for( size_t i = 0; i < std::max< size_t >( threads, 1 ); ++i )
+            m_threads.emplace_back( &ExpirationService::worker, this );
+    }
+    ExpirationService( const ExpirationService& ) = delete;
+    ExpirationService& operator = ( const ExpirationService& ) = delete;
+    ~ExpirationService()
+    {
+        {
+            std::lock_guard lg( m_lock );
+            m_working = false;
+        }
+        m_leaderCond.notify_all();
+        m_followerCond.notify_all();
+        for( auto& t : m_threads )
+            t.join();
+    }
+
+    // Общий на процесс планировщик с одним потоком
+    static ExpirationService& instance()
+    {
+        static ExpirationService service;
+        return service;
+    }
+
+    id add( task fn )
+    {
+        std::lock_guard lg( m_lock );
+        id result = ++m_lastId;
+        m_tasks.emplace( result, Task{ std::move( fn ) } );
+        return result;
+    }
+    // Снимает задачу. Если задача сейчас выполняется, дожидается ее окончания,
+    // после возврата задача больше не будет вызвана.
+    void remove( id taskId )
+    {
+        std::unique_lock ul( m_lock );
+        auto iter = m_tasks.find( taskId );
+        if( iter == m_tasks.end() )
+            return;
+        unschedule( iter->second, taskId );
+        iter->second.removed = true;
+        m_doneCond.wait( ul, [&]() { return !iter->second.running; } );
+        m_tasks.erase( iter );
+    }
+    // Запустить задачу не позже, чем через delay. Более поздний срок не отменяет уже назначенный ранний.
+    void schedule( id taskId, tick delay )
+    {
+        std::lock_guard lg( m_lock );
+        auto iter = m_tasks.find( taskId );
+        if( iter != m_tasks.end() )
+            scheduleLocked( iter->second, taskId, delay );
+    }
+    size_t threads() const
+    {
+        return m_threads.size();
+    }
+private:
+    struct Task
+    {
+        task fn;
+        clock::time_point deadline = clock::time_point::max();
+        bool running = false;
+        bool removed = false;
+    };
+
+    void scheduleLocked( Task& t, id taskId, tick delay )
+    {
+        if( delay == never || t.removed )
+            return;
+        auto now = clock::now();
+        auto deadline = delay >= clock::time_point::max() - now ? clock::time_point::max()
+            : now + std::chrono::duration_cast< clock::duration >( delay );
+        if( deadline >= t.deadline )
+            return;
+        bool earliest = m_queue.empty() || deadline < m_queue.begin()->first;
+        unschedule( t, taskId );
+        t.deadline = deadline;
+        m_queue.emplace( deadline, taskId );
+        // Будим ведущего, только если срок стал самым ранним
+        if( earliest )
+        {
+            if( m_leader )
+                m_leaderCond.notify_one();
+            else
+                m_followerCond.notify_one();
+        }
+    }
+    void unschedule( Task& t, id taskId )
+    {
+        if( t.deadline != clock::time_point::max() )
+            m_queue.erase( std::make_pair( t.deadline, taskId ) );
+        t.deadline = clock::time_point::max();
+    }
+    void worker()
+    {
+        std::unique_lock ul( m_lock );
+        while( m_working )
+        {
+            if( m_leader )
+            {
+                m_followerCond.wait( ul );
+                continue;
+            }
+            if( m_queue.empty() )
+            {
+                // Ведущий не нужен, пока задач нет. Будит первый schedule()
+                m_followerCond.wait( ul );
+                continue;
+            }
+            auto [deadline, taskId] = *m_queue.begin();
+            if( clock::now() < deadline )
+            {
+                m_leader = true;
+                m_leaderCond.wait_until( ul, deadline );
+                m_leader = false;
+                continue;
+            }
+
+            // Задача созрела: забираем ее, и передаем ожидание другому потоку
+            m_queue.erase( m_queue.begin() );
+            Task& t = m_tasks.at( taskId );
+            t.deadline = clock::time_point::max();
+            t.running = true;
+            if( !m_queue.empty() )
+                m_followerCond.notify_one();
+
+            ul.unlock();
+            tick next = t.fn();
+            ul.lock();
+
+            t.running = false;
+            if( t.removed )
+                m_doneCond.notify_all();
+            else
+                scheduleLocked( t, taskId, next );
+        }
+    }
+
+    std::mutex m_lock;
+    std::condition_variable m_leaderCond;
+    std::condition_variable m_followerCond;
+    std::condition_variable m_doneCond;
+    bool m_working = true;
+    bool m_leader = false;
+    id m_lastId = 0;
+    std::unordered_map< id, Task > m_tasks;
+    std::set< std::pair< clock::time_point, id > > m_queue;
+    std::vector< std::thread > m_threads;
+};
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <cstdint>
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#if defined( _MSC_VER )
+#include <intrin.h>
+#endif
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#include <emmintrin.h>
+#define TIMED_CACHE_HAS_SSE2 1
+#endif
+
+// Хэш-таблица с открытой адресацией для индекса кэша (в стиле Swiss table / F14).
+// Ячейки разбиты на группы, у каждой ячейки есть управляющий байт: пусто
+// или младшие 7 бит хэша. Управляющие байты группы проверяются целиком одним
+// сравнением SSE2, ключ сравнивается только в ячейках с совпавшими 7 битами.
+// Меток "удалено" нет (как в F14): у группы есть счетчик ключей, которые прошли ее
+// при вставке, не найдя места. Поиск останавливается на группе с нулевым счетчиком,
+// а удаление уменьшает счетчики на пути пробы и сразу освобождает ячейку. Поэтому
+// таблица не засоряется и никогда не перестраивается.
+// Значение - номер ячейки хранилища кэша, сами ключи лежат в хранилище: при попадании
+// к ячейке хранилища все равно обращаемся за временем и значением.
+// Группа - 16 управляющих байт и 12 номеров, ровно одна строка кэша процессора,
+// поэтому промах стоит одной строки, а попадание - строки и ячейки хранилища.
+// Таблица не растет: размер задается сразу по емкости, заполнение не больше 7/8.
+// Сверх емкости оставляется запас не меньше четверти - короче цепочки проб.
+class FlatIndex
+{
+public:
+    using index = uint32_t;
+    static constexpr index npos = std::numeric_limits< index >::max();
+    // Ячеек в группе. Управляющих байт 16: 12-й - счетчик переполнения, остальные лишние - sentinel.
+    static constexpr size_t groupSize = 12;
+
+    explicit FlatIndex( size_t capacity = 0 )
+    {
+        size_t groups = 1;
+        while( groups * groupSize * 7 / 8 < capacity + capacity / 4 )
+            groups <<= 1;
+        m_groups.assign( groups, Group() );
+        m_groupMask = groups - 1;
+    }
+
+    // @param eq - eq( i ) сравнивает искомый ключ с ключом ячейки хранилища i,
+    //             вызывается только при совпадении 7 бит хэша
+    template< class Eq >
+    index find( size_t hash, Eq&& eq ) const
+    {
+        uint64_t h = mix( hash );
+        size_t g = group( h );
+        for( size_t step = 1; ; ++step )
+        {
+            const Group& grp = m_groups[g];
+            const int8_t* ctrl = grp.ctrl;
+            for( uint32_t bits = match( ctrl, fingerprint( h ) ); bits != 0; bits &= bits - 1 )
+            {
+                index i = grp.slots[lowestBit( bits )];
+                if( eq( i ) )
+                    return i;
+            }
+            // Дальше эту группу ни один ключ не проходил, или пройдены все группы
+            if( grp.overflow() == 0 || step > m_groupMask )
+                return npos;
+            g = ( g + step ) & m_groupMask;
+        }
+    }
+    // Ключа в таблице быть не должно, записей - не больше емкости из конструктора
+    void insert( size_t hash, index i )
+    {
+        uint64_t h = mix( hash );
+        size_t g = group( h );
+        for( size_t step = 1; ; ++step )
+        {
+            Group& grp = m_groups[g];
+            if( uint32_t bits = match( grp.ctrl, empty ) )
+            {
+                unsigned pos = lowestBit( bits );
+                grp.ctrl[pos] = fingerprint( h );
+                grp.slots[pos] = i;
+                return;
+            }
+            grp.addOverflow();
+            g = ( g + step ) & m_groupMask;
+        }
+    }
+    // Удаляет запись ячейки хранилища i. Ячейка сразу свободна, счетчики групп,
+    // пройденных при вставке, уменьшаются - тот же путь пробы.
+    void erase( size_t hash, index i )
+    {
+        uint64_t h = mix( hash );
+        size_t g = group( h );
+        for( size_t step = 1; ; ++step )
+        {
+            Group& grp = m_groups[g];
+            for( uint32_t bits = match( grp.ctrl, fingerprint( h ) ); bits != 0; bits &= bits - 1 )
+            {
+                unsigned pos = lowestBit( bits );
+                if( grp.slots[pos] != i )
+                    continue;
+                grp.ctrl[pos] = empty;
+                for( size_t back = 1, k = group( h ); back < step; ++back )
+                {
+                    m_groups[k].removeOverflow();
+                    k = ( k + back ) & m_groupMask;
+                }
+                return;
+            }
+            if( grp.overflow() == 0 || step > m_groupMask )
+                return;
+            g = ( g + step ) & m_groupMask;
+        }
+    }
+    void clear()
+    {
+        std::fill( m_groups.begin(), m_groups.end(), Group() );
+    }
+    // Групп, которые проходил хотя бы один ключ из таблицы, для проверок
+    size_t overflowed() const
+    {
+        return size_t( std::count_if( m_groups.begin(), m_groups.end(), []( const Group& g ) { return g.overflow() != 0; } ) );
+    }
+    // Адрес первой группы проб, для упреждающей загрузки
+    const void* groupOf( size_t hash ) const
+    {
+        return &m_groups[group( mix( hash ) )];
+    }
+private:
+    static constexpr int8_t empty = int8_t( -128 );
+    static constexpr int8_t sentinel = int8_t( -1 );
+    // Биты ячеек в маске match()
+    static constexpr uint32_t slotBits = ( 1u << groupSize ) - 1;
+
+    // Управляющие байты и номера ячеек хранилища одной группы - одна строка кэша
+    struct alignas( 64 ) Group
+    {
+        Group()
+        {
+            std::fill( ctrl, ctrl + groupSize, empty );
+            std::fill( ctrl + groupSize, ctrl + 16, sentinel );
+            ctrl[groupSize] = 0;
+        }
+
+        // Сколько ключей прошли группу при вставке. Достигнув 255, больше не меняется:
+        // поиск через такую группу просто всегда идет дальше.
+        uint8_t overflow() const
+        {
+            return uint8_t( ctrl[groupSize] );
+        }
+        void addOverflow()
+        {
+            if( overflow() != 255 )
+                ctrl[groupSize] = int8_t( overflow() + 1 );
+        }
+        void removeOverflow()
+        {
+            if( overflow() != 255 )
+                ctrl[groupSize] = int8_t( overflow() - 1 );
+        }
+
+        int8_t ctrl[16];
+        index slots[groupSize];
+    };
+
+    // std::hash для целых на многих платформах - тождественная функция,
+    // поэтому перемешиваем биты (финализатор MurmurHash3)
+    static uint64_t mix( size_t hash )
+    {
+        uint64_t h = uint64_t( hash );
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        return h;
+    }
+    static int8_t fingerprint( uint64_t h )
+    {
+        return int8_t( h & 0x7F );
+    }
+    size_t group( uint64_t h ) const
+    {
+        return size_t( h >> 7 ) & m_groupMask;
+    }
+    // Битовая маска ячеек группы с управляющим байтом value (счетчик и sentinel отброшены)
+    static uint32_t match( const int8_t* ctrl, int8_t value )
+    {
+#if defined( TIMED_CACHE_HAS_SSE2 )
+        __m128i g = _mm_loadu_si128( reinterpret_cast< const __m128i* >( ctrl ) );
+        return uint32_t( _mm_movemask_epi8( _mm_cmpeq_epi8( g, _mm_set1_epi8( value ) ) ) ) & slotBits;
+#else
+        uint32_t result = 0;
+        for( size_t j = 0; j < groupSize; ++j )
+            result |= uint32_t( ctrl[j] == value ) << j;
+        return result;
+#endif
+    }
+    static unsigned lowestBit( uint32_t bits )
+    {
+#if defined( _MSC_VER )
+        unsigned long result;
+        _BitScanForward( &result, bits );
+        return unsigned( result );
+#else
+        return unsigned( __builtin_ctz( bits ) );
+#endif
+    }
+
+    std::vector< Group > m_groups;
+    size_t m_groupMask = 0;
+};
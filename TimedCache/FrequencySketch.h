@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+
+#include <algorithm>
+#include <vector>
+
+// Оценка частоты обращений к ключам для допуска в кэш (TinyLFU).
+// Count-min sketch с 4-битными счетчиками: 16 счетчиков в слове uint64_t,
+// все 4 счетчика ключа лежат в одном блоке из 8 слов, т.е. в одной строке кэша процессора.
+// Первое обращение к ключу попадает только в doorkeeper (фильтр Блума), поэтому
+// ключи, встреченные один раз, не занимают счетчики. После 10 * capacity обращений
+// счетчики делятся пополам, а doorkeeper очищается - старая популярность забывается.
+class FrequencySketch
+{
+public:
+    // Счетчик насыщается на 15
+    static constexpr unsigned maxFrequency = 15;
+
+    explicit FrequencySketch( size_t capacity )
+    {
+        size_t words = 8;
+        while( words < capacity )
+            words <<= 1;
+        m_table.assign( words, 0 );
+        m_blockMask = words / 8 - 1;
+        // doorkeeper: около 6 бит на обращение из выборки
+        m_doorkeeper.assign( words, 0 );
+        m_doorkeeperMask = words * 64 - 1;
+        m_sampleSize = std::max< size_t >( capacity, 1 ) * 10;
+    }
+
+    void increment( size_t hash )
+    {
+        uint64_t h = mix( hash );
+        if( ++m_additions == m_sampleSize )
+            reset();
+        if( !doorkeeperAdd( h ) )
+            return;
+        uint64_t* block = &m_table[( h & m_blockMask ) * 8];
+        uint64_t counters = h >> 32;
+        for( unsigned i = 0; i < 4; ++i )
+        {
+            uint64_t& word = block[( counters >> ( i * 8 ) ) & 7];
+            unsigned shift = unsigned( ( counters >> ( i * 8 + 3 ) ) & 15 ) * 4;
+            if( ( ( word >> shift ) & 15 ) != maxFrequency )
+                word += uint64_t( 1 ) << shift;
+        }
+    }
+    // Оценка числа обращений, не больше maxFrequency + 1
+    unsigned frequency( size_t hash ) const
+    {
+        uint64_t h = mix( hash );
+        const uint64_t* block = &m_table[( h & m_blockMask ) * 8];
+        uint64_t counters = h >> 32;
+        unsigned result = maxFrequency;
+        for( unsigned i = 0; i < 4; ++i )
+        {
+            uint64_t word = block[( counters >> ( i * 8 ) ) & 7];
+            unsigned shift = unsigned( ( counters >> ( i * 8 + 3 ) ) & 15 ) * 4;
+            result = std::min( result, unsigned( ( word >> shift ) & 15 ) );
+        }
+        return result + ( doorkeeperContains( h ) ? 1 : 0 );
+    }
+    void clear()
+    {
+        std::fill( m_table.begin(), m_table.end(), 0 );
+        std::fill( m_doorkeeper.begin(), m_doorkeeper.end(), 0 );
+        m_additions = 0;
+    }
+private:
+    // Старение: все счетчики пополам
+    void reset()
+    {
+        for( auto& word : m_table )
+            word = ( word >> 1 ) & 0x7777777777777777ull;
+        std::fill( m_doorkeeper.begin(), m_doorkeeper.end(), 0 );
+        m_additions /= 2;
+    }
+    // @return true, если ключ в doorkeeper уже был
+    bool doorkeeperAdd( uint64_t h )
+    {
+        uint64_t first = h & m_doorkeeperMask;
+        uint64_t second = ( h >> 20 ) & m_doorkeeperMask;
+        bool contains = doorkeeperContains( h );
+        m_doorkeeper[first / 64] |= uint64_t( 1 ) << ( first % 64 );
+        m_doorkeeper[second / 64] |= uint64_t( 1 ) << ( second % 64 );
+        return contains;
+    }
+    bool doorkeeperContains( uint64_t h ) const
+    {
+        uint64_t first = h & m_doorkeeperMask;
+        uint64_t second = ( h >> 20 ) & m_doorkeeperMask;
+        return ( m_doorkeeper[first / 64] >> ( first % 64 ) & 1 ) != 0 &&
+            ( m_doorkeeper[second / 64] >> ( second % 64 ) & 1 ) != 0;
+    }
+    static uint64_t mix( size_t hash )
+    {
+        // Другой множитель, чем у FlatIndex, чтобы не зависеть от его разбиения
+        uint64_t h = uint64_t( hash ) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 29;
+        h *= 0xBF58476D1CE4E5B9ull;
+        h ^= h >> 32;
+        return h;
+    }
+
+    std::vector< uint64_t > m_table;
+    std::vector< uint64_t > m_doorkeeper;
+    size_t m_blockMask = 0;
+    uint64_t m_doorkeeperMask = 0;
+    size_t m_sampleSize = 0;
+    size_t m_additions = 0;
+};
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <cstdint>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+
+#include "CacheKeyHash.h"
+
+// Версии ключей для FrontCache (CacheOptions::frontCache). Ключи разбиты на группы
+// по младшим битам хэша, версия группы растет при каждом удалении и замене объекта из нее.
+// Пишется только под исключительной блокировкой кэша, читается без блокировок.
+class KeyVersions
+{
+public:
+    static constexpr size_t stripes = 4096;
+
+    uint64_t get( size_t hash ) const
+    {
+        return m_versions[hash & ( stripes - 1 )].load( std::memory_order_acquire );
+    }
+    void bump( size_t hash )
+    {
+        m_versions[hash & ( stripes - 1 )].fetch_add( 1, std::memory_order_release );
+    }
+private:
+    std::array< std::atomic< uint64_t >, stripes > m_versions = {};
+};
+
+// Кэш первого уровня одного потока перед общим TimedCache или ShardedTimedCache,
+// созданным с CacheOptions::frontCache. Sets групп по Ways объектов: группа выбирается
+// по хэшу ключа, внутри нее вытесняется давно не использованный. Новый ключ попадает
+// в группу со второго промаха подряд.
+// Попадание ничего не пишет в общую память: сравнивает версию ключа (KeyVersions) и часы
+// со своими. Версия меняется при любом удалении (время, место, erase, clear) и при замене,
+// поэтому замененное или удаленное значение FrontCache не отдаст.
+// Попаданий FrontCache общий кэш не видит: объект переносится в конец LRU-очереди
+// и продлевается, только когда FrontCache берет его из общего кэша - после refresh
+// или половины оставшегося срока. Без срока жизни (NoExpiry) - только после удаления.
+// Один объект на поток, сам не синхронизирован. Должен жить меньше общего кэша.
+template< class Cache, size_t Sets = 128, size_t Ways = 2 >
+class FrontCache
+{
+    static_assert( Sets != 0 && ( Sets & ( Sets - 1 ) ) == 0, "FrontCache: Sets must be a power of two" );
+    static_assert( Ways != 0, "FrontCache: Ways must be positive" );
+public:
+    using key_type = typename Cache::key_type;
+    using mapped_type = typename Cache::mapped_type;
+    using handle = typename Cache::handle;
+    using time_point = typename Cache::time_point;
+
+    // @param refresh - как часто горячий объект все же запрашивается из общего кэша
+    explicit FrontCache( Cache& cache, std::chrono::nanoseconds refresh = std::chrono::milliseconds( 100 ) )
+        : m_cache( cache ), m_refresh( refresh )
+    {
+        if( !cache.versioned() )
+            throw std::invalid_argument( "FrontCache: the cache needs CacheOptions::frontCache" );
+    }
+    FrontCache( const FrontCache& ) = delete;
+    FrontCache& operator = ( const FrontCache& ) = delete;
+
+    handle get_handle( const key_type& key )
+    {
+        size_t hash = m_hash( key );
+        size_t group = hash % Sets;
+        Slot* set = &m_slots[group * Ways];
+        Slot* victim = set;
+        for( size_t w = 0; w < Ways; ++w )
+        {
+            Slot& slot = set[w];
+            if( slot.value && slot.hash == hash && *slot.key == key )
+            {
+                if( slot.version == m_cache.key_version( hash ) && Cache::now() < slot.refreshAt )
+                {
+                    ++m_hits;
+                    slot.used = ++m_uses;
+                    return slot.value;
+                }
+                return fill( slot, key, hash );
+            }
+            if( slot.used < victim->used )
+                victim = &slot;
+        }
+        // Новый ключ занимает место, только если это второй промах по нему подряд в группе:
+        // редкие ключи из хвоста распределения не вытесняют горячие
+        if( m_candidates[group] != hash )
+        {
+            m_candidates[group] = hash;
+            ++m_misses;
+            return m_cache.get_handle( key );
+        }
+        return fill( *victim, key, hash );
+    }
+    std::optional< mapped_type > get( const key_type& key )
+    {
+        if( handle h = get_handle( key ) )
+            return std::optional< mapped_type >( *h );
+        return std::optional< mapped_type >();
+    }
+    // Запись идет в общий кэш. Замена меняет версию ключа, поэтому своя копия устареет сама.
+    template< class KeyArg, class ValueArg >
+    void set( KeyArg&& key, ValueArg&& value )
+    {
+        m_cache.set( std::forward< KeyArg >( key ), std::forward< ValueArg >( value ) );
+    }
+    bool erase( const key_type& key )
+    {
+        return m_cache.erase( key );
+    }
+    // Забывает только свои копии, общий кэш не трогает
+    void clear()
+    {
+        for( Slot& slot : m_slots )
+            slot = Slot();
+        m_candidates.fill( 0 );
+    }
+    Cache& cache()
+    {
+        return m_cache;
+    }
+    // Попадания в FrontCache и обращения к общему кэшу
+    uint64_t hits() const
+    {
+        return m_hits;
+    }
+    uint64_t misses() const
+    {
+        return m_misses;
+    }
+private:
+    struct Slot
+    {
+        std::optional< key_type > key;
+        handle value;
+        size_t hash = 0;
+        uint64_t version = 0;
+        time_point refreshAt{};
+        // Номер последнего обращения, 0 - пустая ячейка
+        uint64_t used = 0;
+    };
+
+    // Промах или устаревшая копия: версия и срок читаются вместе со значением под блокировкой
+    handle fill( Slot& slot, const key_type& key, size_t hash )
+    {
+        ++m_misses;
+        uint64_t version = 0;
+        time_point expires{};
+        handle value = m_cache.get_versioned( key, hash, version, expires );
+        if( !value )
+        {
+            slot = Slot();
+            return value;
+        }
+        auto now = Cache::now();
+        auto half = ( expires - now ) / 2;
+        if( slot.hash != hash || !slot.key || !( *slot.key == key ) )
+            slot.key.emplace( key );
+        slot.value = value;
+        slot.hash = hash;
+        slot.version = version;
+        slot.refreshAt = now + std::min< std::chrono::nanoseconds >( half, m_refresh );
+        slot.used = ++m_uses;
+        return value;
+    }
+
+    Cache& m_cache;
+    std::chrono::nanoseconds m_refresh;
+    CacheKeyHash< key_type > m_hash;
+    std::array< Slot, Sets * Ways > m_slots;
+    // Хэш последнего ключа, не попавшего в группу
+    std::array< size_t, Sets > m_candidates = {};
+    uint64_t m_uses = 0;
+    uint64_t m_hits = 0;
+    uint64_t m_misses = 0;
+};
@@ -1,13 +1,30 @@
 #pragma once
 
+#include <string>
+#include <utility>
+
 template< class K, class T >
 class ICache
 {
 public:
     virtual ~ICache() = default;
     virtual void set( const K& key, const T& value ) = 0;
-    virtual T* get( const K& key ) = 0;
+    virtual const T* get( const K& key ) = 0;
+    // Поиск без сохранения значения в адаптере, в отличие от get() можно вызывать
+    // из нескольких потоков (многопоточный режим TestPerfomance)
+    virtual bool contains( const K& key ) = 0;
+    // Пакетные операции.
+    // @param out - буфер на count указателей, nullptr для ненайденных.
+    //              Указатели действительны до следующего вызова multi_get.
+    // @return число найденных
+    virtual size_t multi_get( const K* keys, size_t count, const T** out ) = 0;
+    virtual void multi_set( const std::pair< K, T >* items, size_t count ) = 0;
     virtual std::string name() const = 0;
     virtual size_t capacity() const = 0;
     virtual void clear() = 0;
+    // Дополнительные строки отчета после замера, например по уровням кэша. Пусто - нет.
+    virtual std::string details() const
+    {
+        return std::string();
+    }
 };
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#if defined( _MSC_VER )
+#include <intrin.h>
+#endif
+
+// Гистограмма задержек в стиле HdrHistogram: ячейки логарифмические по степеням двойки,
+// внутри степени - subBuckets равных ячеек. Относительная погрешность перцентиля
+// не больше 1 / subBuckets при постоянной памяти и записи за одно сложение.
+// Гистограммы потоков складываются через merge() в общую после замера.
+class LatencyHistogram
+{
+public:
+    static constexpr unsigned subBits = 5;
+    static constexpr uint64_t subBuckets = uint64_t( 1 ) << subBits;
+    // Значения больше 2^maxBits - 1 (около 73 минут в наносекундах) записываются как максимальное
+    static constexpr unsigned maxBits = 42;
+
+    LatencyHistogram()
+        : m_counts( size_t( maxBits - subBits + 1 ) * subBuckets, 0 )
+    {
+    }
+
+    void record( uint64_t value )
+    {
+        value = std::min( value, ( uint64_t( 1 ) << maxBits ) - 1 );
+        ++m_counts[bucket( value )];
+        ++m_count;
+        m_max = std::max( m_max, value );
+    }
+    void merge( const LatencyHistogram& other )
+    {
+        for( size_t i = 0; i < m_counts.size(); ++i )
+            m_counts[i] += other.m_counts[i];
+        m_count += other.m_count;
+        m_max = std::max( m_max, other.m_max );
+    }
+    void clear()
+    {
+        std::fill( m_counts.begin(), m_counts.end(), 0 );
+        m_count = 0;
+        m_max = 0;
+    }
+    // Значение, которого не превышают доля q записей (верхняя граница ячейки, но не больше max())
+    // @param q - от 0 до 1, например 0.999 для p99.9
+    uint64_t percentile( double q ) const
+    {
+        if( m_count == 0 )
+            return 0;
+        uint64_t rank = uint64_t( q * double( m_count ) );
+        rank = std::min( std::max< uint64_t >( rank, 1 ), m_count );
+        uint64_t seen = 0;
+        for( size_t i = 0; i < m_counts.size(); ++i )
+        {
+            seen += m_counts[i];
+            if( seen >= rank )
+                return std::min( upperBound( i ), m_max );
+        }
+        return m_max;
+    }
+    uint64_t count() const
+    {
+        return m_count;
+    }
+    uint64_t max() const
+    {
+        return m_max;
+    }
+private:
+    static size_t bucket( uint64_t value )
+    {
+        if( value < subBuckets )
+            return size_t( value );
+        unsigned shift = highestBit( value ) - subBits;
+        return size_t( ( shift + 1 ) * subBuckets + ( value >> shift ) - subBuckets );
+    }
+    static uint64_t upperBound( size_t i )
+    {
+        if( i < subBuckets )
+            return uint64_t( i );
+        unsigned shift = unsigned( i / subBuckets ) - 1;
+        uint64_t sub = i % subBuckets + subBuckets;
+        return ( ( sub + 1 ) << shift ) - 1;
+    }
+    static unsigned highestBit( uint64_t value )
+    {
+#if defined( _MSC_VER ) && defined( _M_X64 )
+        unsigned long result;
+        _BitScanReverse64( &result, value );
+        return unsigned( result );
+#elif defined( _MSC_VER )
+        unsigned long result;
+        if( _BitScanReverse( &result, static_cast< unsigned long >( value >> 32 ) ) )
+            return unsigned( result ) + 32;
+        _BitScanReverse( &result, static_cast< unsigned long >( value ) );
+        return unsigned( result );
+#else
+        return 63 - unsigned( __builtin_clzll( value ) );
+#endif
+    }
+
+    std::vector< uint64_t > m_counts;
+    uint64_t m_count = 0;
+    uint64_t m_max = 0;
+};
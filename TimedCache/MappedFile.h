@@ -0,0 +1,178 @@
+#pragma once
+
+#include <cstddef>
+
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#if defined( _WIN32 )
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Файл, отображенный в память только для чтения. Страницы подгружает ОС по мере чтения,
+// поэтому большой файл не копируется в память процесса целиком.
+class MappedFile
+{
+public:
+    explicit MappedFile( const std::string& path )
+    {
+#if defined( _WIN32 )
+        HANDLE file = CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+        if( file == INVALID_HANDLE_VALUE )
+            throw std::runtime_error( "MappedFile: can't open " + path );
+        LARGE_INTEGER size;
+        if( !GetFileSizeEx( file, &size ) )
+        {
+            CloseHandle( file );
+            throw std::runtime_error( "MappedFile: can't get size of " + path );
+        }
+        m_size = size_t( size.QuadPart );
+        if( m_size != 0 )
+        {
+            HANDLE mapping = CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+            if( mapping )
+            {
+                m_data = static_cast< const char* >( MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) );
+                // Отображение живет, пока открыт view
+                CloseHandle( mapping );
+            }
+        }
+        CloseHandle( file );
+#else
+        int fd = ::open( path.c_str(), O_RDONLY );
+        if( fd < 0 )
+            throw std::runtime_error( "MappedFile: can't open " + path );
+        struct stat st;
+        if( ::fstat( fd, &st ) != 0 )
+        {
+            ::close( fd );
+            throw std::runtime_error( "MappedFile: can't get size of " + path );
+        }
+        m_size = size_t( st.st_size );
+        if( m_size != 0 )
+        {
+            void* p = ::mmap( nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+            if( p != MAP_FAILED )
+            {
+                m_data = static_cast< const char* >( p );
+                ::madvise( p, m_size, MADV_SEQUENTIAL );
+            }
+        }
+        ::close( fd );
+#endif
+        if( m_size != 0 && !m_data )
+            throw std::runtime_error( "MappedFile: can't map " + path );
+    }
+    MappedFile( MappedFile&& other ) noexcept
+        : m_data( std::exchange( other.m_data, nullptr ) ), m_size( std::exchange( other.m_size, 0 ) )
+    {
+    }
+    MappedFile( const MappedFile& ) = delete;
+    MappedFile& operator = ( const MappedFile& ) = delete;
+    MappedFile& operator = ( MappedFile&& ) = delete;
+    ~MappedFile()
+    {
+        if( !m_data )
+            return;
+#if defined( _WIN32 )
+        UnmapViewOfFile( m_data );
+#else
+        ::munmap( const_cast< char* >( m_data ), m_size );
+#endif
+    }
+
+    const char* data() const
+    {
+        return m_data;
+    }
+    size_t size() const
+    {
+        return m_size;
+    }
+private:
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+};
+
+// Файл заданного размера, отображенный в память для чтения и записи (общее отображение:
+// записанное уходит в файл силами ОС). Файл создается заново, прежнее содержимое теряется.
+// Размер не меняется, поэтому указатели в отображение остаются валидными все время жизни.
+class WritableMappedFile
+{
+public:
+    WritableMappedFile( const std::string& path, size_t size )
+        : m_size( size )
+    {
+        if( size == 0 )
+            throw std::invalid_argument( "WritableMappedFile: size is zero" );
+#if defined( _WIN32 )
+        HANDLE file = CreateFileA( path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr );
+        if( file == INVALID_HANDLE_VALUE )
+            throw std::runtime_error( "WritableMappedFile: can't create " + path );
+        LARGE_INTEGER large;
+        large.QuadPart = LONGLONG( size );
+        HANDLE mapping = CreateFileMappingA( file, nullptr, PAGE_READWRITE, DWORD( large.HighPart ), large.LowPart, nullptr );
+        if( mapping )
+        {
+            m_data = static_cast< char* >( MapViewOfFile( mapping, FILE_MAP_WRITE, 0, 0, size ) );
+            CloseHandle( mapping );
+        }
+        CloseHandle( file );
+#else
+        int fd = ::open( path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600 );
+        if( fd < 0 )
+            throw std::runtime_error( "WritableMappedFile: can't create " + path );
+        if( ::ftruncate( fd, off_t( size ) ) != 0 )
+        {
+            ::close( fd );
+            throw std::runtime_error( "WritableMappedFile: can't resize " + path );
+        }
+        void* p = ::mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+        if( p != MAP_FAILED )
+        {
+            m_data = static_cast< char* >( p );
+            ::madvise( p, size, MADV_RANDOM );
+        }
+        ::close( fd );
+#endif
+        if( !m_data )
+            throw std::runtime_error( "WritableMappedFile: can't map " + path );
+    }
+    WritableMappedFile( const WritableMappedFile& ) = delete;
+    WritableMappedFile& operator = ( const WritableMappedFile& ) = delete;
+    ~WritableMappedFile()
+    {
+#if defined( _WIN32 )
+        UnmapViewOfFile( m_data );
+#else
+        ::munmap( m_data, m_size );
+#endif
+    }
+
+    char* data()
+    {
+        return m_data;
+    }
+    const char* data() const
+    {
+        return m_data;
+    }
+    size_t size() const
+    {
+        return m_size;
+    }
+private:
+    char* m_data = nullptr;
+    size_t m_size = 0;
+};
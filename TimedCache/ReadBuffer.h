@@ -0,0 +1,181 @@
+#pragma once
+
+#include <cstdint>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Размер строки кэша процессора, по нему выравниваются данные разных потоков
+constexpr size_t cacheLineSize = 64;
+
+// Номер потока для выбора полосы (stripe) в распределенных структурах
+inline size_t threadStripe()
+{
+    static thread_local const size_t stripe = std::hash< std::thread::id >()( std::this_thread::get_id() );
+    return stripe;
+}
+
+// Мьютекс с распределенной блокировкой чтения.
+// Читатель отмечается только в своей полосе (отдельная строка кэша), поэтому читатели
+// не пишут в общую память и не мешают друг другу. Писатель выставляет флаг и ждет,
+// пока все полосы опустеют, поэтому запись дороже, чем у std::mutex.
+// Если readBias == false, блокировка чтения не используется и lock() - это просто std::mutex.
+class ReadBiasedMutex
+{
+public:
+    static constexpr size_t stripes = 32;
+
+    explicit ReadBiasedMutex( bool readBias = false )
+        : m_readBias( readBias )
+    {
+    }
+
+    void lock()
+    {
+        m_mutex.lock();
+        waitReaders();
+    }
+    // Не ждет другого писателя, но дожидается ушедших читателей
+    bool try_lock()
+    {
+        if( !m_mutex.try_lock() )
+            return false;
+        waitReaders();
+        return true;
+    }
+    void unlock()
+    {
+        if( m_readBias )
+            m_writer.store( false, std::memory_order_release );
+        m_mutex.unlock();
+    }
+    // @return номер полосы, его надо передать в unlock_shared
+    size_t lock_shared()
+    {
+        size_t stripe = threadStripe() % stripes;
+        auto& readers = m_readers[stripe].count;
+        while( true )
+        {
+            readers.fetch_add( 1, std::memory_order_seq_cst );
+            if( !m_writer.load( std::memory_order_seq_cst ) )
+                return stripe;
+            // Пишет писатель: уходим и ждем его на обычном мьютексе
+            readers.fetch_sub( 1, std::memory_order_release );
+            std::lock_guard lg( m_mutex );
+        }
+    }
+    void unlock_shared( size_t stripe )
+    {
+        m_readers[stripe].count.fetch_sub( 1, std::memory_order_release );
+    }
+private:
+    struct alignas( cacheLineSize ) Stripe
+    {
+        std::atomic< uint32_t > count{ 0 };
+    };
+
+    void waitReaders()
+    {
+        if( !m_readBias )
+            return;
+        m_writer.store( true, std::memory_order_seq_cst );
+        for( auto& stripe : m_readers )
+        {
+            while( stripe.count.load( std::memory_order_seq_cst ) != 0 )
+                std::this_thread::yield();
+        }
+    }
+
+    std::mutex m_mutex;
+    bool m_readBias = false;
+    alignas( cacheLineSize ) std::atomic_bool m_writer{ false };
+    std::array< Stripe, stripes > m_readers;
+};
+
+// Блокировка чтения ReadBiasedMutex (или мьютекса с тем же lock_shared) на время жизни объекта
+template< class Mutex = ReadBiasedMutex >
+class SharedReadLock
+{
+public:
+    explicit SharedReadLock( Mutex& mutex )
+        : m_mutex( mutex ), m_stripe( mutex.lock_shared() )
+    {
+    }
+    SharedReadLock( const SharedReadLock& ) = delete;
+    SharedReadLock& operator = ( const SharedReadLock& ) = delete;
+    ~SharedReadLock()
+    {
+        m_mutex.unlock_shared( m_stripe );
+    }
+private:
+    Mutex& m_mutex;
+    size_t m_stripe;
+};
+
+// Полосатый буфер с потерями для отложенных событий чтения.
+// Читатели пишут в полосу своего потока, место резервируется атомарным счетчиком,
+// при переполнении событие теряется. Разбирается только под исключительной
+// блокировкой, когда читателей нет.
+template< class Event, size_t Stripes = 8, size_t Capacity = 32 >
+class ReadBuffer
+{
+public:
+    // @return false, если событие потеряно; full - полоса только что заполнилась
+    bool push( const Event& ev, bool& full )
+    {
+        Stripe& stripe = m_stripes[threadStripe() % Stripes];
+        full = false;
+        // Полная полоса: не трогаем счетчик, чтобы не писать в общую строку кэша
+        if( stripe.tail.load( std::memory_order_relaxed ) >= Capacity )
+            return false;
+        uint32_t pos = stripe.tail.fetch_add( 1, std::memory_order_relaxed );
+        full = pos + 1 == Capacity;
+        if( pos >= Capacity )
+            return false;
+        stripe.events[pos] = ev;
+        return true;
+    }
+    // Разбирает события всех полос слиянием по порядку less, вызывая fn( event ).
+    // Внутри полосы события уже идут почти по порядку записи.
+    template< class Less, class Fn >
+    void drain( Less&& less, Fn&& fn )
+    {
+        std::array< size_t, Stripes > pos{};
+        std::array< size_t, Stripes > end{};
+        bool any = false;
+        for( size_t s = 0; s < Stripes; ++s )
+        {
+            end[s] = std::min< size_t >( m_stripes[s].tail.load( std::memory_order_relaxed ), Capacity );
+            any |= end[s] != 0;
+        }
+        while( any )
+        {
+            size_t best = Stripes;
+            for( size_t s = 0; s < Stripes; ++s )
+            {
+                if( pos[s] < end[s] && ( best == Stripes || less( m_stripes[s].events[pos[s]], m_stripes[best].events[pos[best]] ) ) )
+                    best = s;
+            }
+            if( best == Stripes )
+                break;
+            fn( m_stripes[best].events[pos[best]++] );
+        }
+        if( any )
+        {
+            for( auto& stripe : m_stripes )
+                stripe.tail.store( 0, std::memory_order_relaxed );
+        }
+    }
+private:
+    struct alignas( cacheLineSize ) Stripe
+    {
+        std::atomic< uint32_t > tail{ 0 };
+        std::array< Event, Capacity > events;
+    };
+
+    std::array< Stripe, Stripes > m_stripes;
+};
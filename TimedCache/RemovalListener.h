@@ -0,0 +1,269 @@
+#pragma once
+
+#include <cstdint>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "ReadBuffer.h"
+
+// Почему объект ушел из кэша
+enum class RemovalCause
+{
+    // Прошло время жизни: фоновая чистка, ExpiryMode::Lazy или обращение к "протухшему" объекту
+    Expired,
+    // Вытеснен ради места (size, maxWeight) или не допущен: Admission::TinyLfu, вес больше maxWeight
+    Capacity,
+    // erase() или clear()
+    Explicit,
+    // set() по существующему ключу, значение - старое
+    Replaced
+};
+
+// Что делать, если очередь слушателя заполнена
+enum class ListenerOverflow
+{
+    // Ждать места. Ждет поток, который удалял объекты, но уже после освобождения блокировки кэша.
+    Block,
+    // Выбросить событие, см. dropped()
+    Drop,
+    // Вызвать обработчик в потоке, который удалял объекты, после освобождения блокировки кэша
+    Inline
+};
+
+// Слушатель удалений из TimedCache (TimedCache::set_removal_listener).
+// Кэш под своей блокировкой только кладет событие в кольцевую очередь без блокировок
+// (несколько писателей, один читатель), обработчик вызывается в отдельном потоке слушателя,
+// который забирает события пачками. Поэтому обработчик может обращаться к самому кэшу.
+// Поток слушателя будится не на каждое событие: после пачки он ждет до delay, и раньше
+// его будят, только если очередь заполнилась на четверть. Простаивающий поток спит без
+// таймаута до первого события.
+// Один слушатель можно отдать нескольким кэшам (например, сегментам ShardedTimedCache).
+// Объекты, оставшиеся в кэше при его разрушении, не сообщаются.
+template< class K, class T >
+class RemovalListener
+{
+public:
+    using handle = std::shared_ptr< const T >;
+    using callback = std::function< void( const K& key, const handle& value, RemovalCause cause ) >;
+
+    struct Event
+    {
+        std::optional< K > key;
+        handle value;
+        RemovalCause cause = RemovalCause::Explicit;
+    };
+
+    // @param capacity - размер очереди, округляется вверх до степени двойки
+    // @param delay - наибольшая задержка доставки при потоке событий, меньшем capacity / 4 за delay
+    explicit RemovalListener( callback fn, size_t capacity = 4096, ListenerOverflow overflow = ListenerOverflow::Block,
+        std::chrono::milliseconds delay = std::chrono::milliseconds( 10 ) )
+        : m_fn( std::move( fn ) ), m_overflow( overflow ), m_delay( delay )
+    {
+        size_t size = 2;
+        while( size < capacity )
+            size <<= 1;
+        m_cells.reset( new Cell[size] );
+        m_mask = size - 1;
+        m_wakeAt = std::max< size_t >( size / 4, 1 );
+        for( size_t i = 0; i < size; ++i )
+            m_cells[i].seq.store( i, std::memory_order_relaxed );
+        m_thread = std::thread( &RemovalListener::run, this );
+    }
+    RemovalListener( const RemovalListener& ) = delete;
+    RemovalListener& operator = ( const RemovalListener& ) = delete;
+    // Доставляет все, что уже в очереди. Кэши, которые его используют, должны быть разрушены раньше.
+    ~RemovalListener()
+    {
+        {
+            std::lock_guard lg( m_mutex );
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        m_thread.join();
+    }
+
+    // Без блокировок, из любого потока. Поток слушателя не будит, для этого - wake().
+    // @return false, если очередь заполнена, ev не тронут
+    bool try_push( Event& ev )
+    {
+        size_t pos = m_tail.load( std::memory_order_relaxed );
+        while( true )
+        {
+            Cell& cell = m_cells[pos & m_mask];
+            size_t seq = cell.seq.load( std::memory_order_acquire );
+            auto diff = intptr_t( seq ) - intptr_t( pos );
+            if( diff == 0 )
+            {
+                if( m_tail.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+                {
+                    cell.event = std::move( ev );
+                    cell.seq.store( pos + 1, std::memory_order_release );
+                    return true;
+                }
+            }
+            else if( diff < 0 )
+                return false;
+            else
+                pos = m_tail.load( std::memory_order_relaxed );
+        }
+    }
+    // Событие, не поместившееся в try_push, по политике ListenerOverflow.
+    // Вызывается без блокировки кэша.
+    void push( Event&& ev )
+    {
+        if( try_push( ev ) )
+            return;
+        switch( m_overflow )
+        {
+        case ListenerOverflow::Block:
+            wake( true );
+            while( !try_push( ev ) )
+                std::this_thread::yield();
+            break;
+        case ListenerOverflow::Drop:
+            m_dropped.fetch_add( 1, std::memory_order_relaxed );
+            break;
+        case ListenerOverflow::Inline:
+            m_fn( *ev.key, ev.value, ev.cause );
+            break;
+        }
+    }
+    // Будит поток слушателя, если он спит без таймаута, или, если force или очередь
+    // заполнена на четверть, - если ждет с таймаутом. Иначе - пара атомарных загрузок.
+    void wake( bool force = false )
+    {
+        // Пара к барьеру в run(): либо поток увидит новое событие, либо мы увидим, что он спит
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        int state = m_state.load( std::memory_order_relaxed );
+        if( state == Running )
+            return;
+        if( state == Napping && !force &&
+            m_tail.load( std::memory_order_relaxed ) - m_head.load( std::memory_order_relaxed ) < m_wakeAt )
+            return;
+        std::lock_guard lg( m_mutex );
+        m_wake.notify_one();
+    }
+    // Дожидается доставки всех событий, которые уже в очереди
+    void flush()
+    {
+        uint64_t target = m_tail.load( std::memory_order_relaxed );
+        wake( true );
+        std::unique_lock ul( m_mutex );
+        m_delivered.wait( ul, [&]() { return m_deliveredCount >= target; } );
+    }
+    // Сколько событий выброшено по ListenerOverflow::Drop
+    uint64_t dropped() const
+    {
+        return m_dropped.load( std::memory_order_relaxed );
+    }
+private:
+    // Сколько событий поток слушателя забирает за раз
+    static constexpr size_t batchSize = 256;
+
+    // Состояние потока слушателя
+    enum State
+    {
+        Running,
+        // Ждет с таймаутом delay
+        Napping,
+        // Ждет без таймаута
+        Sleeping
+    };
+
+    // Ячейка очереди Д. Вьюкова: seq == pos - свободна для записи на позиции pos,
+    // seq == pos + 1 - заполнена и ждет чтения
+    struct Cell
+    {
+        std::atomic< size_t > seq{ 0 };
+        Event event;
+    };
+
+    // Только поток слушателя
+    bool pop( Event& ev )
+    {
+        size_t head = m_head.load( std::memory_order_relaxed );
+        Cell& cell = m_cells[head & m_mask];
+        if( cell.seq.load( std::memory_order_acquire ) != head + 1 )
+            return false;
+        ev = std::move( cell.event );
+        cell.event = Event();
+        cell.seq.store( head + m_mask + 1, std::memory_order_release );
+        m_head.store( head + 1, std::memory_order_relaxed );
+        return true;
+    }
+    bool empty() const
+    {
+        size_t head = m_head.load( std::memory_order_relaxed );
+        return m_cells[head & m_mask].seq.load( std::memory_order_acquire ) != head + 1;
+    }
+    void run()
+    {
+        std::vector< Event > batch;
+        batch.reserve( batchSize );
+        // После доставки ждем с таймаутом, после пустого ожидания - без
+        bool nap = true;
+        while( true )
+        {
+            Event ev;
+            while( batch.size() < batchSize && pop( ev ) )
+                batch.push_back( std::move( ev ) );
+            if( !batch.empty() )
+            {
+                for( Event& e : batch )
+                    m_fn( *e.key, e.value, e.cause );
+                size_t n = batch.size();
+                // Значения разрушаются здесь, в потоке слушателя
+                batch.clear();
+                {
+                    std::lock_guard lg( m_mutex );
+                    m_deliveredCount += n;
+                }
+                m_delivered.notify_all();
+                nap = true;
+                continue;
+            }
+            std::unique_lock ul( m_mutex );
+            m_state.store( nap ? Napping : Sleeping, std::memory_order_relaxed );
+            std::atomic_thread_fence( std::memory_order_seq_cst );
+            if( empty() )
+            {
+                if( m_stop )
+                    break;
+                if( nap )
+                    m_wake.wait_for( ul, m_delay );
+                else
+                    m_wake.wait( ul );
+            }
+            m_state.store( Running, std::memory_order_relaxed );
+            nap = false;
+        }
+    }
+
+    callback m_fn;
+    ListenerOverflow m_overflow;
+    std::chrono::milliseconds m_delay;
+    std::unique_ptr< Cell[] > m_cells;
+    size_t m_mask = 0;
+    size_t m_wakeAt = 1;
+    // Позиция записи - общая для писателей, позиция чтения - только поток слушателя
+    // (писатели читают ее для оценки заполнения)
+    alignas( cacheLineSize ) std::atomic< size_t > m_tail{ 0 };
+    alignas( cacheLineSize ) std::atomic< size_t > m_head{ 0 };
+    std::atomic< int > m_state{ Running };
+    std::atomic< uint64_t > m_dropped{ 0 };
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_delivered;
+    uint64_t m_deliveredCount = 0;
+    bool m_stop = false;
+    std::thread m_thread;
+};
@@ -0,0 +1,319 @@
+#pragma once
+
+#include <cstdint>
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "TimedCache.h"
+
+// Кэш, разбитый на независимые сегменты по хэшу ключа.
+// У каждого сегмента свой мьютекс, своя очередь по давности и свое время жизни,
+// поэтому потоки, работающие с разными ключами, не мешают друг другу.
+// Статистика у каждого сегмента своя и складывается только в stats().
+// Policy - политики сегментов (CachePolicy.h), блокировка сегментов - из нее же.
+template< class K, class T, class Clock = PreciseClock, class Stats = NoStats, class Policy = CachePolicy<> >
+class ShardedTimedCache
+{
+    using shard_type = TimedCache< K, T, Clock, Stats, Policy >;
+public:
+    // @param size - общая емкость, делится между сегментами без остатка
+    // @param relTime - время жизни объекта
+    // @param shards - число сегментов, 0 - по числу ядер. Округляется вниз до степени двойки
+    //                 и не превышает size, чтобы в каждом сегменте было место хотя бы под один объект.
+    // @param options - настройки, общие для всех сегментов
+    template< class Rep, class Period >
+    ShardedTimedCache( size_t size, const std::chrono::duration< Rep, Period >& relTime, size_t shards = 0,
+        const CacheOptions& options = {} )
+        : m_size( size )
+    {
+        if( shards == 0 )
+            shards = size_t( std::thread::hardware_concurrency() ) * 4;
+        shards = std::max< size_t >( 1, std::min( shards, size ) );
+        while( shards & ( shards - 1 ) )
+            shards &= shards - 1;
+        while( ( size_t( 1 ) << m_shift ) < shards )
+            ++m_shift;
+        m_shift = 64 - m_shift;
+
+        // Остаток от деления раздаем первым сегментам, сумма емкостей равна size
+        m_shards.reserve( shards );
+        for( size_t i = 0; i < shards; ++i )
+        {
+            size_t shardSize = size / shards + ( i < size % shards ? 1 : 0 );
+            CacheOptions shardOptions = options;
+            if( options.maxWeight != 0 )
+                shardOptions.maxWeight = std::max< size_t >( 1, options.maxWeight / shards + ( i < options.maxWeight % shards ? 1 : 0 ) );
+            m_shards.push_back( std::make_unique< shard_type >( shardSize, relTime, shardOptions ) );
+        }
+    }
+    ShardedTimedCache( const ShardedTimedCache& ) = delete;
+    ShardedTimedCache& operator = ( const ShardedTimedCache& ) = delete;
+
+    using handle = typename shard_type::handle;
+    using key_type = K;
+    using mapped_type = T;
+    using time_point = typename shard_type::time_point;
+
+    static time_point now()
+    {
+        return shard_type::now();
+    }
+
+    std::optional< T > get( const K& key )
+    {
+        return shard( key ).get( key );
+    }
+    // Разнородный поиск, см. TimedCache::get
+    template< class Q, class = std::enable_if_t< isLookupKey< K, Q > > >
+    std::optional< T > get( const Q& key )
+    {
+        return shard( key ).get( key );
+    }
+    handle get_handle( const K& key )
+    {
+        return shard( key ).get_handle( key );
+    }
+    template< class Q, class = std::enable_if_t< isLookupKey< K, Q > > >
+    handle get_handle( const Q& key )
+    {
+        return shard( key ).get_handle( key );
+    }
+    template< class Fn >
+    bool get_with( const K& key, Fn&& fn )
+    {
+        return shard( key ).get_with( key, std::forward< Fn >( fn ) );
+    }
+    template< class Q, class Fn, class = std::enable_if_t< isLookupKey< K, Q > > >
+    bool get_with( const Q& key, Fn&& fn )
+    {
+        return shard( key ).get_with( key, std::forward< Fn >( fn ) );
+    }
+    // Загрузки разных сегментов независимы, см. TimedCache::get_or_load
+    template< class Loader >
+    handle get_or_load( const K& key, Loader&& loader )
+    {
+        return shard( key ).get_or_load( key, std::forward< Loader >( loader ) );
+    }
+    // Пакетный поиск. Ключи обрабатываются частями, в каждой части сегмент
+    // блокируется один раз для всех своих ключей. Память не выделяется.
+    // @param out - буфер на count элементов, для ненайденных ключей - пустой handle
+    // @return число найденных
+    size_t multi_get( const K* keys, size_t count, handle* out )
+    {
+        size_t found = 0;
+        forEachShard( keys, count, [&]( shard_type& s, const size_t* which, const size_t* hashes, size_t n )
+        {
+            for( size_t j = 0; j < n; ++j )
+                TIMED_CACHE_PREFETCH( s.m_index.groupOf( hashes[j] ) );
+            auto lg = s.lockExclusive();
+            auto currTime = s.getCurrTime();
+            for( size_t j = 0; j < n; ++j )
+            {
+                out[which[j]] = s.getLocked( keys[which[j]], hashes[j], currTime );
+                if( out[which[j]] )
+                    ++found;
+            }
+        } );
+        return found;
+    }
+    void set( const K& key, const T& value )
+    {
+        shard( key ).set( key, value );
+    }
+    void set( const K& key, T&& value )
+    {
+        shard( key ).set( key, std::move( value ) );
+    }
+    void set( K&& key, const T& value )
+    {
+        shard_type& s = shard( key );
+        s.set( std::move( key ), value );
+    }
+    void set( K&& key, T&& value )
+    {
+        shard_type& s = shard( key );
+        s.set( std::move( key ), std::move( value ) );
+    }
+    template< class... Args >
+    void emplace( const K& key, Args&&... args )
+    {
+        shard( key ).emplace( key, std::forward< Args >( args )... );
+    }
+    template< class... Args >
+    void emplace( K&& key, Args&&... args )
+    {
+        shard_type& s = shard( key );
+        s.emplace( std::move( key ), std::forward< Args >( args )... );
+    }
+    template< class... Args >
+    bool try_emplace( const K& key, Args&&... args )
+    {
+        return shard( key ).try_emplace( key, std::forward< Args >( args )... );
+    }
+    template< class... Args >
+    bool try_emplace( K&& key, Args&&... args )
+    {
+        shard_type& s = shard( key );
+        return s.try_emplace( std::move( key ), std::forward< Args >( args )... );
+    }
+    // Пакетная запись, сегмент блокируется один раз на часть пакета
+    void multi_set( const std::pair< K, T >* items, size_t count )
+    {
+        handle data[batchChunk];
+        size_t weights[batchChunk];
+        for( size_t first = 0; first < count; first += batchChunk )
+        {
+            size_t n = std::min( batchChunk, count - first );
+            for( size_t j = 0; j < n; ++j )
+            {
+                shard_type& s = shard( items[first + j].first );
+                data[j] = s.makeValue( items[first + j].second );
+                weights[j] = s.m_weigher( items[first + j].first, *data[j] );
+            }
+            forEachShard( items + first, n, [&]( shard_type& s, const size_t* which, const size_t* hashes, size_t m )
+            {
+                if( s.m_size == 0 )
+                    return;
+                bool wakeup = false;
+                {
+                    auto lg = s.lockExclusive();
+                    auto curTime = s.getCurrTime();
+                    if( s.m_lazyBatch != 0 )
+                        s.expireFront( curTime, s.m_lazyBatch * m );
+                    for( size_t j = 0; j < m; ++j )
+                        wakeup |= s.setLocked( items[first + which[j]].first, hashes[j], data[which[j]], weights[which[j]], curTime );
+                }
+                if( wakeup )
+                    s.scheduleCleaner();
+            } );
+            std::fill( data, data + n, handle() );
+        }
+    }
+    size_t size() const
+    {
+        size_t result = 0;
+        for( auto& s : m_shards )
+            result += s->size();
+        return result;
+    }
+    size_t capacity() const
+    {
+        return m_size;
+    }
+    size_t weighted_size() const
+    {
+        size_t result = 0;
+        for( auto& s : m_shards )
+            result += s->weighted_size();
+        return result;
+    }
+    CacheStatsSnapshot stats() const
+    {
+        CacheStatsSnapshot result;
+        for( auto& s : m_shards )
+            result += s->stats();
+        return result;
+    }
+    size_t shards() const
+    {
+        return m_shards.size();
+    }
+    void clear()
+    {
+        for( auto& s : m_shards )
+            s->clear();
+    }
+    bool erase( const K& key )
+    {
+        return shard( key ).erase( key );
+    }
+    // Для FrontCache, версии ключей у каждого сегмента свои, см. TimedCache::key_version
+    bool versioned() const
+    {
+        return m_shards.front()->versioned();
+    }
+    uint64_t key_version( size_t hash ) const
+    {
+        return m_shards[shardOf( hash )]->key_version( hash );
+    }
+    handle get_versioned( const K& key, size_t hash, uint64_t& version, time_point& expires )
+    {
+        return m_shards[shardOf( hash )]->get_versioned( key, hash, version, expires );
+    }
+    // Один слушатель на все сегменты, его очередь принимает события из разных блокировок
+    void set_removal_listener( RemovalListener< K, T >* listener )
+    {
+        for( auto& s : m_shards )
+            s->set_removal_listener( listener );
+    }
+private:
+    static constexpr size_t batchChunk = shard_type::batchChunk;
+
+    static const K& keyOf( const K& key )
+    {
+        return key;
+    }
+    static const K& keyOf( const std::pair< K, T >& item )
+    {
+        return item.first;
+    }
+    size_t shardOf( size_t hash ) const
+    {
+        if( m_shards.size() == 1 )
+            return 0;
+        // Внутри сегмента корзина выбирается по младшим битам хэша,
+        // поэтому сегмент берем по старшим битам перемешанного хэша
+        return size_t( ( uint64_t( hash ) * 0x9E3779B97F4A7C15ull ) >> m_shift );
+    }
+    template< class Q >
+    shard_type& shard( const Q& key )
+    {
+        return *m_shards[shardOf( m_hash( key ) )];
+    }
+    // Разбивает пакет на части по batchChunk и внутри части группирует элементы по сегментам.
+    // fn( shard, which, hashes, n ) получает номера элементов сегмента и их хэши.
+    template< class Item, class Fn >
+    void forEachShard( const Item* items, size_t count, Fn&& fn )
+    {
+        size_t hashes[batchChunk];
+        size_t shards[batchChunk];
+        size_t which[batchChunk];
+        size_t groupHashes[batchChunk];
+        for( size_t first = 0; first < count; first += batchChunk )
+        {
+            size_t n = std::min( batchChunk, count - first );
+            for( size_t j = 0; j < n; ++j )
+            {
+                hashes[j] = m_hash( keyOf( items[first + j] ) );
+                shards[j] = shardOf( hashes[j] );
+            }
+            for( size_t j = 0; j < n; ++j )
+            {
+                if( shards[j] == npos )
+                    continue;
+                size_t current = shards[j];
+                size_t m = 0;
+                for( size_t k = j; k < n; ++k )
+                {
+                    if( shards[k] != current )
+                        continue;
+                    which[m] = first + k;
+                    groupHashes[m] = hashes[k];
+                    ++m;
+                    shards[k] = npos;
+                }
+                fn( *m_shards[current], which, groupHashes, m );
+            }
+        }
+    }
+
+    static constexpr size_t npos = size_t( -1 );
+
+    size_t m_size = 0;
+    unsigned m_shift = 0;
+    CacheKeyHash< K > m_hash;
+    std::vector< std::unique_ptr< shard_type > > m_shards;
+};
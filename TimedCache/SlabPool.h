@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <algorithm>
+#include <functional>
+#include <memory_resource>
+#include <mutex>
+
+// Пул блоков одного размера для значений кэша.
+// Кэш всегда заполнен, поэтому каждый set() освобождает одно значение и создает другое.
+// Пул раздает блоки из одного заранее выделенного куска (slab) и возвращает освобожденные
+// в список свободных, так что в установившемся режиме обращений к куче нет.
+// Размер блока задает первый запрос (у кэша все значения одного типа, значит, и одного размера).
+// Запросы другого размера и запросы сверх емкости уходят в upstream.
+class SlabPool : public std::pmr::memory_resource
+{
+public:
+    // @param blocks - число блоков в slab
+    // @param upstream - откуда брать slab и блоки, которые в него не поместились
+    explicit SlabPool( size_t blocks, std::pmr::memory_resource* upstream = std::pmr::new_delete_resource() )
+        : m_blocks( std::max< size_t >( blocks, 1 ) ), m_upstream( upstream )
+    {
+    }
+    SlabPool( const SlabPool& ) = delete;
+    SlabPool& operator = ( const SlabPool& ) = delete;
+    ~SlabPool() override
+    {
+        if( m_slab )
+            m_upstream->deallocate( m_slab, m_blockSize * m_blocks, alignof( std::max_align_t ) );
+    }
+
+    // Для пула, которым владеет кэш: значения (handle) могут пережить кэш, поэтому
+    // пул удаляется, только когда вернется последний блок.
+    struct Releaser
+    {
+        void operator()( SlabPool* pool ) const
+        {
+            pool->release();
+        }
+    };
+
+    size_t blockSize() const
+    {
+        std::lock_guard lg( m_lock );
+        return m_blockSize;
+    }
+    // Сколько блоков сейчас выдано, из slab и из upstream
+    size_t used() const
+    {
+        std::lock_guard lg( m_lock );
+        return m_used;
+    }
+private:
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    void* do_allocate( size_t bytes, size_t alignment ) override
+    {
+        {
+            std::lock_guard lg( m_lock );
+            if( !m_slab && alignment <= alignof( std::max_align_t ) )
+                createSlab( bytes );
+            ++m_used;
+            if( fits( bytes, alignment ) && m_free )
+            {
+                FreeBlock* block = m_free;
+                m_free = block->next;
+                return block;
+            }
+        }
+        try
+        {
+            return m_upstream->allocate( bytes, alignment );
+        }
+        catch( ... )
+        {
+            std::lock_guard lg( m_lock );
+            --m_used;
+            throw;
+        }
+    }
+    void do_deallocate( void* p, size_t bytes, size_t alignment ) override
+    {
+        bool destroy = false;
+        {
+            std::lock_guard lg( m_lock );
+            if( inSlab( p ) )
+            {
+                FreeBlock* block = static_cast< FreeBlock* >( p );
+                block->next = m_free;
+                m_free = block;
+            }
+            else
+                m_upstream->deallocate( p, bytes, alignment );
+            --m_used;
+            destroy = m_released && m_used == 0;
+        }
+        if( destroy )
+            delete this;
+    }
+    bool do_is_equal( const std::pmr::memory_resource& other ) const noexcept override
+    {
+        return this == &other;
+    }
+
+    void release()
+    {
+        bool destroy = false;
+        {
+            std::lock_guard lg( m_lock );
+            m_released = true;
+            destroy = m_used == 0;
+        }
+        if( destroy )
+            delete this;
+    }
+    void createSlab( size_t bytes )
+    {
+        const size_t align = alignof( std::max_align_t );
+        m_blockSize = std::max( ( bytes + align - 1 ) / align * align, sizeof( FreeBlock ) );
+        m_slab = static_cast< char* >( m_upstream->allocate( m_blockSize * m_blocks, align ) );
+        for( size_t i = m_blocks; i > 0; --i )
+        {
+            FreeBlock* block = reinterpret_cast< FreeBlock* >( m_slab + ( i - 1 ) * m_blockSize );
+            block->next = m_free;
+            m_free = block;
+        }
+    }
+    bool fits( size_t bytes, size_t alignment ) const
+    {
+        return m_slab && alignment <= alignof( std::max_align_t ) && bytes <= m_blockSize &&
+            bytes + alignof( std::max_align_t ) > m_blockSize;
+    }
+    bool inSlab( void* p ) const
+    {
+        std::less_equal< const char* > le;
+        const char* c = static_cast< const char* >( p );
+        return m_slab && le( m_slab, c ) && !le( m_slab + m_blockSize * m_blocks, c );
+    }
+
+    mutable std::mutex m_lock;
+    const size_t m_blocks;
+    std::pmr::memory_resource* m_upstream;
+    size_t m_blockSize = 0;
+    char* m_slab = nullptr;
+    FreeBlock* m_free = nullptr;
+    size_t m_used = 0;
+    bool m_released = false;
+};
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "CacheKeyHash.h"
+#include "CacheSerializer.h"
+#include "FlatIndex.h"
+#include "MappedFile.h"
+
+// Второй уровень кэша (TwoTierCache): объекты, вытесненные из памяти, в файле,
+// отображенном в память. Файл - кольцевой журнал: записи дописываются подряд,
+// а на месте, которое нужно новой записи, самые старые записи затираются.
+// Удаленная или забранная обратно в память запись место не освобождает,
+// оно вернется, когда до него дойдет журнал.
+// Индекс компактный: ключи лежат только в файле, в памяти на запись - смещение, размеры,
+// срок и хэш (40 байт) плюс ячейка FlatIndex. Число записей ограничено entries.
+// Ключи и значения пишутся через CacheSerializer. Сам не синхронизирован.
+// Файл удаляется в деструкторе: после перезапуска журнал не читается.
+template< class K, class T, class Clock >
+class SpillTier
+{
+    using index = FlatIndex::index;
+public:
+    using time_point = typename Clock::time_point;
+
+    // Счетчики, см. stats()
+    struct Counters
+    {
+        // Записано и забрано обратно
+        uint64_t writes = 0;
+        uint64_t hits = 0;
+        // Затерто журналом до того, как понадобилось
+        uint64_t overwritten = 0;
+        // Найдено "протухшим"
+        uint64_t expired = 0;
+        // Не записано: больше файла или уже "протухло"
+        uint64_t rejected = 0;
+    };
+
+    // @param bytes - размер файла
+    // @param entries - наибольшее число записей в индексе
+    SpillTier( const std::string& path, size_t bytes, size_t entries )
+        : m_path( path ), m_file( std::make_unique< WritableMappedFile >( path, bytes ) ),
+        m_records( std::max< size_t >( entries, 1 ) ), m_index( std::max< size_t >( entries, 1 ) )
+    {
+        if( m_records.size() >= FlatIndex::npos )
+            throw std::length_error( "SpillTier: too many entries" );
+    }
+    SpillTier( const SpillTier& ) = delete;
+    SpillTier& operator = ( const SpillTier& ) = delete;
+    ~SpillTier()
+    {
+        m_file.reset();
+        std::error_code ec;
+        std::filesystem::remove( m_path, ec );
+    }
+
+    // Записывает объект, прежняя запись ключа, если была, забывается.
+    // @param expires - срок, до которого объект жил бы в памяти
+    // @return false, если объект не записан: "протух" или больше файла
+    bool put( const K& key, const T& value, time_point expires, time_point now )
+    {
+        size_t hash = m_hash( key );
+        serializeKey( key );
+        if( index i = find( hash ); i != npos )
+            drop( i );
+        if( expires <= now )
+        {
+            ++m_counters.rejected;
+            return false;
+        }
+        size_t keySize = m_buffer.size();
+        CacheSerializer< T >::write( m_buffer, value );
+        uint64_t size = headerSize + m_buffer.size();
+        uint64_t fileSize = m_file->size();
+        if( size > fileSize )
+        {
+            ++m_counters.rejected;
+            return false;
+        }
+        // Запись не разрывается концом файла
+        uint64_t start = m_end;
+        if( start % fileSize + size > fileSize )
+            start += fileSize - start % fileSize;
+        // Освобождаем место: затираются самые старые записи, с которыми новая делит байты файла
+        while( m_count != 0 && ( m_count == m_records.size() || m_records[m_first].start + fileSize < start + size ) )
+            popOldest();
+
+        index i = index( ( m_first + m_count ) % m_records.size() );
+        ++m_count;
+        Record& record = m_records[i];
+        record.start = start;
+        record.keySize = uint32_t( keySize );
+        record.size = uint32_t( size );
+        record.expires = expires;
+        record.hash = hash;
+        record.live = true;
+        char* p = m_file->data() + start % fileSize;
+        uint32_t header[2] = { uint32_t( keySize ), uint32_t( m_buffer.size() - keySize ) };
+        std::memcpy( p, header, headerSize );
+        std::memcpy( p + headerSize, m_buffer.data(), m_buffer.size() );
+        m_end = start + size;
+        link( i );
+        ++m_counters.writes;
+        return true;
+    }
+    // Забирает объект: запись удаляется, объект возвращается в память.
+    // @param expires - срок объекта
+    std::optional< T > take( const K& key, time_point now, time_point& expires )
+    {
+        size_t hash = m_hash( key );
+        serializeKey( key );
+        index i = find( hash );
+        if( i == npos )
+            return std::optional< T >();
+        Record& record = m_records[i];
+        drop( i );
+        if( record.expires <= now )
+        {
+            ++m_counters.expired;
+            return std::optional< T >();
+        }
+        const char* p = m_file->data() + record.start % m_file->size() + headerSize + record.keySize;
+        const char* end = m_file->data() + record.start % m_file->size() + record.size;
+        expires = record.expires;
+        ++m_counters.hits;
+        return std::optional< T >( CacheSerializer< T >::read( p, end ) );
+    }
+    bool erase( const K& key )
+    {
+        serializeKey( key );
+        index i = find( m_hash( key ) );
+        if( i == npos )
+            return false;
+        drop( i );
+        return true;
+    }
+    void clear()
+    {
+        for( ; m_count != 0; --m_count, m_first = ( m_first + 1 ) % m_records.size() )
+            m_records[m_first].live = false;
+        m_index.clear();
+        m_live = 0;
+    }
+    // Записей в индексе, в том числе "протухших", но еще не найденных
+    size_t size() const
+    {
+        return m_live;
+    }
+    size_t bytes() const
+    {
+        return m_file->size();
+    }
+    const Counters& stats() const
+    {
+        return m_counters;
+    }
+private:
+    static constexpr index npos = FlatIndex::npos;
+    // Заголовок записи в файле: размеры ключа и значения
+    static constexpr size_t headerSize = 2 * sizeof( uint32_t );
+
+    struct Record
+    {
+        // Смещение от начала журнала, в файле - по модулю его размера
+        uint64_t start = 0;
+        uint32_t keySize = 0;
+        uint32_t size = 0;
+        time_point expires{};
+        size_t hash = 0;
+        bool live = false;
+    };
+
+    // Ключ для сравнения с файлом - в m_buffer
+    void serializeKey( const K& key )
+    {
+        m_buffer.clear();
+        CacheSerializer< K >::write( m_buffer, key );
+    }
+    index find( size_t hash ) const
+    {
+        return m_index.find( hash, [&]( index i )
+        {
+            const Record& record = m_records[i];
+            return record.hash == hash && record.keySize == m_buffer.size() &&
+                std::memcmp( m_file->data() + record.start % m_file->size() + headerSize, m_buffer.data(), m_buffer.size() ) == 0;
+        } );
+    }
+    void link( index i )
+    {
+        m_index.insert( m_records[i].hash, i );
+        ++m_live;
+    }
+    void drop( index i )
+    {
+        m_index.erase( m_records[i].hash, i );
+        m_records[i].live = false;
+        --m_live;
+    }
+    void popOldest()
+    {
+        if( m_records[m_first].live )
+        {
+            ++m_counters.overwritten;
+            drop( index( m_first ) );
+        }
+        m_first = ( m_first + 1 ) % m_records.size();
+        --m_count;
+    }
+
+    std::string m_path;
+    std::unique_ptr< WritableMappedFile > m_file;
+    // Записи в порядке журнала: m_first - самая старая, всего m_count
+    std::vector< Record > m_records;
+    size_t m_first = 0;
+    size_t m_count = 0;
+    size_t m_live = 0;
+    // Конец журнала: куда пойдет следующая запись, по модулю размера файла
+    uint64_t m_end = 0;
+    FlatIndex m_index;
+    CacheKeyHash< K > m_hash;
+    // Сериализованные ключ и значение, память переиспользуется
+    std::string m_buffer;
+    Counters m_counters;
+};
@@ -1,13 +1,52 @@
 #pragma once
 
+#include <cstdio>
 #include <sstream>
 #include <random>
 #include <string>
 #include <chrono>
 #include <iomanip>
+#include <cmath>
 #include <numeric>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <vector>
+#include <thread>
+
+#if defined( _WIN32 )
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined( __linux__ )
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "ICache.h"
+#include "LatencyHistogram.h"
+#include "TimedCache.h"
+#include "Workload.h"
+
+// Привязывает текущий поток к процессору cpu (по модулю числа процессоров).
+// @return false, если платформа не поддерживается или привязка не удалась
+inline bool PinThread( size_t cpu )
+{
+    size_t cpus = std::max< size_t >( std::thread::hardware_concurrency(), 1 );
+#if defined( _WIN32 )
+    return SetThreadAffinityMask( GetCurrentThread(), DWORD_PTR( 1 ) << ( cpu % cpus % 64 ) ) != 0;
+#elif defined( __linux__ )
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    CPU_SET( int( cpu % cpus ), &set );
+    return pthread_setaffinity_np( pthread_self(), sizeof( set ), &set ) == 0;
+#else
+    ( void )cpu;
+    return false;
+#endif
+}
 
 class Timer
 {
@@ -81,11 +120,92 @@ private:
     select_clock::duration   t_base = {};
 };
 
+// Стоимость set/get и точность удаления по времени.
+// Заполняем кэш count объектами, читаем их, добавляем еще один и ждем, пока фоновый поток очистит кэш.
+// Опоздание - насколько позже времени жизни кэш опустел.
+template< class Cache, class Rep, class Period >
+void ExpiryAccuracy( std::ostream& os, const std::string& name, Cache& cache,
+    const std::chrono::duration< Rep, Period >& ttl, size_t count )
+{
+    using namespace std::chrono;
+
+    cache.clear();
+    Timer timer;
+    timer.start();
+    for( size_t i = 0; i < count; ++i )
+        cache.set( i, std::to_string( i ) );
+    timer.stop();
+    double setCost = double( timer.t< nanoseconds >() ) / count;
+
+    timer.start();
+    for( size_t i = 0; i < count; ++i )
+        cache.get( i );
+    timer.stop();
+    double getCost = double( timer.t< nanoseconds >() ) / count;
+
+    // Последний добавленный объект удаляется позже всех, отсчитываем от него
+    cache.set( count, std::to_string( count ) );
+    auto start = high_resolution_clock::now();
+    while( cache.size() != 0 && high_resolution_clock::now() - start < ttl * 10 + seconds( 1 ) )
+        std::this_thread::sleep_for( microseconds( 100 ) );
+    auto late = duration_cast< microseconds >( high_resolution_clock::now() - start - ttl );
+
+    os << std::setw( 40 ) << name << "\tset: " << std::setw( 6 ) << std::setprecision( 4 ) << setCost << " ns"
+        << "\tget: " << std::setw( 6 ) << getCost << " ns"
+        << "\texpiry late: " << std::setw( 8 ) << late.count() << " us\n";
+}
+
+// Быстрый старт: запись снимка count объектов и загрузка его в пустой кэш против count вызовов set()
+template< class Cache, class Rep, class Period >
+void SnapshotSpeed( std::ostream& os, const std::string& path, size_t count, const std::chrono::duration< Rep, Period >& ttl )
+{
+    using namespace std::chrono;
+
+    Timer timer;
+    Cache source( count, ttl );
+    timer.start();
+    for( size_t i = 0; i < count; ++i )
+        source.set( i, std::to_string( i ) );
+    timer.stop();
+    auto setTime = timer.t< microseconds >();
+
+    timer.start();
+    source.save_snapshot( path );
+    timer.stop();
+    auto saveTime = timer.t< microseconds >();
+
+    Cache target( count, ttl );
+    timer.start();
+    size_t loaded = target.load_snapshot( path );
+    timer.stop();
+    auto loadTime = timer.t< microseconds >();
+    std::remove( path.c_str() );
+
+    os << "Snapshot. Count = " << count << "\tset(): " << setTime / 1000 << " ms"
+        << "\tsave: " << saveTime / 1000 << " ms\tload: " << loadTime / 1000 << " ms (" << loaded << " objects)\n\n";
+}
+
 class TestPerfomance
 {
     size_t m_size;
     size_t m_random_iteration;
     size_t m_max_w_name = 0;
+    size_t m_batch = 0;
+    size_t m_minValue = 0;
+    size_t m_maxValue = 0;
+    size_t m_hot = 0;
+    double m_scanShare = 0.0;
+    std::vector< size_t > m_threads;
+    double m_readShare = 1.0;
+    std::chrono::milliseconds m_duration{ 0 };
+    size_t m_burst = 0;
+    std::chrono::milliseconds m_burstPeriod{ 0 };
+    std::optional< Workload > m_workload;
+    std::shared_ptr< TraceFile > m_trace;
+    std::string m_traceName;
+    bool m_paced = false;
+    std::vector< size_t > m_curveSizes;
+    std::vector< std::chrono::milliseconds > m_curveTtls;
     bool m_debug = false;
 public:
 
@@ -96,6 +216,69 @@ public:
         m_size = size;
         m_random_iteration = random_iteration;
     }
+    // @param batch - размер пакета для multi_get/multi_set, 0 - поэлементные get/set
+    void SetBatch( size_t batch )
+    {
+        m_batch = batch;
+    }
+    // Значения разного размера от minSize до maxSize байт (логарифмически равномерно),
+    // размер зависит только от ключа. maxSize == 0 - значение std::to_string( key ).
+    // minSize меньше 1 считается 1 (логарифмическая шкала), maxSize меньше minSize - minSize.
+    void SetValueSizes( size_t minSize, size_t maxSize )
+    {
+        m_minValue = maxSize == 0 ? 0 : std::max< size_t >( minSize, 1 );
+        m_maxValue = maxSize == 0 ? 0 : std::max( maxSize, m_minValue );
+    }
+    // Частые ключи вперемешку с проходом по ключам, которые больше не встретятся:
+    // с вероятностью scanShare - следующий ключ прохода, иначе - случайный из hot частых.
+    // 0 - равномерно по всему диапазону
+    void SetScan( size_t hot, double scanShare )
+    {
+        m_hot = hot;
+        m_scanShare = scanShare;
+    }
+    // Многопоточный режим вместо random(): для каждого числа потоков из threads потоки
+    // в течение duration работают с одним кэшем. Доля readShare операций - get (при промахе set),
+    // остальные - set. Результат: операций в секунду и перцентили задержки одной операции.
+    // Пустой threads - однопоточный режим.
+    void SetConcurrent( const std::vector< size_t >& threads, double readShare, std::chrono::milliseconds duration )
+    {
+        m_threads = threads;
+        m_readShare = readShare;
+        m_duration = duration;
+    }
+    // Для многопоточного режима: отдельный поток каждые period записывает пачкой count новых ключей
+    // (больше size, не повторяются), и все они "протухают" почти одновременно - так проверяется,
+    // мешает ли чистка читателям. Запись пачки не замеряется. 0 - без пачек.
+    void SetBurst( size_t count, std::chrono::milliseconds period )
+    {
+        m_burst = count;
+        m_burstPeriod = period;
+    }
+    // Распределение ключей вместо равномерного (и вместо SetScan)
+    void SetWorkload( const Workload& workload )
+    {
+        m_workload = workload;
+    }
+    // Запросы из файла трассы (см. Workload.h) вместо генератора. Кэши из PushCache
+    // работают по настоящим часам, поэтому сроки жизни соблюдаются, только если paced:
+    // каждый запрос ждет своей метки времени трассы, и время замера - это длина трассы.
+    // Без paced трасса проигрывается подряд, и отчет предупреждает, что время жизни
+    // не моделируется. В SetCurve метки времени задают время всегда (ManualClock).
+    void SetTrace( const std::string& path, bool paced = false )
+    {
+        m_trace = std::make_shared< TraceFile >( path );
+        m_traceName = path;
+        m_paced = paced;
+    }
+    // После основного теста - доля попаданий TimedCache для каждого размера из sizes
+    // и времени жизни из ttls, чтобы подобрать их без запуска сервиса.
+    // Время задает ManualClock: по меткам трассы, для генератора - 1 мкс на запрос.
+    void SetCurve( const std::vector< size_t >& sizes, const std::vector< std::chrono::milliseconds >& ttls )
+    {
+        m_curveSizes = sizes;
+        m_curveTtls = ttls;
+    }
     void debug( bool useDebug = true )
     {
         m_debug = useDebug;
@@ -120,13 +303,54 @@ public:
         }
         os << endl << endl;
 
-        random( m_random_iteration, m_size, os );
+        if( m_trace )
+            replay( os );
+        else if( !m_threads.empty() )
+            concurrent( m_size, os );
+        else if( m_batch != 0 )
+            randomBatch( m_random_iteration, m_size, m_batch, os );
+        else
+            random( m_random_iteration, m_size, os );
+        if( !m_curveSizes.empty() )
+            curve( os );
     }
 
 private:
+    // Последовательность запросов, одинаковая для всех кэшей
+    class KeyGenerator
+    {
+    public:
+        // @param seed - для многопоточного режима у каждого потока своя последовательность
+        KeyGenerator( const TestPerfomance& test, size_t size, uint64_t seed = 100 )
+            : m_mt64( seed ), m_uniform( 0, size ), m_hot( 0, test.m_hot == 0 ? 0 : test.m_hot - 1 ),
+            m_scanShare( test.m_hot == 0 ? 0.0 : test.m_scanShare ), m_scan( std::max( size, test.m_hot ) + 1 )
+        {
+            if( test.m_workload )
+                m_stream.emplace( *test.m_workload, size, seed );
+        }
+        size_t operator()()
+        {
+            if( m_stream )
+                return ( *m_stream )();
+            if( m_scanShare == 0.0 )
+                return m_uniform( m_mt64 );
+            if( m_share( m_mt64 ) < m_scanShare )
+                return m_scan++;
+            return m_hot( m_mt64 );
+        }
+    private:
+        std::mt19937_64 m_mt64;
+        std::uniform_int_distribution< size_t > m_uniform;
+        std::uniform_int_distribution< size_t > m_hot;
+        std::uniform_real_distribution< double > m_share{ 0.0, 1.0 };
+        double m_scanShare;
+        size_t m_scan;
+        std::optional< KeyStream > m_stream;
+    };
+
     void random( size_t countIteration, size_t size, std::ostream& os )
     {
-        os << countIteration << " times. RANDOM() . Count = " << size << '\n';
+        os << countIteration << " times. RANDOM() . Count = " << size << valueSizes() << keys() << '\n';
         Timer timer;
 
         for( auto& cache : m_Caches )
@@ -134,20 +358,62 @@ private:
             cache->clear();
 
             size_t cacheMiss = 0;
-            std::mt19937_64 mt64( 100 );
-            std::uniform_int<size_t> uniform{ 0, size };
+            KeyGenerator keys( *this, size );
             timer.start();
 
             for( size_t i = 0; i < countIteration; ++i )
             {
-                size_t v = uniform( mt64 );
+                size_t v = keys();
                 if( cache->get( v ) == nullptr )
                 {
-                    cache->set( v, std::to_string( v ) );
+                    cache->set( v, value( v ) );
                     cacheMiss++;
                 }
             }
 
+            timer.stop();
+            os << std::setw( m_max_w_name + 1 ) << cache->name();
+            timer.print( os );
+            os << "\tCache miss: " << cacheMiss << " from " << countIteration << " - " << double( countIteration - cacheMiss ) / countIteration * 100.0 << "%\n";
+            os << cache->details();
+        }
+        os << "\n\n";
+    }
+
+    // То же, что random(), но запросы идут пакетами: multi_get, затем multi_set для промахов
+    void randomBatch( size_t countIteration, size_t size, size_t batch, std::ostream& os )
+    {
+        os << countIteration << " times. RANDOM( batch = " << batch << " ) . Count = " << size << valueSizes() << keys() << '\n';
+        Timer timer;
+        std::vector< size_t > keys( batch );
+        std::vector< const std::string* > found( batch );
+        std::vector< std::pair< size_t, std::string > > misses;
+        misses.reserve( batch );
+
+        for( auto& cache : m_Caches )
+        {
+            cache->clear();
+
+            size_t cacheMiss = 0;
+            KeyGenerator generator( *this, size );
+            timer.start();
+
+            for( size_t i = 0; i < countIteration; i += batch )
+            {
+                size_t n = std::min( batch, countIteration - i );
+                for( size_t j = 0; j < n; ++j )
+                    keys[j] = generator();
+                cache->multi_get( keys.data(), n, found.data() );
+                misses.clear();
+                for( size_t j = 0; j < n; ++j )
+                {
+                    if( found[j] == nullptr )
+                        misses.emplace_back( keys[j], value( keys[j] ) );
+                }
+                cache->multi_set( misses.data(), misses.size() );
+                cacheMiss += misses.size();
+            }
+
             timer.stop();
             os << std::setw( m_max_w_name + 1 ) << cache->name();
             timer.print( os );
@@ -156,6 +422,282 @@ private:
         os << "\n\n";
     }
 
+    // То же, что random(), но запросы из трассы
+    void replay( std::ostream& os )
+    {
+        os << "TRACE( " << m_traceName << " ) . Records = " << m_trace->size() << valueSizes()
+            << ( m_paced ? ". Paced by trace timestamps" : ". Not paced: trace timestamps are ignored, TTL is not simulated" ) << '\n';
+        Timer timer;
+
+        for( auto& cache : m_Caches )
+        {
+            cache->clear();
+
+            size_t gets = 0;
+            size_t cacheMiss = 0;
+            timer.start();
+            auto start = std::chrono::steady_clock::now();
+
+            for( const TraceRecord& record : *m_trace )
+            {
+                if( m_paced )
+                    std::this_thread::sleep_until( start + std::chrono::nanoseconds( record.time() ) );
+                size_t v = size_t( record.key );
+                if( record.op() == TraceOp::Set )
+                {
+                    cache->set( v, value( v ) );
+                    continue;
+                }
+                ++gets;
+                if( cache->get( v ) == nullptr )
+                {
+                    cache->set( v, value( v ) );
+                    cacheMiss++;
+                }
+            }
+
+            timer.stop();
+            os << std::setw( m_max_w_name + 1 ) << cache->name();
+            timer.print( os );
+            os << "\tCache miss: " << cacheMiss << " from " << gets << " - "
+                << ( gets == 0 ? 0.0 : double( gets - cacheMiss ) / gets * 100.0 ) << "%\n";
+        }
+        os << "\n\n";
+    }
+
+    // Доля попаданий TimedCache по размерам и временам жизни, см. SetCurve()
+    void curve( std::ostream& os )
+    {
+        using namespace std::chrono;
+        using Cache = TimedCache< size_t, std::string, ManualClock >;
+
+        os << "HIT RATIO CURVE. " << ( m_trace ? "Trace = " + m_traceName
+            : std::to_string( m_random_iteration ) + " times. Count = " + std::to_string( m_size ) + keys() ) << '\n';
+        os << std::setw( 10 ) << "size";
+        for( auto ttl : m_curveTtls )
+            os << '\t' << std::setw( 8 ) << ( std::to_string( ttl.count() ) + "ms" );
+        os << '\n';
+
+        CacheOptions options;
+        options.expiry = ExpiryMode::Lazy;
+        for( size_t size : m_curveSizes )
+        {
+            os << std::setw( 10 ) << size;
+            for( auto ttl : m_curveTtls )
+            {
+                Cache cache( size, ttl, options );
+                size_t gets = 0;
+                size_t hits = 0;
+                // Значения пустые: для доли попаданий содержимое не важно
+                auto request = [&]( size_t key, TraceOp op )
+                {
+                    if( op == TraceOp::Set )
+                    {
+                        cache.set( key, std::string() );
+                        return;
+                    }
+                    ++gets;
+                    if( cache.get_handle( key ) )
+                        ++hits;
+                    else
+                        cache.set( key, std::string() );
+                };
+                auto start = ManualClock::now();
+                if( m_trace )
+                {
+                    for( const TraceRecord& record : *m_trace )
+                    {
+                        ManualClock::set( start + nanoseconds( record.time() ) );
+                        request( size_t( record.key ), record.op() );
+                    }
+                }
+                else
+                {
+                    KeyGenerator generator( *this, m_size );
+                    for( size_t i = 0; i < m_random_iteration; ++i )
+                    {
+                        ManualClock::advance( microseconds( 1 ) );
+                        request( generator(), TraceOp::Get );
+                    }
+                }
+                // Следующий прогон начинается после всех сроков этого
+                ManualClock::advance( ttl + seconds( 1 ) );
+                os << '\t' << std::setw( 7 ) << std::fixed << std::setprecision( 2 )
+                    << ( gets == 0 ? 0.0 : double( hits ) / gets * 100.0 ) << std::defaultfloat << '%';
+            }
+            os << '\n';
+        }
+        os << "\n\n";
+    }
+
+    // Результат одного потока в concurrent()
+    struct ThreadResult
+    {
+        LatencyHistogram latency;
+        size_t reads = 0;
+        size_t misses = 0;
+    };
+
+    void concurrent( size_t size, std::ostream& os )
+    {
+        using namespace std::chrono;
+        using select_clock = steady_clock;
+
+        os << "CONCURRENT( read = " << int( m_readShare * 100 ) << "%, " << m_duration.count() << " ms ) . Count = " << size
+            << valueSizes() << keys() << burst() << ". CPUs = " << std::thread::hardware_concurrency() << '\n';
+        os << std::setw( m_max_w_name + 1 ) << "cache" << "\tthreads\t     ops/sec\t  hit %"
+            << "\t  p50 ns\t  p99 ns\tp99.9 ns\t  max ns\n";
+
+        for( auto& cache : m_Caches )
+        {
+            for( size_t threadCount : m_threads )
+            {
+                // Прогрев: кэш заполнен, как в установившемся режиме
+                cache->clear();
+                KeyGenerator warmup( *this, size );
+                for( size_t i = 0; i < cache->capacity() * 2; ++i )
+                {
+                    size_t v = warmup();
+                    if( !cache->contains( v ) )
+                        cache->set( v, value( v ) );
+                }
+
+                std::vector< ThreadResult > results( threadCount );
+                std::atomic< size_t > ready{ 0 };
+                std::atomic_bool start{ false };
+                std::atomic_bool stop{ false };
+                std::vector< std::thread > threads;
+                for( size_t t = 0; t < threadCount; ++t )
+                {
+                    threads.emplace_back( [&, t]()
+                    {
+                        PinThread( t );
+                        ThreadResult result;
+                        KeyGenerator keys( *this, size, 100 + t );
+                        std::mt19937_64 mt64( 200 + t );
+                        std::uniform_real_distribution< double > share( 0.0, 1.0 );
+                        ++ready;
+                        while( !start )
+                            std::this_thread::yield();
+                        while( !stop.load( std::memory_order_relaxed ) )
+                        {
+                            size_t v = keys();
+                            bool read = share( mt64 ) < m_readShare;
+                            // Значение создаем вне замера
+                            std::string data = read ? std::string() : value( v );
+                            auto t0 = select_clock::now();
+                            bool miss = false;
+                            if( read )
+                                miss = !cache->contains( v );
+                            else
+                                cache->set( v, data );
+                            auto dt = select_clock::now() - t0;
+                            if( miss )
+                            {
+                                data = value( v );
+                                t0 = select_clock::now();
+                                cache->set( v, data );
+                                dt += select_clock::now() - t0;
+                            }
+                            result.latency.record( uint64_t( duration_cast< nanoseconds >( dt ).count() ) );
+                            if( read )
+                                ++result.reads;
+                            if( miss )
+                                ++result.misses;
+                        }
+                        results[t] = std::move( result );
+                    } );
+                }
+                if( m_burst != 0 )
+                {
+                    threads.emplace_back( [&]()
+                    {
+                        std::vector< std::pair< size_t, std::string > > items( m_burst );
+                        size_t next = size;
+                        while( !start )
+                            std::this_thread::yield();
+                        while( !stop.load( std::memory_order_relaxed ) )
+                        {
+                            for( auto& item : items )
+                            {
+                                item.first = next++;
+                                item.second = value( item.first );
+                            }
+                            cache->multi_set( items.data(), items.size() );
+                            std::this_thread::sleep_for( m_burstPeriod );
+                        }
+                    } );
+                }
+                while( ready != threadCount )
+                    std::this_thread::yield();
+                auto begin = select_clock::now();
+                start = true;
+                std::this_thread::sleep_for( m_duration );
+                stop = true;
+                auto elapsed = duration_cast< duration< double > >( select_clock::now() - begin );
+                for( auto& thread : threads )
+                    thread.join();
+
+                ThreadResult total;
+                for( auto& result : results )
+                {
+                    total.latency.merge( result.latency );
+                    total.reads += result.reads;
+                    total.misses += result.misses;
+                }
+                double hit = total.reads == 0 ? 0.0 : double( total.reads - total.misses ) / total.reads * 100.0;
+                os << std::setw( m_max_w_name + 1 ) << cache->name() << '\t' << std::setw( 7 ) << threadCount
+                    << '\t' << std::setw( 12 ) << uint64_t( double( total.latency.count() ) / elapsed.count() )
+                    << '\t' << std::setw( 7 ) << std::fixed << std::setprecision( 2 ) << hit << std::defaultfloat
+                    << '\t' << std::setw( 8 ) << total.latency.percentile( 0.5 )
+                    << '\t' << std::setw( 8 ) << total.latency.percentile( 0.99 )
+                    << '\t' << std::setw( 8 ) << total.latency.percentile( 0.999 )
+                    << '\t' << std::setw( 8 ) << total.latency.max() << '\n';
+            }
+        }
+        os << "\n\n";
+    }
+
+    std::string value( size_t key ) const
+    {
+        std::string result = std::to_string( key );
+        if( m_maxValue == 0 )
+            return result;
+        // splitmix64: размер случайный, но один и тот же для ключа
+        uint64_t h = key + 0x9E3779B97F4A7C15ull;
+        h = ( h ^ ( h >> 30 ) ) * 0xBF58476D1CE4E5B9ull;
+        h = ( h ^ ( h >> 27 ) ) * 0x94D049BB133111EBull;
+        h ^= h >> 31;
+        double u = double( h >> 11 ) / double( uint64_t( 1 ) << 53 );
+        size_t size = size_t( double( m_minValue ) * std::pow( double( m_maxValue ) / m_minValue, u ) );
+        result.resize( std::max( size, result.size() ), '*' );
+        return result;
+    }
+    std::string keys() const
+    {
+        if( m_workload )
+            return ". Keys = " + m_workload->name();
+        return scan();
+    }
+    std::string burst() const
+    {
+        if( m_burst == 0 )
+            return std::string();
+        return ". Burst = " + std::to_string( m_burst ) + " keys / " + std::to_string( m_burstPeriod.count() ) + " ms";
+    }
+    std::string scan() const
+    {
+        if( m_hot == 0 )
+            return std::string();
+        return ". Hot keys = " + std::to_string( m_hot ) + ", scan = " + std::to_string( int( m_scanShare * 100 ) ) + "%";
+    }
+    std::string valueSizes() const
+    {
+        if( m_maxValue == 0 )
+            return std::string();
+        return ". Value size = " + std::to_string( m_minValue ) + " - " + std::to_string( m_maxValue );
+    }
+
     std::vector< size_t > m_data;
     std::vector< ICache< size_t, std::string >* > m_Caches;
 };
\ No newline at end of file
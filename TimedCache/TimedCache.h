@@ -2,190 +2,1461 @@
 
 #include <cstdint>
 
-#include <atomic>
-#include <condition_variable>
-#include <thread>
 #include <mutex>
-#include <map>
-#include <unordered_map>
+#include <memory>
+#include <limits>
 #include <optional>
+#include <stdexcept>
 #include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
-// Вспомогательный класс, который позволяет усыплять и будить поток
-class Sleeper
+#include "BoundedExecutor.h"
+#include "CacheKeyHash.h"
+#include "CachePolicy.h"
+#include "CacheSerializer.h"
+#include "CacheStats.h"
+#include "Clock.h"
+#include "ExpirationService.h"
+#include "FrequencySketch.h"
+#include "FlatIndex.h"
+#include "FrontCache.h"
+#include "MappedFile.h"
+#include "ReadBuffer.h"
+#include "RemovalListener.h"
+#include "SlabPool.h"
+#include "TimingWheel.h"
+#include "Weigher.h"
+
+#if defined( _MSC_VER ) && ( defined( _M_X64 ) || defined( _M_IX86 ) )
+#include <xmmintrin.h>
+#define TIMED_CACHE_PREFETCH( p ) _mm_prefetch( reinterpret_cast< const char* >( p ), _MM_HINT_T0 )
+#elif defined( __GNUC__ ) || defined( __clang__ )
+#define TIMED_CACHE_PREFETCH( p ) __builtin_prefetch( p )
+#else
+#define TIMED_CACHE_PREFETCH( p ) ( (void)( p ) )
+#endif
+
+template< class K, class T, class Clock, class Stats, class Policy > class ShardedTimedCache;
+
+// Способ удаления "протухших" объектов
+enum class ExpiryMode
 {
-    std::mutex m_lock;
-    std::condition_variable m_cond;
-    std::atomic_bool flag = ATOMIC_VAR_INIT( false );
-public:
-    template< class Rep, class Period >
-    void sleep( const std::chrono::duration< Rep, Period >& relTime )
-    {
-        std::unique_lock ul( m_lock );
-        m_cond.wait_for( ul, relTime, [&](){ return flag.load(); } );
-        flag = false;
-    }
+    // Фоновой чисткой через ExpirationService
+    Background,
+    // Без фоновой чистки: при обращении к объекту и понемногу на каждом set()
+    Lazy
+};
 
-    void wakeUp()
-    {
-        flag = true;
-        m_cond.notify_one();
-    }
+// Допуск нового ключа в заполненный кэш
+enum class Admission
+{
+    // Всегда, вытесняется самый старый
+    Always,
+    // TinyLFU: новый ключ вытесняет самый старый, только если к нему обращались чаще
+    // (оценка по FrequencySketch). Разовый проход по множеству ключей не вымывает частые.
+    // Обращения считает только поиск (попадания и промахи), запись не считается: иначе
+    // обычный промах с последующим set() засчитывался бы кандидату дважды.
+    TinyLfu
 };
 
-template< class K, class T >
+// Дополнительные настройки кэша
+struct CacheOptions
+{
+    // Шаг колеса таймеров для удаления по времени. 0 - удаление по списку давности.
+    // С колесом фоновый поток просыпается не чаще раза за шаг, а объект удаляется
+    // не раньше своего срока и не позже, чем через шаг после него.
+    std::chrono::nanoseconds wheelTick{ 0 };
+    // Планировщик, который чистит кэш. nullptr - общий на процесс ExpirationService::instance().
+    ExpirationService* service = nullptr;
+    ExpiryMode expiry = ExpiryMode::Background;
+    // Фоновая чистка удаляет не больше sweepBatch объектов за одну блокировку, остальные -
+    // следующими проходами, между которыми блокировка отпускается и ждущие get() и set() проходят.
+    // Значения удаленных объектов разрушаются уже после освобождения блокировки.
+    // 0 - все "протухшие" объекты за одну блокировку.
+    size_t sweepBatch = 1024;
+    // То же по времени: проход прерывается, если блокировка удерживается дольше sweepTime. 0 - без ограничения.
+    std::chrono::microseconds sweepTime{ 0 };
+    // Для ExpiryMode::Lazy: сколько самых старых объектов проверяет каждый set().
+    // Больше одного, чтобы удаление обгоняло добавление. Колесо таймеров в этом режиме не создается.
+    size_t lazyBatch = 2;
+    // Чтение без исключительной блокировки. Попадания ищутся под распределенной блокировкой
+    // чтения и только записывают событие в буфер своего потока; перенос в конец очереди
+    // и продление жизни выполняются пачкой при следующей исключительной блокировке
+    // (set, фоновая чистка). При переполнении буфера часть продлений теряется.
+    // Запись в этом режиме дороже, режим рассчитан на 90%+ попаданий.
+    bool readBuffer = false;
+    // Память под значения (вместе со счетчиком ссылок handle). nullptr - обычный operator new.
+    std::pmr::memory_resource* resource = nullptr;
+    // Свой пул блоков под значения поверх resource, на size + size / 8 + 16 значений.
+    // Запас - под значения, которые еще держат снаружи через handle, и под set() в других потоках.
+    bool slabPool = false;
+    // Ограничение по памяти: суммарный вес объектов (CacheWeigher, для std::string - capacity()
+    // ключа и значения) не больше maxWeight байт. При добавлении вытесняются самые старые,
+    // пока новый объект не поместится; объект тяжелее maxWeight не сохраняется.
+    // Число объектов по-прежнему не больше size. 0 - только по числу объектов.
+    size_t maxWeight = 0;
+    Admission admission = Admission::Always;
+    // Обновление заранее для get_or_load: если с записи значения прошло больше
+    // (1 - refreshAhead) * relTime, get_or_load сразу возвращает текущее значение и ставит
+    // перезагрузку в executor. Так у часто читаемого ключа нет промаха на границе срока.
+    // Срок считается от записи, а не от последнего обращения: иначе горячий ключ не обновлялся бы никогда.
+    // 0 - выключено.
+    double refreshAhead = 0.0;
+    // Сколько "протухший" объект еще хранится после своего срока. get() его уже не видит,
+    // но если загрузка в get_or_load завершилась исключением, возвращается старое значение.
+    std::chrono::nanoseconds staleGrace{ 0 };
+    // Пул для перезагрузок. nullptr - общий на процесс BoundedExecutor::instance().
+    BoundedExecutor* executor = nullptr;
+    // Версии ключей для FrontCache - кэшей первого уровня в потоках. Каждое удаление и замена
+    // объекта пишет одну атомарную переменную под блокировкой; 32 KB на кэш (на сегмент).
+    bool frontCache = false;
+};
+
+// @param Clock - источник времени, см. Clock.h
+// @param Stats - статистика, см. CacheStats.h. NoStats ничего не стоит.
+// @param Policy - блокировка, удаление по времени и порядок вытеснения, см. CachePolicy.h
+template< class K, class T, class Clock = PreciseClock, class Stats = NoStats, class Policy = CachePolicy<> >
 class TimedCache
 {
+    using Locking = typename Policy::locking;
+    using Expiry = typename Policy::expiry;
+    using Eviction = typename Policy::eviction;
+    using Mutex = typename Locking::mutex;
     using tick = std::chrono::nanoseconds;
-    using timer = std::chrono::high_resolution_clock::time_point;
+    using timer = typename Clock::time_point;
+    using index = uint32_t;
+    static constexpr index npos = std::numeric_limits< index >::max();
+
+    // Ячейка хранилища. Все связи - это индексы в m_entries, поэтому
+    // перестановка и удаление элементов не выделяют и не освобождают память.
+    struct Entry
+    {
+        std::optional< K > key;
+        std::shared_ptr< const T > value;
+        timer time{};
+        // Время записи значения, для CacheOptions::refreshAhead
+        timer written{};
+        size_t hash = 0;
+        size_t weight = 0;
+        // Список по давности обращения: m_head - самый старый, m_tail - самый свежий.
+        // Время жизни у всех объектов одинаковое, поэтому это же и очередь на удаление по времени.
+        // У свободной ячейки next указывает на следующую свободную.
+        index prev = npos;
+        index next = npos;
+    };
 public:
     template< class Rep, class Period >
-    TimedCache( size_t size, const std::chrono::duration< Rep, Period >& relTime )
-        : m_maxDTime( std::chrono::duration_cast<std::chrono::nanoseconds>( relTime ) ),
-        m_size( size )
+    TimedCache( size_t size, const std::chrono::duration< Rep, Period >& relTime, const CacheOptions& options = {} )
+        : m_lock( sharedReads( options ) ),
+        m_size( size ),
+        m_maxDTime( Expiry::expires ? std::chrono::duration_cast<std::chrono::nanoseconds>( relTime ) : tick::max() ),
+        m_keepDTime( Expiry::expires ? m_maxDTime + options.staleGrace : tick::max() ),
+        m_maxWeight( options.maxWeight )
     {
-        startClenaer();
+        if( size >= npos )
+            throw std::length_error( "TimedCache: size is too large" );
+        // Кэш никогда не растет больше size, поэтому все выделяем сразу
+        m_entries.resize( size );
+        m_index = FlatIndex( size );
+        resetFreeList();
+        // Заодно запускаем часы, если им нужна инициализация (поток, калибровка)
+        m_start = getCurrTime();
+        m_resource = options.resource;
+        if( options.slabPool )
+        {
+            m_pool.reset( options.resource ? new SlabPool( size + size / 8 + 16, options.resource )
+                : new SlabPool( size + size / 8 + 16 ) );
+            m_resource = m_pool.get();
+        }
+        if( options.admission == Admission::TinyLfu )
+            m_sketch = std::make_unique< FrequencySketch >( size );
+        if( options.frontCache )
+            m_versions = std::make_unique< KeyVersions >();
+        if( sharedReads( options ) )
+            m_reads = std::make_unique< ReadBuffer< ReadEvent > >();
+        // Перезагрузка идет в другом потоке, а без срока жизни перезагружать нечего
+        if( Locking::threadSafe && Expiry::expires && options.refreshAhead > 0.0 )
+        {
+            m_refreshAfter = std::chrono::duration_cast< tick >(
+                m_maxDTime * ( 1.0 - std::min( options.refreshAhead, 1.0 ) ) );
+            m_executor = options.executor ? options.executor : &BoundedExecutor::instance();
+        }
+        if constexpr( !Expiry::expires )
+            return;
+        if( !Expiry::background || options.expiry == ExpiryMode::Lazy )
+        {
+            // Ни потока, ни задачи в планировщике
+            m_lazyBatch = std::max< size_t >( options.lazyBatch, 1 );
+            return;
+        }
+        if constexpr( Expiry::background )
+        {
+            if( options.wheelTick.count() > 0 )
+            {
+                m_tick = options.wheelTick;
+                m_wheel.emplace( size );
+            }
+            m_sweepBatch = options.sweepBatch != 0 ? options.sweepBatch : std::numeric_limits< size_t >::max();
+            m_sweepTime = options.sweepTime;
+            m_service = options.service ? options.service : &ExpirationService::instance();
+            m_task = m_service->add( [this]() { return updateCached(); } );
+        }
     }
     TimedCache( const TimedCache& ) = delete;
     TimedCache& operator = ( const TimedCache& ) = delete;
     ~TimedCache()
     {
-        stopCleaner();
+        // Перезагрузки обращаются к кэшу, дожидаемся их
+        {
+            std::unique_lock ul( m_loadLock );
+            m_refreshDone.wait( ul, [this]() { return m_refreshing == 0; } );
+        }
+        if( m_service )
+            m_service->remove( m_task );
     }
 
-    std::optional< T > get( const K& key )
-    {
-        std::lock_guard lg( m_lock );
-        // Выполняем поиск
-        auto iter = m_data.find( key );
-        if( iter == m_data.end() )
-            return std::optional< T >();
-
-        auto dt =
-            std::chrono::duration_cast<tick>(
-                getCurrTime() - iter->second.second );
+    // Разделяемый доступ к значению без копирования. Объект остается валидным,
+    // даже если его вытеснят или заменят, пока жив хотя бы один handle.
+    using handle = std::shared_ptr< const T >;
+    using key_type = K;
+    using mapped_type = T;
+    using time_point = timer;
 
-        T data = std::move( iter->second.first );
-        // Да, удаляем
-        m_key.erase( iter->second.second );
-        m_data.erase( iter );
+    // Время по часам кэша. Без срока жизни часы не читаются и время всегда одно.
+    static time_point now()
+    {
+        return getCurrTime();
+    }
 
-        // Пройденно время превышает максимальное?
-        if( dt >= m_maxDTime )
+    // Поиск и по ключу K, и по "прозрачному" ключу Q без создания временного K,
+    // например по std::string_view для ключей std::string (см. CacheKeyHash.h)
+    std::optional< T > get( const K& key )
+    {
+        return getValue( key );
+    }
+    template< class Q, class = std::enable_if_t< isLookupKey< K, Q > > >
+    std::optional< T > get( const Q& key )
+    {
+        return getValue( key );
+    }
+    handle get_handle( const K& key )
+    {
+        return getHandle( key );
+    }
+    template< class Q, class = std::enable_if_t< isLookupKey< K, Q > > >
+    handle get_handle( const Q& key )
+    {
+        return getHandle( key );
+    }
+    // Вызывает fn( const T& ) для найденного объекта вне блокировки.
+    // @return false, если объекта нет
+    template< class Fn >
+    bool get_with( const K& key, Fn&& fn )
+    {
+        return getWith( key, std::forward< Fn >( fn ) );
+    }
+    template< class Q, class Fn, class = std::enable_if_t< isLookupKey< K, Q > > >
+    bool get_with( const Q& key, Fn&& fn )
+    {
+        return getWith( key, std::forward< Fn >( fn ) );
+    }
+    // Пакетный поиск: одна блокировка и одно чтение часов на весь пакет,
+    // корзины хэш-таблицы подгружаются в кэш процессора заранее. Память не выделяется.
+    // @param out - буфер на count элементов, для ненайденных ключей - пустой handle
+    // @return число найденных
+    size_t multi_get( const K* keys, size_t count, handle* out )
+    {
+        size_t hashes[batchChunk];
+        size_t found = 0;
+        auto lg = lockExclusive();
+        auto currTime = getCurrTime();
+        for( size_t first = 0; first < count; first += batchChunk )
         {
-            if( m_data.size() == 0 )
-                stopCleaner();
-            return std::optional< T >();
+            size_t n = std::min( batchChunk, count - first );
+            prefetch( keys + first, hashes, n );
+            for( size_t j = 0; j < n; ++j )
+            {
+                out[first + j] = getLocked( keys[first + j], hashes[j], currTime );
+                if( out[first + j] )
+                    ++found;
+            }
         }
+        return found;
+    }
+    // Поиск с загрузкой при промахе. loader( key ) возвращает T и на каждый ключ
+    // выполняется только в одном потоке: остальные, кому нужен тот же ключ, ждут его результат
+    // (без блокировки кэша). Исключение загрузчика получают все ожидающие, в кэш оно не попадает,
+    // и следующий вызов попробует загрузить снова.
+    // С CacheOptions::refreshAhead значение в конце срока возвращается сразу, а loader
+    // (его копия) вызывается в executor. С CacheOptions::staleGrace при исключении загрузчика
+    // возвращается "протухшее" значение, если оно еще хранится.
+    template< class Loader >
+    handle get_or_load( const K& key, Loader&& loader )
+    {
+        handle stale;
+        if( m_executor || m_keepDTime != m_maxDTime )
+        {
+            bool refresh = false;
+            if( handle h = loadLookup( key, stale, refresh ) )
+            {
+                if( refresh )
+                    refreshAsync( key, loader );
+                return h;
+            }
+        }
+        else if( handle h = get_handle( key ) )
+            return h;
 
-        auto currTime = getCurrTime();
-        auto [obj, state] = m_data.insert( std::make_pair( key, std::make_pair( std::move( data) , currTime ) ) );
-        m_key.insert( std::make_pair( currTime, key ) );
+        std::shared_future< handle > loading;
+        std::promise< handle > promise;
+        {
+            std::lock_guard lg( m_loadLock );
+            auto iter = m_loading.find( key );
+            if( iter != m_loading.end() )
+                loading = iter->second;
+            else
+                m_loading.emplace( key, promise.get_future().share() );
+        }
+        // Уже загружается в другом потоке: ждем вне блокировок
+        if( loading.valid() )
+            return loading.get();
 
-        // Все ок, возращаем объект
-        return std::optional< T >( obj->second.first );
+        handle result;
+        try
+        {
+            // Пока регистрировались, значение могла положить только что закончившаяся загрузка
+            result = get_handle( key );
+            if( !result )
+            {
+                result = makeValue( std::forward< Loader >( loader )( key ) );
+                store( key, result );
+            }
+        }
+        catch( ... )
+        {
+            if( !stale )
+            {
+                promise.set_exception( std::current_exception() );
+                finishLoad( key );
+                throw;
+            }
+            // Источник недоступен, отдаем старое значение
+            result = stale;
+        }
+        promise.set_value( result );
+        finishLoad( key );
+        return result;
     }
+    // Память под значение выделяется до захвата блокировки. Ключ хранится один раз,
+    // в ячейке хранилища: индекс и очередь ссылаются на нее по номеру.
+    // Перегрузки с && перемещают ключ и значение без копирования.
     void set( const K& key, const T& value )
     {
+        store( key, makeValue( value ) );
+    }
+    void set( const K& key, T&& value )
+    {
+        store( key, makeValue( std::move( value ) ) );
+    }
+    void set( K&& key, const T& value )
+    {
+        store( std::move( key ), makeValue( value ) );
+    }
+    void set( K&& key, T&& value )
+    {
+        store( std::move( key ), makeValue( std::move( value ) ) );
+    }
+    // Как set(), но значение создается из args сразу в памяти кэша, без промежуточного T
+    template< class... Args >
+    void emplace( const K& key, Args&&... args )
+    {
+        store( key, makeValue( std::forward< Args >( args )... ) );
+    }
+    template< class... Args >
+    void emplace( K&& key, Args&&... args )
+    {
+        store( std::move( key ), makeValue( std::forward< Args >( args )... ) );
+    }
+    // Добавляет объект, только если ключа нет (или он "протух"). Как у std::map::try_emplace,
+    // если ключ есть, args не используются. Существующий объект при этом не продлевается.
+    // Значение создается вне блокировки, поэтому, если ключ успели добавить из другого потока,
+    // созданное значение выбрасывается.
+    // @return true, если ключа не было и объект передан в кэш (Admission::TinyLfu может его не пустить)
+    template< class... Args >
+    bool try_emplace( const K& key, Args&&... args )
+    {
+        return tryStore( key, std::forward< Args >( args )... );
+    }
+    template< class... Args >
+    bool try_emplace( K&& key, Args&&... args )
+    {
+        return tryStore( std::move( key ), std::forward< Args >( args )... );
+    }
+    // Пакетная запись. Значения создаются вне блокировки частями по batchChunk,
+    // блокировка и чтение часов - один раз на часть, замененные значения разрушаются вне блокировки.
+    void multi_set( const std::pair< K, T >* items, size_t count )
+    {
+        handle data[batchChunk];
+        size_t hashes[batchChunk];
+        size_t weights[batchChunk];
         bool wakeup = false;
+        for( size_t first = 0; first < count && m_size != 0; first += batchChunk )
         {
-            std::lock_guard lg( m_lock );
-           // Чистим, если размер кэша превышен
-            if( m_data.size() == m_size )
+            size_t n = std::min( batchChunk, count - first );
+            for( size_t j = 0; j < n; ++j )
             {
-                // В m_key у нас отсортированы по времени, берем первый.
-                auto old = m_key.begin();
-                m_data.erase( old->second );
-                m_key.erase( old );
+                data[j] = makeValue( items[first + j].second );
+                hashes[j] = m_hash( items[first + j].first );
+                weights[j] = m_weigher( items[first + j].first, *data[j] );
             }
-            auto curTime = getCurrTime();
-            m_key[curTime] = key;
-            m_data[key] = std::make_pair( value, curTime );
-            if( m_data.size() == 1 )
-                wakeup = true;
+            {
+                auto lg = lockExclusive();
+                auto curTime = getCurrTime();
+                if( m_lazyBatch != 0 )
+                    expireFront( curTime, m_lazyBatch * n );
+                for( size_t j = 0; j < n; ++j )
+                    wakeup |= setLocked( items[first + j].first, hashes[j], data[j], weights[j], curTime );
+            }
+            std::fill( data, data + n, handle() );
         }
-        // Появились новые объекты, надо разбудить поток
         if( wakeup )
-            wakeUp();
+            scheduleCleaner();
     }
+    // В ExpiryMode::Lazy учитывает и еще не удаленные "протухшие" объекты.
+    // Под блокировкой: счетчик меняет и фоновая чистка.
     size_t size() const
     {
-        return m_data.size();
+        std::lock_guard lg( m_lock );
+        return m_count;
     }
     size_t capacity() const
     {
         return m_size;
     }
-    void clear()
+    // Суммарный вес объектов, см. CacheOptions::maxWeight
+    size_t weighted_size() const
     {
         std::lock_guard lg( m_lock );
-        m_key.clear();
-        m_data.clear();
+        return m_weight;
+    }
+    // Снимок статистики. С NoStats - нули, с DetailedCacheStats берет исключительную блокировку.
+    CacheStatsSnapshot stats() const
+    {
+        CacheStatsSnapshot result;
+        if constexpr( Stats::histograms )
+        {
+            auto lg = lockExclusive();
+            m_stats.snapshot( result );
+        }
+        else
+            m_stats.snapshot( result );
+        return result;
+    }
+    // Вместе с объектами забывается и частота обращений для Admission::TinyLfu
+    void clear()
+    {
+        auto lg = lockExclusive();
+        while( m_head != npos )
+            remove( m_head, RemovalCause::Explicit );
+        if( m_sketch )
+            m_sketch->clear();
+    }
+    // Удаляет объект, в том числе "протухший", но еще хранящийся.
+    // @return false, если объекта не было
+    bool erase( const K& key )
+    {
+        size_t hash = m_hash( key );
+        // Объявлен до блокировки: значение разрушается после ее освобождения
+        handle value;
+        auto lg = lockExclusive();
+        index i = find( key, hash );
+        if( i == npos )
+            return false;
+        if( !m_listener )
+            value.swap( m_entries[i].value );
+        remove( i, RemovalCause::Explicit );
+        return true;
+    }
+    // Для FrontCache: создан ли кэш с CacheOptions::frontCache
+    bool versioned() const
+    {
+        return bool( m_versions );
+    }
+    // Версия ключей с хэшем hash: меняется при каждом удалении и замене объекта с таким хэшем.
+    // Без блокировки, ничего не пишет.
+    uint64_t key_version( size_t hash ) const
+    {
+        return m_versions->get( hash );
+    }
+    // Поиск для FrontCache: под той же блокировкой, что и значение, читает версию ключа
+    // и срок, до которого объект не "протухнет", если его не заменят и не удалят.
+    // @param hash - CacheKeyHash< K >()( key )
+    handle get_versioned( const K& key, size_t hash, uint64_t& version, time_point& expires )
+    {
+        auto lg = lockExclusive();
+        version = m_versions->get( hash );
+        index i = npos;
+        handle result = getLocked( key, hash, getCurrTime(), &i );
+        if( !result )
+            return result;
+        if constexpr( Expiry::expires )
+            expires = m_entries[i].time + m_maxDTime;
+        else
+            expires = time_point::max();
+        return result;
+    }
+    // Слушатель удалений, см. RemovalListener.h: ключ, значение и причина каждого удаления
+    // (время, место, erase/clear, замена в set). Под блокировкой кэша событие только кладется
+    // в очередь слушателя, обработчик вызывается в его потоке. nullptr - без слушателя.
+    // Слушатель должен жить дольше кэша.
+    void set_removal_listener( RemovalListener< K, T >* listener )
+    {
+        auto lg = lockExclusive();
+        m_listener = listener;
+    }
+    // Обработчик вытеснений ради места (size, maxWeight), для TwoTierCache: ключ, значение,
+    // срок, до которого объект жил бы в памяти, и метка stamp( hash ), снятая в момент вытеснения.
+    // Под блокировкой кэша вытеснение только запоминается (как события слушателя, не поместившиеся
+    // в его очередь), обработчик вызывается уже без блокировки, в потоке, который вытеснил объект.
+    // К этому времени ключ мог быть записан заново или удален - по метке обработчик узнает об этом.
+    // stamp вызывается под блокировкой и должен быть дешевым. nullptr - без обработчика или без метки.
+    using eviction_handler = std::function< void( const K& key, const handle& value, time_point expires, uint64_t stamp ) >;
+    using eviction_stamp = std::function< uint64_t( size_t hash ) >;
+    void set_eviction_handler( eviction_handler handler, eviction_stamp stamp = nullptr )
+    {
+        auto lg = lockExclusive();
+        m_evictionHandler = handler ? std::make_shared< const eviction_handler >( std::move( handler ) ) : nullptr;
+        m_evictionStamp = std::move( stamp );
+    }
+    // Для TwoTierCache: объект, вернувшийся со второго уровня. Если ключ уже есть, ничего не пишет:
+    // значит, его успели записать заново, и возвращает то, что в кэше. Срок - как будто объект
+    // не уходил из памяти: с LRU попадание на втором уровне - обычное обращение и продлевает объект,
+    // с FIFO срок прежний (expires) и объект встает в очередь по времени записи (см. reorder).
+    // @return значение в кэше
+    handle restore( const K& key, T&& value, time_point expires )
+    {
+        handle data = makeValue( std::move( value ) );
+        handle result = data;
+        size_t weight = m_weigher( key, *data );
+        size_t hash = m_hash( key );
+        bool wakeup = false;
+        {
+            auto lg = lockExclusive();
+            auto curTime = getCurrTime();
+            if( m_size == 0 )
+                return result;
+            if( containsLive( key, hash, curTime ) )
+                return m_entries[find( key, hash )].value;
+            if( m_lazyBatch != 0 )
+                expireFront( curTime, m_lazyBatch );
+            wakeup = setLocked( key, hash, data, weight, curTime );
+            if constexpr( !Eviction::promote && Expiry::expires )
+            {
+                index i = find( key, hash );
+                if( i != npos )
+                    reorder( i, expires - m_maxDTime );
+            }
+        }
+        if( wakeup )
+            scheduleCleaner();
+        return result;
+    }
+    // Снимок живых объектов для быстрого старта: ключ, значение (CacheSerializer) и остаток
+    // времени жизни, от самого свежего к самому старому. Кэш блокируется частями
+    // по snapshotChunk ячеек, сериализация и запись в файл - без блокировки, поэтому снимок
+    // не атомарен: объекты, измененные во время записи, могут попасть в него в любой версии.
+    // Пишется во временный файл, который затем переименовывается в path.
+    // @return число записанных объектов
+    size_t save_snapshot( const std::string& path ) const
+    {
+        struct Item
+        {
+            K key;
+            handle value;
+            timer time;
+        };
+        std::vector< Item > items;
+        // Под блокировкой: счетчик меняют set(), erase() и фоновая чистка
+        items.reserve( size() );
+        for( size_t first = 0; first < m_entries.size(); first += snapshotChunk )
+        {
+            auto lg = lockExclusive();
+            auto curTime = getCurrTime();
+            for( size_t i = first; i < std::min( first + snapshotChunk, m_entries.size() ); ++i )
+            {
+                const Entry& entry = m_entries[i];
+                if( entry.key && curTime - entry.time < m_maxDTime )
+                    items.push_back( Item{ *entry.key, entry.value, entry.time } );
+            }
+        }
+        // Ключ мог переехать в другую ячейку между частями: оставляем самую свежую версию
+        std::sort( items.begin(), items.end(), []( const Item& l, const Item& r ) { return l.time > r.time; } );
+        std::unordered_set< K > seen;
+        auto curTime = getCurrTime();
+
+        std::string tmpPath = path + ".tmp";
+        std::ofstream out( tmpPath, std::ios::binary | std::ios::trunc );
+        std::string buffer( snapshotMagic, sizeof( snapshotMagic ) );
+        CacheSerializer< uint64_t >::write( buffer, 0 );
+        size_t count = 0;
+        for( const Item& item : items )
+        {
+            auto remaining = m_maxDTime - std::max< tick >( curTime - item.time, tick( 0 ) );
+            if( remaining <= tick( 0 ) || !seen.insert( item.key ).second )
+                continue;
+            CacheSerializer< int64_t >::write( buffer, int64_t( remaining.count() ) );
+            CacheSerializer< K >::write( buffer, item.key );
+            CacheSerializer< T >::write( buffer, *item.value );
+            ++count;
+            if( buffer.size() >= snapshotBuffer )
+            {
+                out.write( buffer.data(), std::streamsize( buffer.size() ) );
+                buffer.clear();
+            }
+        }
+        out.write( buffer.data(), std::streamsize( buffer.size() ) );
+        // Число объектов - в заголовок
+        uint64_t count64 = count;
+        out.seekp( sizeof( snapshotMagic ) );
+        out.write( reinterpret_cast< const char* >( &count64 ), sizeof( count64 ) );
+        out.close();
+        if( !out )
+            throw std::runtime_error( "TimedCache: can't write snapshot " + tmpPath );
+        std::filesystem::rename( tmpPath, path );
+        return count;
+    }
+    // Загружает снимок save_snapshot() через отображение файла в память.
+    // Объекты сохраняют остаток времени жизни и порядок давности. Значения создаются
+    // вне блокировки, затем все объекты связываются за одну исключительную блокировку,
+    // без вытеснения и без допуска TinyLfu: загруженные объекты считаются старше уже
+    // лежащих в кэше, ключи, которые в кэше уже есть, пропускаются.
+    // Загрузка останавливается, когда кэш заполнен (size или maxWeight).
+    // @return число загруженных объектов
+    size_t load_snapshot( const std::string& path )
+    {
+        struct Item
+        {
+            K key;
+            handle value;
+            size_t hash;
+            size_t weight;
+            tick remaining;
+        };
+        std::vector< Item > items;
+        {
+            MappedFile file( path );
+            const char* p = file.data();
+            const char* end = p + file.size();
+            if( file.size() < sizeof( snapshotMagic ) || std::memcmp( p, snapshotMagic, sizeof( snapshotMagic ) ) != 0 )
+                throw std::runtime_error( "TimedCache: " + path + " isn't a snapshot" );
+            p += sizeof( snapshotMagic );
+            uint64_t count = CacheSerializer< uint64_t >::read( p, end );
+            items.reserve( size_t( std::min< uint64_t >( count, m_size ) ) );
+            for( uint64_t n = 0; n < count && items.size() < m_size; ++n )
+            {
+                tick remaining( CacheSerializer< int64_t >::read( p, end ) );
+                K key = CacheSerializer< K >::read( p, end );
+                handle value = makeValue( CacheSerializer< T >::read( p, end ) );
+                size_t hash = m_hash( key );
+                size_t weight = m_weigher( key, *value );
+                items.push_back( Item{ std::move( key ), std::move( value ), hash, weight, remaining } );
+            }
+        }
+
+        size_t loaded = 0;
+        {
+            auto lg = lockExclusive();
+            auto curTime = getCurrTime();
+            for( Item& item : items )
+            {
+                if( m_count == m_size )
+                    break;
+                if( item.remaining <= tick( 0 ) || find( item.key, item.hash ) != npos ||
+                    ( m_maxWeight != 0 && m_weight + item.weight > m_maxWeight ) )
+                    continue;
+                // Время обращения, при котором остаток жизни равен сохраненному,
+                // но не свежее самого старого объекта в кэше
+                timer time = curTime - std::max( m_maxDTime - item.remaining, tick( 0 ) );
+                if( m_head != npos )
+                    time = std::min( time, m_entries[m_head].time );
+                index i = m_free;
+                Entry& entry = m_entries[i];
+                m_free = entry.next;
+                entry.key.emplace( std::move( item.key ) );
+                entry.value = std::move( item.value );
+                entry.hash = item.hash;
+                entry.weight = item.weight;
+                entry.time = time;
+                entry.written = time;
+                m_weight += item.weight;
+                linkIndex( i );
+                pushFront( i );
+                schedule( i );
+                ++m_count;
+                ++loaded;
+            }
+        }
+        // Загруженные объекты могут "протухнуть" раньше обычного срока: чистка пересчитает его сама
+        if( loaded != 0 && m_service )
+            m_service->schedule( m_task, tick( 0 ) );
+        return loaded;
     }
 private:
-    void wakeUp()
+    template< class, class, class, class, class > friend class ShardedTimedCache;
+
+    // Размер части пакетных операций, под него выделяются буферы на стеке
+    static constexpr size_t batchChunk = 32;
+    // Чистка проверяет бюджет времени после каждой такой части
+    static constexpr size_t sweepStep = 64;
+    // Наибольший шаг поиска места в очереди для restore() с FIFO
+    static constexpr size_t restoreSteps = 64;
+    // Снимок: сколько ячеек копируется за одну блокировку и размер буфера записи
+    static constexpr size_t snapshotChunk = 1024;
+    static constexpr size_t snapshotBuffer = 1 << 16;
+    static constexpr char snapshotMagic[8] = { 'T', 'C', 'S', 'N', 'A', 'P', '0', '1' };
+
+    // Значение и счетчик ссылок - одно выделение памяти
+    template< class... Args >
+    handle makeValue( Args&&... args ) const
+    {
+        if( m_resource )
+            return std::allocate_shared< T >( std::pmr::polymorphic_allocator< T >( m_resource ), std::forward< Args >( args )... );
+        return std::make_shared< const T >( std::forward< Args >( args )... );
+    }
+    template< class Q >
+    std::optional< T > getValue( const Q& key )
+    {
+        if( hasReads() )
+        {
+            // Копируем прямо под блокировкой чтения, счетчик ссылок не трогаем
+            std::optional< T > result;
+            if( readShared( key, m_hash( key ), [&]( const handle& value ) { result.emplace( *value ); } ) )
+                return result;
+        }
+        if( handle h = getHandle( key ) )
+            return std::optional< T >( *h );
+        return std::optional< T >();
+    }
+    template< class Q >
+    handle getHandle( const Q& key )
     {
-        m_sleeper.wakeUp();
+        size_t hash = m_hash( key );
+        if( hasReads() )
+        {
+            handle result;
+            if( readShared( key, hash, [&]( const handle& value ) { result = value; } ) )
+                return result;
+        }
+        auto lg = lockExclusive();
+        return getLocked( key, hash, getCurrTime() );
     }
-    timer getCurrTime() const
+    template< class Q, class Fn >
+    bool getWith( const Q& key, Fn&& fn )
     {
-        return std::chrono::high_resolution_clock::now();
+        handle h = getHandle( key );
+        if( !h )
+            return false;
+        std::forward< Fn >( fn )( *h );
+        return true;
     }
-    void startClenaer()
+    // Событие чтения для отложенного обновления очереди
+    struct ReadEvent
+    {
+        index i = npos;
+        timer time{};
+    };
+
+    using RemovalEvent = typename RemovalListener< K, T >::Event;
+    // Вытеснение для обработчика (set_eviction_handler)
+    struct Demotion
+    {
+        K key;
+        handle value;
+        timer expires;
+        uint64_t stamp;
+    };
+
+    // Исключительная блокировка кэша. С DetailedCacheStats записывает время удержания.
+    // Если были удаления, после освобождения передает слушателю события, не поместившиеся
+    // в его очередь, и будит его поток.
+    class ExclusiveLock
+    {
+    public:
+        ExclusiveLock( std::unique_lock< Mutex > lock, TimedCache& cache, std::chrono::steady_clock::time_point start )
+            : m_lock( std::move( lock ) ), m_cache( cache ), m_start( start )
+        {
+        }
+        ExclusiveLock( const ExclusiveLock& ) = delete;
+        ExclusiveLock& operator = ( const ExclusiveLock& ) = delete;
+        ~ExclusiveLock()
+        {
+            // Пишем до освобождения, гистограмма защищена этой же блокировкой
+            if constexpr( Stats::histograms )
+                m_cache.m_stats.lockHold( elapsedNs( m_start ) );
+            if( m_cache.m_notify )
+                m_cache.publish( m_lock );
+        }
+    private:
+        std::unique_lock< Mutex > m_lock;
+        TimedCache& m_cache;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+    static uint64_t elapsedNs( std::chrono::steady_clock::time_point start )
     {
-        m_working = true;
-        m_cleaner = std::thread( &TimedCache<K, T>::updateCached, this );
+        return uint64_t( std::chrono::duration_cast< tick >( std::chrono::steady_clock::now() - start ).count() );
     }
-    void stopCleaner()
+    // Исключительная блокировка. Сначала применяет накопленные события чтения.
+    ExclusiveLock lockExclusive() const
     {
-        m_working = false;
-        m_sleeper.wakeUp();
-        if( m_cleaner.joinable() )
-            m_cleaner.join();
+        std::unique_lock ul( m_lock, std::defer_lock );
+        if constexpr( Stats::enabled )
+        {
+            // Часы читаем, только если блокировка занята
+            if( !ul.try_lock() )
+            {
+                auto start = std::chrono::steady_clock::now();
+                ul.lock();
+                m_stats.lockWait( elapsedNs( start ) );
+            }
+        }
+        else
+            ul.lock();
+        std::chrono::steady_clock::time_point start;
+        if constexpr( Stats::histograms )
+            start = std::chrono::steady_clock::now();
+        if( hasReads() )
+            const_cast< TimedCache* >( this )->drainReads();
+        return ExclusiveLock( std::move( ul ), *const_cast< TimedCache* >( this ), start );
     }
-    void updateCached()
+    // Под блокировкой: событие - в очередь слушателя, а если она заполнена - в m_overflow,
+    // его передаст ExclusiveLock уже без блокировки
+    void notify( std::optional< K >&& key, handle&& value, RemovalCause cause )
     {
-        tick timeForSleep;
-        while( m_working )
+        RemovalEvent ev{ std::move( key ), std::move( value ), cause };
+        if( !m_listener->try_push( ev ) )
+            m_overflow.push_back( std::move( ev ) );
+        m_notify = true;
+    }
+    // Освобождает блокировку и передает накопленное слушателю и обработчику вытеснений
+    void publish( std::unique_lock< Mutex >& lock )
+    {
+        m_notify = false;
+        RemovalListener< K, T >* listener = m_listener;
+        std::vector< RemovalEvent > overflow;
+        overflow.swap( m_overflow );
+        std::shared_ptr< const eviction_handler > handler = m_evictionHandler;
+        std::vector< Demotion > demotions;
+        demotions.swap( m_demotions );
+        lock.unlock();
+        for( RemovalEvent& ev : overflow )
+            listener->push( std::move( ev ) );
+        if( listener )
+            listener->wake();
+        if( handler )
         {
+            for( const Demotion& d : demotions )
+                ( *handler )( d.key, d.value, d.expires, d.stamp );
+        }
+    }
+    void drainReads()
+    {
+        m_reads->drain(
+            []( const ReadEvent& l, const ReadEvent& r ) { return l.time < r.time; },
+            [this]( const ReadEvent& ev )
             {
-                timeForSleep = std::chrono::duration_cast< tick >( std::chrono::hours( 10 ) );
-                std::lock_guard lg( m_lock );
-                auto curTime = getCurrTime();
-                // если ключей нет, засыпаем на большой период
-                while( !m_key.empty() )
-                {
-                    auto first = m_key.begin();
-                    auto&[time, key] = *first;
-                    auto dt = std::chrono::duration_cast<tick>( curTime - time );
-                    if( dt >= m_maxDTime )
-                    {
-                        m_data.erase( key );
-                        m_key.erase( first );
-                    }
-                    else
-                    {
-                        timeForSleep = m_maxDTime - dt;
-                        // все следующие объекты "достаточно свежие"
-                        break;
-                    }
-                }
-            }
-            // спим, до следующего "протукшего" объекта или надолго, т.к. их нету
-            m_sleeper.sleep( timeForSleep );
-        }
-    }
-
-    Sleeper m_sleeper;
-    std::thread m_cleaner;
-    std::atomic_bool m_working = ATOMIC_VAR_INIT(false);
-
-    mutable std::mutex m_lock;
+                Entry& entry = m_entries[ev.i];
+                if( m_sketch )
+                    m_sketch->increment( entry.hash );
+                if( !Eviction::promote || ev.time <= entry.time )
+                    return;
+                // Потоки с общей полосой могут чуть нарушить порядок событий,
+                // а очередь должна оставаться упорядоченной по времени
+                entry.time = m_tail != npos ? std::max( ev.time, m_entries[m_tail].time ) : ev.time;
+                moveToBack( ev.i );
+                schedule( ev.i );
+            } );
+    }
+    // Поиск под блокировкой чтения. Очередь не меняется, событие уходит в буфер.
+    // @return false - нужен поиск под исключительной блокировкой: объект похож на
+    //         "протухший", но его продление может лежать в буфере, или промах надо
+    //         учесть в FrequencySketch
+    template< class Q, class Fn >
+    bool readShared( const Q& key, size_t hash, Fn&& fn )
+    {
+        bool full = false;
+        {
+            SharedReadLock lock( m_lock );
+            index i = find( key, hash );
+            if( i == npos )
+            {
+                if( !m_sketch )
+                    m_stats.miss();
+                return !m_sketch;
+            }
+            const Entry& entry = m_entries[i];
+            auto currTime = getCurrTime();
+            if( currTime - entry.time >= m_maxDTime )
+                return false;
+            m_stats.hit();
+            fn( entry.value );
+            // Без продления событие нужно только для частоты TinyLfu
+            if( Eviction::promote || m_sketch )
+                m_reads->push( ReadEvent{ i, currTime }, full );
+        }
+        // Полоса буфера заполнилась, просим фоновый поток разобрать ее сейчас
+        if( full && m_service )
+            m_service->schedule( m_task, tick( 0 ) );
+        return true;
+    }
+    // @param found - номер ячейки найденного объекта
+    template< class Q >
+    handle getLocked( const Q& key, size_t hash, timer currTime, index* found = nullptr )
+    {
+        if( m_sketch )
+            m_sketch->increment( hash );
+        // Выполняем поиск
+        index i = find( key, hash );
+        if( i == npos )
+        {
+            m_stats.miss();
+            return handle();
+        }
+
+        Entry& entry = m_entries[i];
+
+        // Пройденно время превышает максимальное?
+        if( currTime - entry.time >= m_maxDTime )
+        {
+            // Фоновый поток не останавливаем: пустой кэш он и так ждет, а после
+            // остановки новые объекты некому было бы удалять.
+            // В пределах staleGrace объект хранится для get_or_load.
+            m_stats.miss();
+            if( currTime - entry.time >= m_keepDTime )
+            {
+                m_stats.expiration();
+                remove( i, RemovalCause::Expired );
+            }
+            return handle();
+        }
+
+        // Обновляем время и переносим в конец очереди, без выделения памяти
+        m_stats.hit();
+        if constexpr( Eviction::promote )
+        {
+            entry.time = currTime;
+            moveToBack( i );
+            schedule( i );
+        }
+
+        // Все ок, возращаем объект
+        if( found )
+            *found = i;
+        return entry.value;
+    }
+    // @param data - новое значение. Если ключ уже был, на выходе в data старое значение,
+    //               его надо разрушать уже вне блокировки.
+    // @param weight - вес нового значения
+    // @return true, если кэш был пуст и надо запланировать чистку
+    // @param key - const K& или K&&, перемещается в ячейку
+    template< class KeyArg >
+    bool setLocked( KeyArg&& key, size_t hash, handle& data, size_t weight, timer curTime )
+    {
+        index i = find( key, hash );
+        if( m_maxWeight != 0 && weight > m_maxWeight )
+        {
+            // Не поместится даже в пустой кэш. Старое значение тоже убираем, оно устарело.
+            if( m_listener )
+                notify( std::optional< K >( std::forward< KeyArg >( key ) ), std::move( data ), RemovalCause::Capacity );
+            if( i != npos )
+            {
+                if( !m_listener )
+                    data.swap( m_entries[i].value );
+                remove( i, RemovalCause::Replaced );
+            }
+            return false;
+        }
+        if( i != npos )
+        {
+            // Ключ уже есть, заменяем значение и освежаем.
+            Entry& entry = m_entries[i];
+            entry.value.swap( data );
+            if( m_versions )
+                m_versions->bump( hash );
+            if( m_listener )
+                notify( std::optional< K >( *entry.key ), std::move( data ), RemovalCause::Replaced );
+            entry.time = curTime;
+            entry.written = curTime;
+            m_weight = m_weight - entry.weight + weight;
+            entry.weight = weight;
+            moveToBack( i );
+            schedule( i );
+            // Объект теперь самый свежий и сам по себе помещается, до него вытеснение не дойдет
+            while( m_maxWeight != 0 && m_weight > m_maxWeight )
+                evict();
+            return false;
+        }
+
+        // Места нет: новый ключ может не пройти допуск
+        bool needSpace = m_count == m_size || ( m_maxWeight != 0 && m_weight + weight > m_maxWeight );
+        if( needSpace && m_sketch && !admit( hash, curTime ) )
+        {
+            m_stats.rejection();
+            if( m_listener )
+                notify( std::optional< K >( std::forward< KeyArg >( key ) ), std::move( data ), RemovalCause::Capacity );
+            return false;
+        }
+
+        // Чистим, если размер кэша превышен. В голове списка самый старый.
+        if( m_count == m_size )
+            evict();
+        while( m_maxWeight != 0 && m_weight + weight > m_maxWeight )
+            evict();
+        i = m_free;
+        Entry& entry = m_entries[i];
+        entry.key.emplace( std::forward< KeyArg >( key ) );
+        entry.value = std::move( data );
+        m_free = entry.next;
+        entry.hash = hash;
+        entry.weight = weight;
+        entry.time = curTime;
+        entry.written = curTime;
+        m_weight += weight;
+        linkIndex( i );
+        pushBack( i );
+        schedule( i );
+        ++m_count;
+        return m_count == 1;
+    }
+    template< class KeyArg >
+    void store( KeyArg&& key, handle data )
+    {
+        size_t weight = m_weigher( key, *data );
+        size_t hash = m_hash( key );
+        bool wakeup = false;
+        {
+            auto lg = lockExclusive();
+            if( m_size == 0 )
+                return;
+            auto curTime = getCurrTime();
+            // Без фонового потока чистим понемногу сами
+            if( m_lazyBatch != 0 )
+                expireFront( curTime, m_lazyBatch );
+            wakeup = setLocked( std::forward< KeyArg >( key ), hash, data, weight, curTime );
+        }
+        // Появились новые объекты, надо запланировать чистку к сроку первого из них
+        if( wakeup )
+            scheduleCleaner();
+    }
+    template< class KeyArg, class... Args >
+    bool tryStore( KeyArg&& key, Args&&... args )
+    {
+        size_t hash = m_hash( key );
+        if( m_size == 0 || containsLive( key, hash ) )
+            return false;
+        handle data = makeValue( std::forward< Args >( args )... );
+        size_t weight = m_weigher( key, *data );
+        bool wakeup = false;
+        {
+            auto lg = lockExclusive();
+            auto curTime = getCurrTime();
+            if( containsLive( key, hash, curTime ) )
+                return false;
+            if( m_lazyBatch != 0 )
+                expireFront( curTime, m_lazyBatch );
+            wakeup = setLocked( std::forward< KeyArg >( key ), hash, data, weight, curTime );
+        }
+        if( wakeup )
+            scheduleCleaner();
+        return true;
+    }
+    bool containsLive( const K& key, size_t hash )
+    {
+        auto lg = lockExclusive();
+        return containsLive( key, hash, getCurrTime() );
+    }
+    bool containsLive( const K& key, size_t hash, timer curTime ) const
+    {
+        index i = find( key, hash );
+        return i != npos && curTime - m_entries[i].time < m_maxDTime;
+    }
+    void finishLoad( const K& key )
+    {
+        std::lock_guard lg( m_loadLock );
+        m_loading.erase( key );
+    }
+    // Поиск для get_or_load с обновлением заранее или со старыми значениями.
+    // @param stale - значение, которое "протухло", но еще хранится (CacheOptions::staleGrace)
+    // @param refresh - пора перезагрузить найденное значение
+    handle loadLookup( const K& key, handle& stale, bool& refresh )
+    {
+        size_t hash = m_hash( key );
+        auto lg = lockExclusive();
+        auto currTime = getCurrTime();
+        handle result = getLocked( key, hash, currTime );
+        index i = find( key, hash );
+        if( i == npos )
+            return result;
+        if( result )
+            refresh = currTime - m_entries[i].written >= m_refreshAfter;
+        else
+            stale = m_entries[i].value;
+        return result;
+    }
+    // Перезагрузка в executor. Если ключ уже загружается, ничего не делает.
+    // Переполненный executor перезагрузку пропускает: значение еще живо, обновится при следующем чтении.
+    template< class Loader >
+    void refreshAsync( const K& key, const Loader& loader )
+    {
+        auto promise = std::make_shared< std::promise< handle > >();
+        {
+            std::lock_guard lg( m_loadLock );
+            if( !m_loading.emplace( key, promise->get_future().share() ).second )
+                return;
+            ++m_refreshing;
+        }
+        bool submitted = m_executor->try_submit( [this, key, loader, promise]()
+        {
+            try
+            {
+                handle result = makeValue( loader( key ) );
+                store( key, result );
+                promise->set_value( result );
+            }
+            catch( ... )
+            {
+                // Ждущие в get_or_load получат исключение, само значение остается до конца срока
+                promise->set_exception( std::current_exception() );
+            }
+            finishRefresh( key );
+        } );
+        if( !submitted )
+        {
+            promise->set_exception( std::make_exception_ptr( std::runtime_error( "TimedCache: refresh queue is full" ) ) );
+            finishRefresh( key );
+        }
+    }
+    // Будим под блокировкой: иначе деструктор, увидев m_refreshing == 0, разрушит
+    // m_refreshDone, пока этот поток еще внутри notify_all()
+    void finishRefresh( const K& key )
+    {
+        std::lock_guard lg( m_loadLock );
+        m_loading.erase( key );
+        --m_refreshing;
+        m_refreshDone.notify_all();
+    }
+    // TinyLFU: пускаем новый ключ вместо самого старого, только если он популярнее.
+    // "Протухший" самый старый объект вытесняется всегда.
+    bool admit( size_t hash, timer curTime ) const
+    {
+        const Entry& victim = m_entries[m_head];
+        if( curTime - victim.time >= m_maxDTime )
+            return true;
+        return m_sketch->frequency( hash ) > m_sketch->frequency( victim.hash );
+    }
+    void scheduleCleaner()
+    {
+        if( m_service )
+            m_service->schedule( m_task, m_keepDTime + m_tick );
+    }
+    // Считает хэши и подгружает первые группы проб индекса
+    void prefetch( const K* keys, size_t* hashes, size_t n ) const
+    {
+        for( size_t j = 0; j < n; ++j )
+        {
+            hashes[j] = m_hash( keys[j] );
+            TIMED_CACHE_PREFETCH( m_index.groupOf( hashes[j] ) );
+        }
+    }
+    template< class Q >
+    index find( const Q& key, size_t hash ) const
+    {
+        return m_index.find( hash, [&]( index i )
+        {
+            const Entry& entry = m_entries[i];
+            return entry.hash == hash && *entry.key == key;
+        } );
+    }
+    void linkIndex( index i )
+    {
+        m_index.insert( m_entries[i].hash, i );
+    }
+    void pushBack( index i )
+    {
+        Entry& entry = m_entries[i];
+        entry.prev = m_tail;
+        entry.next = npos;
+        if( m_tail != npos )
+            m_entries[m_tail].next = i;
+        else
+            m_head = i;
+        m_tail = i;
+    }
+    void pushFront( index i )
+    {
+        Entry& entry = m_entries[i];
+        entry.prev = npos;
+        entry.next = m_head;
+        if( m_head != npos )
+            m_entries[m_head].prev = i;
+        else
+            m_tail = i;
+        m_head = i;
+    }
+    void unlink( index i )
+    {
+        Entry& entry = m_entries[i];
+        if( entry.prev != npos )
+            m_entries[entry.prev].next = entry.next;
+        else
+            m_head = entry.next;
+        if( entry.next != npos )
+            m_entries[entry.next].prev = entry.prev;
+        else
+            m_tail = entry.prev;
+    }
+    void moveToBack( index i )
+    {
+        if( i == m_tail )
+            return;
+        unlink( i );
+        pushBack( i );
+    }
+    void schedule( index i )
+    {
+        if( !m_wheel )
+            return;
+        // Срок округляем вверх до шага, чтобы не удалить объект раньше времени
+        // Объект из снимка может быть старше самого кэша
+        auto deadline = std::max( m_entries[i].time + m_keepDTime - m_start, tick( 0 ) );
+        m_wheel->schedule( i, uint64_t( ( deadline + m_tick - tick( 1 ) ) / m_tick ) );
+    }
+    void remove( index i, RemovalCause cause )
+    {
+        if( m_wheel )
+            m_wheel->cancel( i );
+        m_index.erase( m_entries[i].hash, i );
+        unlink( i );
+        Entry& entry = m_entries[i];
+        if( m_versions )
+            m_versions->bump( entry.hash );
+        if( m_listener )
+            notify( std::move( entry.key ), std::move( entry.value ), cause );
+        entry.key.reset();
+        entry.value.reset();
+        entry.prev = npos;
+        entry.next = m_free;
+        m_free = i;
+        m_weight -= entry.weight;
+        --m_count;
+    }
+    // Ставит объект в очередь по времени time, а не в конец. Место ищется с головы, но не дальше
+    // restoreSteps объектов: вернувшийся со второго уровня объект был вытеснен с головы
+    // и обычно старше всех. Если место глубже, объект встает на restoreSteps-ю позицию:
+    // очередь чуть нарушает порядок, и фоновая чистка удалит стоящие за ним более старые
+    // объекты не раньше него, но по времени они уже не отдаются.
+    void reorder( index i, timer time )
+    {
+        Entry& entry = m_entries[i];
+        entry.time = time;
+        entry.written = time;
+        unlink( i );
+        index next = m_head;
+        for( size_t step = 0; next != npos && m_entries[next].time <= time && step < restoreSteps; ++step )
+            next = m_entries[next].next;
+        if( next == npos )
+            pushBack( i );
+        else
+        {
+            entry.prev = m_entries[next].prev;
+            entry.next = next;
+            if( entry.prev != npos )
+                m_entries[entry.prev].next = i;
+            else
+                m_head = i;
+            m_entries[next].prev = i;
+        }
+        schedule( i );
+    }
+    // Вытесняет самый старый объект ради места
+    void evict()
+    {
+        m_stats.eviction();
+        if( m_evictionHandler )
+        {
+            // Обработчик вызовет publish() уже без блокировки
+            const Entry& entry = m_entries[m_head];
+            m_demotions.push_back( Demotion{ *entry.key, entry.value, Expiry::expires ? entry.time + m_maxDTime : timer::max(),
+                m_evictionStamp ? m_evictionStamp( entry.hash ) : 0 } );
+            m_notify = true;
+        }
+        remove( m_head, RemovalCause::Capacity );
+    }
+    void resetFreeList()
+    {
+        for( size_t i = 0; i < m_entries.size(); ++i )
+            m_entries[i].next = i + 1 < m_entries.size() ? index( i + 1 ) : npos;
+        m_free = m_entries.empty() ? npos : 0;
+    }
+    // Без срока жизни часы не нужны: время всех объектов одинаковое и ни с чем не сравнивается
+    static timer getCurrTime()
+    {
+        if constexpr( Expiry::expires )
+            return Clock::now();
+        else
+            return timer();
+    }
+    // Буфер чтений бывает только у кэша с блокировкой
+    bool hasReads() const
+    {
+        if constexpr( Locking::threadSafe )
+            return bool( m_reads );
+        else
+            return false;
+    }
+    static bool sharedReads( const CacheOptions& options )
+    {
+        return Locking::threadSafe && ( Locking::sharedReads || options.readBuffer );
+    }
+    // Один проход чистки, вызывается планировщиком.
+    // @return время до следующего "протухшего" объекта, 0 - проход прерван по
+    //         CacheOptions::sweepBatch или sweepTime и его надо продолжить
+    tick updateCached()
+    {
+        // Объявлен до блокировки: значения разрушаются после ее освобождения
+        std::vector< handle > retired;
+        auto lg = lockExclusive();
+        std::chrono::steady_clock::time_point start;
+        if constexpr( Stats::enabled )
+            start = std::chrono::steady_clock::now();
+        tick result = expire( retired );
+        if constexpr( Stats::enabled )
+            m_stats.sweep( elapsedNs( start ) );
+        return result;
+    }
+    // Удаляет "протухшие" объекты, по колесу таймеров или с головы списка, частями по sweepStep,
+    // пока не кончатся или не исчерпан бюджет прохода (m_sweepBatch, m_sweepTime).
+    // @param retired - значения удаленных объектов, для разрушения вне блокировки
+    // @return время до следующего "протухшего" объекта или 0, если бюджет исчерпан
+    tick expire( std::vector< handle >& retired )
+    {
+        auto curTime = getCurrTime();
+        std::chrono::steady_clock::time_point start;
+        if( m_sweepTime.count() != 0 )
+            start = std::chrono::steady_clock::now();
+        // Со слушателем значения в retired не попадают, поэтому удаленные считаем по m_count
+        const size_t count = m_count;
+        if( !m_listener )
+            retired.reserve( std::min( m_sweepBatch, m_count ) );
+        while( true )
+        {
+            size_t expired = count - m_count;
+            size_t limit = std::min( sweepStep, m_sweepBatch - expired );
+            tick next;
+            if( m_wheel )
+            {
+                bool done = m_wheel->advance( uint64_t( ( curTime - m_start ) / m_tick ),
+                    [&]( index i ) { expireEntry( i, &retired ); }, limit );
+                next = !done ? tick( 0 )
+                    // до ближайшего события колеса
+                    : m_wheel->size() == 0 ? ExpirationService::never
+                    : std::chrono::duration_cast< tick >( m_start + m_tick * ( m_wheel->now() + m_wheel->nextEvent() ) - curTime );
+            }
+            else
+                next = expireFront( curTime, limit, &retired );
+            if( next != tick( 0 ) )
+                return next;
+            // Остальное - следующим проходом, блокировку пора отпустить
+            if( count - m_count >= m_sweepBatch ||
+                ( m_sweepTime.count() != 0 && std::chrono::steady_clock::now() - start >= m_sweepTime ) )
+                return tick( 0 );
+        }
+    }
+    // @param retired - куда перенести значение, nullptr - разрушить сразу.
+    //                  Со слушателем значение и так разрушается в его потоке.
+    void expireEntry( index i, std::vector< handle >* retired )
+    {
+        m_stats.expiration();
+        if( retired && !m_listener )
+            retired->push_back( std::move( m_entries[i].value ) );
+        remove( i, RemovalCause::Expired );
+    }
+    // Удаляет с головы списка не более limit "протухших" объектов.
+    // @return время до следующего "протухшего" объекта, 0 - остановились по limit
+    tick expireFront( timer curTime, size_t limit, std::vector< handle >* retired = nullptr )
+    {
+        for( ; m_head != npos && limit != 0; --limit )
+        {
+            auto dt = std::chrono::duration_cast<tick>( curTime - m_entries[m_head].time );
+            if( dt < m_keepDTime )
+            {
+                // все следующие объекты "достаточно свежие"
+                return m_keepDTime - dt;
+            }
+            expireEntry( m_head, retired );
+        }
+        // ключей нет, до следующего set() чистка не нужна
+        return m_head == npos ? ExpirationService::never : tick( 0 );
+    }
+
+    std::pmr::memory_resource* m_resource = nullptr;
+    std::unique_ptr< SlabPool, SlabPool::Releaser > m_pool;
+    ExpirationService* m_service = nullptr;
+    ExpirationService::id m_task = 0;
+    // Для ExpiryMode::Lazy - сколько объектов проверять на каждом set(), иначе 0
+    size_t m_lazyBatch = 0;
+    // Бюджет одного прохода фоновой чистки, см. CacheOptions::sweepBatch
+    size_t m_sweepBatch = std::numeric_limits< size_t >::max();
+    std::chrono::microseconds m_sweepTime{ 0 };
+
+    mutable Mutex m_lock;
+    mutable Stats m_stats;
+    // Слушатель удалений и события, не поместившиеся в его очередь (под m_lock)
+    RemovalListener< K, T >* m_listener = nullptr;
+    std::vector< RemovalEvent > m_overflow;
+    bool m_notify = false;
+    // Обработчик вытеснений и вытеснения, которые он еще не получил (под m_lock)
+    std::shared_ptr< const eviction_handler > m_evictionHandler;
+    eviction_stamp m_evictionStamp;
+    std::vector< Demotion > m_demotions;
+    std::unique_ptr< ReadBuffer< ReadEvent > > m_reads;
+    std::unique_ptr< FrequencySketch > m_sketch;
+    // Для FrontCache, см. CacheOptions::frontCache
+    std::unique_ptr< KeyVersions > m_versions;
+    // Загрузки get_or_load, которые сейчас выполняются. Своя блокировка, m_lock не держим.
+    std::mutex m_loadLock;
+    std::unordered_map< K, std::shared_future< handle > > m_loading;
+    // Перезагрузки в executor, которые еще не закончились
+    size_t m_refreshing = 0;
+    std::condition_variable m_refreshDone;
+    BoundedExecutor* m_executor = nullptr;
+    tick m_refreshAfter = tick::max();
     size_t m_size = 0;
     tick m_maxDTime{};
-    std::unordered_map< K, std::pair< T, timer > > m_data;
-    std::map< timer, K > m_key;
+    // Срок хранения: m_maxDTime + CacheOptions::staleGrace. Инициализируется через m_maxDTime,
+    // поэтому объявлен после него.
+    tick m_keepDTime{};
+    CacheKeyHash< K > m_hash;
+    std::vector< Entry > m_entries;
+    FlatIndex m_index;
+    std::optional< TimingWheel > m_wheel;
+    tick m_tick{};
+    timer m_start{};
+    size_t m_count = 0;
+    size_t m_maxWeight = 0;
+    size_t m_weight = 0;
+    CacheWeigher< K, T > m_weigher;
+    index m_head = npos;
+    index m_tail = npos;
+    index m_free = npos;
 };
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <cstdint>
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <vector>
+
+// Иерархическое колесо таймеров.
+// Элементы - индексы от 0 до capacity - 1, связи хранятся в самом колесе,
+// поэтому постановка и снятие таймера не выделяют память.
+// Время измеряется в тиках: постановка и перепостановка - O(1),
+// срабатывание - амортизированно O(1) на элемент, каждый элемент опускается
+// с уровня на уровень не более levels раз.
+class TimingWheel
+{
+public:
+    using index = uint32_t;
+    static constexpr index npos = std::numeric_limits< index >::max();
+    static constexpr unsigned bits = 6;
+    static constexpr size_t slots = size_t( 1 ) << bits;
+    static constexpr uint64_t mask = slots - 1;
+    // 64^6 = 2^36 тиков, при тике в 1ms это около 2 лет (795 дней). Более дальние сроки
+    // паркуются на верхнем уровне и перекладываются заново при каждом его обороте.
+    static constexpr unsigned levels = 6;
+
+    explicit TimingWheel( size_t capacity, uint64_t now = 0 )
+        : m_nodes( capacity ), m_now( now )
+    {
+        for( auto& level : m_heads )
+            level.fill( npos );
+    }
+
+    uint64_t now() const
+    {
+        return m_now;
+    }
+    size_t size() const
+    {
+        return m_count;
+    }
+    bool scheduled( index i ) const
+    {
+        return m_nodes[i].level != npos;
+    }
+    // Ставит (или переставляет) таймер элемента i на тик deadline.
+    // Уже прошедший срок сработает на ближайшем advance().
+    void schedule( index i, uint64_t deadline )
+    {
+        cancel( i );
+        m_nodes[i].deadline = std::max( deadline, m_now + 1 );
+        insert( i );
+    }
+    void cancel( index i )
+    {
+        Node& node = m_nodes[i];
+        if( node.level == npos )
+            return;
+        index& head = m_heads[node.level][node.slot];
+        if( node.prev != npos )
+            m_nodes[node.prev].next = node.next;
+        else
+            head = node.next;
+        if( node.next != npos )
+            m_nodes[node.next].prev = node.prev;
+        --m_levelCount[node.level];
+        --m_count;
+        node.level = npos;
+    }
+    // Продвигает время до тика target и вызывает fn( index ) для каждого сработавшего таймера.
+    // fn может снимать и ставить таймеры.
+    // @param limit - не больше limit срабатываний за вызов. Время тогда останавливается на текущем
+    //                тике, оставшиеся таймеры этого тика сработают первыми при следующем вызове.
+    // @return false, если остановились по limit
+    template< class Fn >
+    bool advance( uint64_t target, Fn&& fn, size_t limit = std::numeric_limits< size_t >::max() )
+    {
+        // Остаток прерванного тика. Новые таймеры в эту ячейку не попадают: срок всегда позже m_now.
+        if( !fire( m_heads[0][m_now & mask], fn, limit ) )
+            return false;
+        while( m_now < target )
+        {
+            if( m_count == 0 )
+            {
+                m_now = target;
+                break;
+            }
+            // Пустые нижние уровни проскакиваем до ближайшего перехода
+            unsigned empty = 0;
+            while( empty < levels && m_levelCount[empty] == 0 )
+                ++empty;
+            if( empty > 0 )
+            {
+                uint64_t span = empty < levels ? ( uint64_t( 1 ) << ( bits * empty ) ) - 1 : ~uint64_t( 0 );
+                uint64_t skip = m_now | span;
+                if( skip > m_now )
+                {
+                    m_now = std::min( skip, target );
+                    continue;
+                }
+            }
+
+            ++m_now;
+            // На переходе через границу уровня опускаем элементы вниз, начиная с верхнего
+            unsigned top = 0;
+            while( top + 1 < levels && ( m_now & ( ( uint64_t( 1 ) << ( bits * ( top + 1 ) ) ) - 1 ) ) == 0 )
+                ++top;
+            for( unsigned level = top; level > 0; --level )
+                cascade( level, size_t( ( m_now >> ( bits * level ) ) & mask ) );
+
+            if( !fire( m_heads[0][m_now & mask], fn, limit ) )
+                return false;
+        }
+        return true;
+    }
+    // Число тиков от now() до ближайшего события (срабатывания или опускания уровня).
+    // Для пустого колеса - максимальное значение.
+    uint64_t nextEvent() const
+    {
+        for( unsigned level = 0; level < levels; ++level )
+        {
+            if( m_levelCount[level] == 0 )
+                continue;
+            unsigned shift = bits * level;
+            uint64_t current = m_now >> shift;
+            for( uint64_t k = 1; k <= slots; ++k )
+            {
+                if( m_heads[level][( current + k ) & mask] != npos )
+                    return ( ( current + k ) << shift ) - m_now;
+            }
+        }
+        return std::numeric_limits< uint64_t >::max();
+    }
+    void clear()
+    {
+        for( auto& level : m_heads )
+            level.fill( npos );
+        for( auto& node : m_nodes )
+            node.level = npos;
+        m_levelCount.fill( 0 );
+        m_count = 0;
+    }
+private:
+    struct Node
+    {
+        uint64_t deadline = 0;
+        index prev = npos;
+        index next = npos;
+        index level = npos;
+        index slot = 0;
+    };
+
+    void insert( index i )
+    {
+        Node& node = m_nodes[i];
+        // Уровень определяется старшим отличающимся битом срока и текущего времени
+        uint64_t diff = node.deadline ^ m_now;
+        unsigned level = 0;
+        while( level + 1 < levels && ( diff >> ( bits * ( level + 1 ) ) ) != 0 )
+            ++level;
+        size_t slot = size_t( ( node.deadline >> ( bits * level ) ) & mask );
+        // Старшие биты различаются и выше верхнего уровня. Если до срока не больше оборота
+        // верхнего уровня, хватает ячейки срока: ее опустят, когда время в нее войдет.
+        // Иначе - в самую дальнюю ячейку, при опускании срок пересчитается.
+        if( ( diff >> ( bits * ( level + 1 ) ) ) != 0 &&
+            ( node.deadline >> ( bits * level ) ) - ( m_now >> ( bits * level ) ) > slots )
+            slot = size_t( ( ( m_now >> ( bits * level ) ) - 1 ) & mask );
+
+        index& head = m_heads[level][slot];
+        node.level = level;
+        node.slot = index( slot );
+        node.prev = npos;
+        node.next = head;
+        if( head != npos )
+            m_nodes[head].prev = i;
+        head = i;
+        ++m_levelCount[level];
+        ++m_count;
+    }
+    template< class Fn >
+    bool fire( index& head, Fn& fn, size_t& limit )
+    {
+        while( head != npos )
+        {
+            if( limit == 0 )
+                return false;
+            --limit;
+            index i = head;
+            cancel( i );
+            fn( i );
+        }
+        return true;
+    }
+    void cascade( unsigned level, size_t slot )
+    {
+        index i = m_heads[level][slot];
+        m_heads[level][slot] = npos;
+        while( i != npos )
+        {
+            Node& node = m_nodes[i];
+            index next = node.next;
+            --m_levelCount[level];
+            --m_count;
+            node.level = npos;
+            insert( i );
+            i = next;
+        }
+    }
+
+    std::vector< Node > m_nodes;
+    std::array< std::array< index, slots >, levels > m_heads;
+    std::array< size_t, levels > m_levelCount{};
+    size_t m_count = 0;
+    uint64_t m_now = 0;
+};
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <cstdint>
+
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include "FrontCache.h"
+#include "SpillTier.h"
+#include "TimedCache.h"
+
+// Снимок счетчиков TwoTierCache::tier_stats()
+struct TierStats
+{
+    // Попадания в памяти и на втором уровне (с возвратом в память), промахи обоих уровней
+    uint64_t memoryHits = 0;
+    uint64_t spillHits = 0;
+    uint64_t misses = 0;
+    // Вытеснено из памяти и записано на второй уровень
+    uint64_t demotions = 0;
+    // Затерто журналом второго уровня до того, как понадобилось
+    uint64_t overwritten = 0;
+    // Найдено "протухшим" на втором уровне
+    uint64_t spillExpired = 0;
+    // Записей на втором уровне
+    size_t spillSize = 0;
+};
+
+// Какой уровень ответил на TwoTierCache::get_handle
+enum class CacheTier
+{
+    Memory,
+    Spill,
+    Miss
+};
+
+// Кэш из двух уровней: TimedCache в памяти и SpillTier - журнал в файле, отображенном
+// в память (локальный диск или tmpfs). Объект, вытесненный из памяти ради места,
+// записывается на второй уровень, а попадание там возвращает его в память, вытесняя
+// следующий. "Протухшие" объекты не вытесняются, а удаляются, и на второй уровень не идут.
+// Срок жизни общий: на втором уровне объект хранится до того же срока, что и в памяти,
+// а после возврата живет по правилам первого уровня (см. TimedCache::restore).
+// Запись на второй уровень идет уже после освобождения блокировки кэша в памяти, в потоке,
+// который вытеснил объект (см. TimedCache::set_eviction_handler), поэтому диск не задерживает
+// остальных. Пока запись не дошла, объект не найден ни на одном уровне. Если ключ за это время
+// записали заново, удалили или кэш очистили, вытеснение не записывается: версия ключа
+// (KeyVersions) в момент вытеснения сравнивается с текущей. Второй уровень защищен своим
+// мьютексом, блокировку кэша в памяти под ним не берем. Политики Clock, Stats и Policy - как у TimedCache.
+template< class K, class T, class Clock = PreciseClock, class Stats = NoStats, class Policy = CachePolicy<> >
+class TwoTierCache
+{
+    using memory_type = TimedCache< K, T, Clock, Stats, Policy >;
+public:
+    using handle = typename memory_type::handle;
+    using key_type = K;
+    using mapped_type = T;
+    using time_point = typename memory_type::time_point;
+
+    // @param size - число объектов в памяти
+    // @param path - файл второго уровня, создается заново и удаляется в деструкторе
+    // @param spillBytes - размер файла
+    // @param spillEntries - наибольшее число записей второго уровня, 0 - spillBytes / 64
+    template< class Rep, class Period >
+    TwoTierCache( size_t size, const std::chrono::duration< Rep, Period >& relTime, const std::string& path,
+        size_t spillBytes, size_t spillEntries = 0, const CacheOptions& options = {} )
+        : m_spill( path, spillBytes, spillEntries != 0 ? spillEntries : spillBytes / 64 ),
+        m_memory( size, relTime, options )
+    {
+        m_memory.set_eviction_handler( [this]( const K& key, const handle& value, time_point expires, uint64_t stamp )
+        {
+            std::lock_guard lg( m_spillLock );
+            if( stamp == version( m_hash( key ) ) )
+                m_spill.put( key, *value, expires, memory_type::now() );
+        },
+        [this]( size_t hash ) { return version( hash ); } );
+    }
+    TwoTierCache( const TwoTierCache& ) = delete;
+    TwoTierCache& operator = ( const TwoTierCache& ) = delete;
+
+    handle get_handle( const K& key )
+    {
+        CacheTier tier;
+        return get_handle( key, tier );
+    }
+    handle get_handle( const K& key, CacheTier& tier )
+    {
+        tier = CacheTier::Memory;
+        if( handle h = m_memory.get_handle( key ) )
+        {
+            m_memoryHits.fetch_add( 1, std::memory_order_relaxed );
+            return h;
+        }
+        std::optional< T > value;
+        time_point expires{};
+        {
+            std::lock_guard lg( m_spillLock );
+            value = m_spill.take( key, memory_type::now(), expires );
+        }
+        if( !value )
+        {
+            tier = CacheTier::Miss;
+            m_misses.fetch_add( 1, std::memory_order_relaxed );
+            return handle();
+        }
+        tier = CacheTier::Spill;
+        m_spillHits.fetch_add( 1, std::memory_order_relaxed );
+        return m_memory.restore( key, std::move( *value ), expires );
+    }
+    std::optional< T > get( const K& key )
+    {
+        if( handle h = get_handle( key ) )
+            return std::optional< T >( *h );
+        return std::optional< T >();
+    }
+    // Старая копия со второго уровня удаляется, иначе она вернулась бы после "протухания" новой.
+    // Версия меняется раньше: вытеснение старого значения, еще не дошедшее до второго уровня, туда не попадет.
+    template< class KeyArg, class ValueArg >
+    void set( KeyArg&& key, ValueArg&& value )
+    {
+        m_versions.bump( m_hash( key ) );
+        {
+            std::lock_guard lg( m_spillLock );
+            m_spill.erase( key );
+        }
+        m_memory.set( std::forward< KeyArg >( key ), std::forward< ValueArg >( value ) );
+    }
+    bool erase( const K& key )
+    {
+        bool erased = m_memory.erase( key );
+        std::lock_guard lg( m_spillLock );
+        m_versions.bump( m_hash( key ) );
+        return m_spill.erase( key ) || erased;
+    }
+    void clear()
+    {
+        m_memory.clear();
+        std::lock_guard lg( m_spillLock );
+        m_epoch.fetch_add( 1, std::memory_order_release );
+        m_spill.clear();
+    }
+    // Объектов в памяти
+    size_t size() const
+    {
+        return m_memory.size();
+    }
+    size_t capacity() const
+    {
+        return m_memory.capacity();
+    }
+    TierStats tier_stats() const
+    {
+        TierStats result;
+        result.memoryHits = m_memoryHits.load( std::memory_order_relaxed );
+        result.spillHits = m_spillHits.load( std::memory_order_relaxed );
+        result.misses = m_misses.load( std::memory_order_relaxed );
+        std::lock_guard lg( m_spillLock );
+        result.demotions = m_spill.stats().writes;
+        result.overwritten = m_spill.stats().overwritten;
+        result.spillExpired = m_spill.stats().expired;
+        result.spillSize = m_spill.size();
+        return result;
+    }
+    // Первый уровень, например для stats()
+    memory_type& memory()
+    {
+        return m_memory;
+    }
+private:
+    // Версия ключа для вытеснений: растет при записи, удалении ключа и при clear()
+    uint64_t version( size_t hash ) const
+    {
+        return m_versions.get( hash ) + m_epoch.load( std::memory_order_acquire );
+    }
+
+    KeyVersions m_versions;
+    std::atomic< uint64_t > m_epoch{ 0 };
+    CacheKeyHash< K > m_hash;
+    // Второй уровень объявлен раньше: кэш в памяти пишет в него до самого разрушения
+    mutable std::mutex m_spillLock;
+    SpillTier< K, T, Clock > m_spill;
+    memory_type m_memory;
+    std::atomic< uint64_t > m_memoryHits{ 0 };
+    std::atomic< uint64_t > m_spillHits{ 0 };
+    std::atomic< uint64_t > m_misses{ 0 };
+};
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+
+// Вес объекта в байтах для ограничения кэша по памяти (CacheOptions::maxWeight).
+// Для своих типов можно специализировать ObjectWeight или сразу CacheWeigher, как std::hash.
+template< class X >
+struct ObjectWeight
+{
+    size_t operator()( const X& ) const
+    {
+        return sizeof( X );
+    }
+};
+
+template<>
+struct ObjectWeight< std::string >
+{
+    size_t operator()( const std::string& s ) const
+    {
+        return s.capacity();
+    }
+};
+
+// Вес объекта кэша: ключ плюс значение
+template< class K, class T >
+struct CacheWeigher
+{
+    size_t operator()( const K& key, const T& value ) const
+    {
+        return ObjectWeight< K >()( key ) + ObjectWeight< T >()( value );
+    }
+};
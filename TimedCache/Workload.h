@@ -0,0 +1,312 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "MappedFile.h"
+
+// Распределение ключей для тестов производительности.
+// Ключи - от 0 до size - 1, ключи прохода (Scan в ScanZipf) - больше size и не повторяются.
+struct Workload
+{
+    enum class Kind
+    {
+        // Равномерно по всем ключам
+        Uniform,
+        // Распределение Ципфа: к k-му по популярности ключу обращаются с вероятностью ~ 1 / k^skew
+        Zipf,
+        // Доля hotKeys ключей получает долю hotShare обращений, внутри обеих частей - равномерно
+        Hotspot,
+        // Циклический проход по всем ключам
+        Scan,
+        // Zipf вперемешку с проходом: доля scanShare - ключи, которые больше не встретятся
+        ScanZipf,
+        // Zipf, популярные ключи которого через каждые period обращений сдвигаются
+        // на десятую часть диапазона: рабочее множество постепенно меняется
+        Shifting
+    };
+
+    Kind kind = Kind::Uniform;
+    double skew = 0.99;
+    double hotKeys = 0.2;
+    double hotShare = 0.8;
+    double scanShare = 0.3;
+    size_t period = 100000;
+
+    static Workload uniform()
+    {
+        return Workload();
+    }
+    static Workload zipf( double skew = 0.99 )
+    {
+        Workload w;
+        w.kind = Kind::Zipf;
+        w.skew = skew;
+        return w;
+    }
+    static Workload hotspot( double hotKeys = 0.2, double hotShare = 0.8 )
+    {
+        Workload w;
+        w.kind = Kind::Hotspot;
+        w.hotKeys = hotKeys;
+        w.hotShare = hotShare;
+        return w;
+    }
+    static Workload scan()
+    {
+        Workload w;
+        w.kind = Kind::Scan;
+        return w;
+    }
+    static Workload scanZipf( double skew = 0.99, double scanShare = 0.3 )
+    {
+        Workload w;
+        w.kind = Kind::ScanZipf;
+        w.skew = skew;
+        w.scanShare = scanShare;
+        return w;
+    }
+    static Workload shifting( double skew = 0.99, size_t period = 100000 )
+    {
+        Workload w;
+        w.kind = Kind::Shifting;
+        w.skew = skew;
+        w.period = period;
+        return w;
+    }
+
+    std::string name() const
+    {
+        auto num = []( double v ) { std::string s = std::to_string( v ); return s.substr( 0, s.find_last_not_of( '0' ) + 1 ); };
+        switch( kind )
+        {
+        case Kind::Uniform:
+            return "uniform";
+        case Kind::Zipf:
+            return "zipf( " + num( skew ) + " )";
+        case Kind::Hotspot:
+            return "hotspot( " + num( hotKeys ) + ", " + num( hotShare ) + " )";
+        case Kind::Scan:
+            return "scan";
+        case Kind::ScanZipf:
+            return "scan+zipf( " + num( skew ) + ", " + num( scanShare ) + " )";
+        case Kind::Shifting:
+            return "shifting zipf( " + num( skew ) + ", " + std::to_string( period ) + " )";
+        }
+        return std::string();
+    }
+};
+
+// Распределение Ципфа на 1..n без таблицы вероятностей: выборка обратной функцией
+// с отбраковкой (W. Hormann, G. Derflinger, "Rejection-inversion to generate variates
+// from monotone discrete distributions"). O(1) памяти и в среднем чуть больше одной попытки.
+class ZipfDistribution
+{
+public:
+    ZipfDistribution( uint64_t n, double skew )
+        : m_n( std::max< uint64_t >( n, 1 ) ), m_skew( skew )
+    {
+        m_hIntegralX1 = hIntegral( 1.5 ) - 1.0;
+        m_hIntegralN = hIntegral( double( m_n ) + 0.5 );
+        m_s = 2.0 - hIntegralInverse( hIntegral( 2.5 ) - h( 2.0 ) );
+    }
+    template< class Engine >
+    uint64_t operator()( Engine& engine )
+    {
+        while( true )
+        {
+            double u = m_hIntegralN + m_uniform( engine ) * ( m_hIntegralX1 - m_hIntegralN );
+            double x = hIntegralInverse( u );
+            double k = std::min( std::max( std::floor( x + 0.5 ), 1.0 ), double( m_n ) );
+            if( k - x <= m_s || u >= hIntegral( k + 0.5 ) - h( k ) )
+                return uint64_t( k );
+        }
+    }
+private:
+    double h( double x ) const
+    {
+        return std::exp( -m_skew * std::log( x ) );
+    }
+    double hIntegral( double x ) const
+    {
+        double logX = std::log( x );
+        return helper2( ( 1.0 - m_skew ) * logX ) * logX;
+    }
+    double hIntegralInverse( double x ) const
+    {
+        double t = std::max( x * ( 1.0 - m_skew ), -1.0 );
+        return std::exp( helper1( t ) * x );
+    }
+    // log( 1 + x ) / x без потери точности около 0
+    static double helper1( double x )
+    {
+        if( std::abs( x ) > 1e-8 )
+            return std::log1p( x ) / x;
+        return 1.0 - x * ( 0.5 - x * ( 1.0 / 3.0 - 0.25 * x ) );
+    }
+    // ( exp( x ) - 1 ) / x без потери точности около 0
+    static double helper2( double x )
+    {
+        if( std::abs( x ) > 1e-8 )
+            return std::expm1( x ) / x;
+        return 1.0 + x * 0.5 * ( 1.0 + x / 3.0 * ( 1.0 + 0.25 * x ) );
+    }
+
+    uint64_t m_n;
+    double m_skew;
+    double m_hIntegralX1 = 0.0;
+    double m_hIntegralN = 0.0;
+    double m_s = 0.0;
+    std::uniform_real_distribution< double > m_uniform{ 0.0, 1.0 };
+};
+
+// Последовательность ключей по Workload. Одинаковый seed - одинаковая последовательность.
+class KeyStream
+{
+public:
+    KeyStream( const Workload& workload, size_t size, uint64_t seed = 100 )
+        : m_workload( workload ), m_size( std::max< size_t >( size, 1 ) ), m_mt64( seed ),
+        m_zipf( m_size, workload.skew ), m_scan( workload.kind == Workload::Kind::ScanZipf ? m_size + 1 : 0 )
+    {
+        m_hot = std::min( std::max< size_t >( size_t( double( m_size ) * workload.hotKeys ), 1 ), m_size );
+    }
+    size_t operator()()
+    {
+        switch( m_workload.kind )
+        {
+        case Workload::Kind::Uniform:
+            return uniform( 0, m_size );
+        case Workload::Kind::Zipf:
+            return size_t( m_zipf( m_mt64 ) - 1 );
+        case Workload::Kind::Hotspot:
+            if( m_hot == m_size || m_share( m_mt64 ) < m_workload.hotShare )
+                return uniform( 0, m_hot );
+            return uniform( m_hot, m_size );
+        case Workload::Kind::Scan:
+            if( m_scan == m_size )
+                m_scan = 0;
+            return m_scan++;
+        case Workload::Kind::ScanZipf:
+            if( m_share( m_mt64 ) < m_workload.scanShare )
+                return m_scan++;
+            return size_t( m_zipf( m_mt64 ) - 1 );
+        case Workload::Kind::Shifting:
+        {
+            size_t shift = m_count++ / std::max< size_t >( m_workload.period, 1 ) * std::max< size_t >( m_size / 10, 1 );
+            return size_t( ( m_zipf( m_mt64 ) - 1 + shift ) % m_size );
+        }
+        }
+        return 0;
+    }
+private:
+    // [first, last)
+    size_t uniform( size_t first, size_t last )
+    {
+        return first + size_t( m_mt64() % uint64_t( last - first ) );
+    }
+
+    Workload m_workload;
+    size_t m_size;
+    std::mt19937_64 m_mt64;
+    ZipfDistribution m_zipf;
+    std::uniform_real_distribution< double > m_share{ 0.0, 1.0 };
+    size_t m_hot = 0;
+    size_t m_scan = 0;
+    size_t m_count = 0;
+};
+
+// Трасса запросов для воспроизведения: заголовок TraceHeader и за ним записи TraceRecord.
+// Порядок байт - little-endian (x86, ARM), записи выровнены на 8 байт.
+enum class TraceOp : uint8_t
+{
+    // Чтение, при промахе - запись (как в обычном тесте)
+    Get = 0,
+    Set = 1
+};
+
+struct TraceHeader
+{
+    char magic[8] = { 'T', 'C', 'T', 'R', 'A', 'C', 'E', '1' };
+    uint64_t count = 0;
+};
+
+struct TraceRecord
+{
+    // Время от начала трассы в наносекундах в старших 62 битах, операция в младших 2
+    uint64_t timeOp = 0;
+    uint64_t key = 0;
+
+    TraceRecord() = default;
+    TraceRecord( uint64_t timeNs, uint64_t k, TraceOp op )
+        : timeOp( timeNs << 2 | uint64_t( op ) ), key( k )
+    {
+    }
+    uint64_t time() const
+    {
+        return timeOp >> 2;
+    }
+    TraceOp op() const
+    {
+        return TraceOp( timeOp & 3 );
+    }
+};
+
+static_assert( sizeof( TraceHeader ) == 16 && sizeof( TraceRecord ) == 16, "trace format is fixed" );
+
+inline void WriteTrace( const std::string& path, const TraceRecord* records, size_t count )
+{
+    std::ofstream out( path, std::ios::binary | std::ios::trunc );
+    TraceHeader header;
+    header.count = count;
+    out.write( reinterpret_cast< const char* >( &header ), sizeof( header ) );
+    out.write( reinterpret_cast< const char* >( records ), std::streamsize( count * sizeof( TraceRecord ) ) );
+    if( !out )
+        throw std::runtime_error( "WriteTrace: can't write " + path );
+}
+
+// Трасса, отображенная в память: записи читаются прямо из файла, без загрузки целиком
+class TraceFile
+{
+public:
+    explicit TraceFile( const std::string& path )
+        : m_file( path )
+    {
+        TraceHeader header;
+        if( m_file.size() < sizeof( header ) )
+            throw std::runtime_error( "TraceFile: " + path + " is too short" );
+        std::memcpy( &header, m_file.data(), sizeof( header ) );
+        if( std::memcmp( header.magic, TraceHeader().magic, sizeof( header.magic ) ) != 0 )
+            throw std::runtime_error( "TraceFile: " + path + " isn't a trace" );
+        if( header.count > ( m_file.size() - sizeof( header ) ) / sizeof( TraceRecord ) )
+            throw std::runtime_error( "TraceFile: " + path + " is truncated" );
+        m_count = size_t( header.count );
+    }
+
+    size_t size() const
+    {
+        return m_count;
+    }
+    const TraceRecord* begin() const
+    {
+        return reinterpret_cast< const TraceRecord* >( m_file.data() + sizeof( TraceHeader ) );
+    }
+    const TraceRecord* end() const
+    {
+        return begin() + m_count;
+    }
+    const TraceRecord& operator[]( size_t i ) const
+    {
+        return begin()[i];
+    }
+private:
+    MappedFile m_file;
+    size_t m_count = 0;
+};
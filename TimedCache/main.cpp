@@ -1,38 +1,265 @@
+#include <array>
+#include <filesystem>
 #include <iostream>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "TimedCache.h"
+#include "ShardedTimedCache.h"
+#include "TwoTierCache.h"
 #include "TestPerfomance.h"
 #include "ICache.h"
 
 #include "Poco/LRUCache.h"
 
+template< class Cache = TimedCache< size_t, std::string > >
 class CacheTimedCached : public ICache< size_t, std::string >
 {
 public:
-    template< class Rep, class Period >
-    CacheTimedCached( size_t size, const std::chrono::duration< Rep, Period >& relTime )
-        : m_cache( size, relTime ), m_dt( std::chrono::duration_cast<std::chrono::milliseconds>( relTime ) )
+    template< class Rep, class Period, class... Args >
+    CacheTimedCached( size_t size, const std::chrono::duration< Rep, Period >& relTime, Args&&... args )
+        : m_cache( size, relTime, std::forward< Args >( args )... ), m_dt( std::chrono::duration_cast<std::chrono::milliseconds>( relTime ) )
     {
     }
     CacheTimedCached( CacheTimedCached& ) = delete;
 
-    std::string* get( const size_t& key ) override
+    Cache& cache()
+    {
+        return m_cache;
+    }
+
+    const std::string* get( const size_t& key ) override
+    {
+        // Держим handle до следующего вызова, значение не копируется
+        m_value = m_cache.get_handle( key );
+        return m_value.get();
+    }
+    bool contains( const size_t& key ) override
+    {
+        return m_cache.get_handle( key ) != nullptr;
+    }
+    void set( const size_t& key, const std::string& value ) override
+    {
+        m_cache.set( key, value );
+    }
+    size_t multi_get( const size_t* keys, size_t count, const std::string** out ) override
+    {
+        if( m_batch.size() < count )
+            m_batch.resize( count );
+        size_t found = m_cache.multi_get( keys, count, m_batch.data() );
+        for( size_t i = 0; i < count; ++i )
+            out[i] = m_batch[i].get();
+        return found;
+    }
+    void multi_set( const std::pair< size_t, std::string >* items, size_t count ) override
+    {
+        m_cache.multi_set( items, count );
+    }
+    std::string name() const override
+    {
+        return "TimedCache(" + std::to_string(capacity()) + "; dt= "+ std::to_string( m_dt.count() ) + "ms)";
+    }
+    size_t capacity() const override
+    {
+        return m_cache.capacity();
+    }
+    void clear() override
+    {
+        m_cache.clear();
+    }
+private:
+    std::chrono::milliseconds m_dt;
+    typename Cache::handle m_value;
+    std::vector< typename Cache::handle > m_batch;
+    Cache m_cache;
+};
+
+class CacheShardedTimedCached : public CacheTimedCached< ShardedTimedCache< size_t, std::string > >
+{
+public:
+    using CacheTimedCached::CacheTimedCached;
+
+    std::string name() const override
+    {
+        return "Sharded" + CacheTimedCached::name();
+    }
+};
+
+class CacheWheelTimedCached : public CacheTimedCached<>
+{
+public:
+    template< class Rep, class Period >
+    CacheWheelTimedCached( size_t size, const std::chrono::duration< Rep, Period >& relTime, std::chrono::milliseconds tick )
+        : CacheTimedCached( size, relTime, CacheOptions{ tick } ), m_tick( tick )
+    {
+    }
+
+    std::string name() const override
+    {
+        return "Wheel" + std::to_string( m_tick.count() ) + "ms" + CacheTimedCached::name();
+    }
+private:
+    std::chrono::milliseconds m_tick;
+};
+
+// Фоновая чистка частями по batch объектов за блокировку, 0 - все сразу
+class CacheSweepTimedCached : public CacheTimedCached<>
+{
+public:
+    template< class Rep, class Period >
+    CacheSweepTimedCached( size_t size, const std::chrono::duration< Rep, Period >& relTime, size_t batch )
+        : CacheTimedCached( size, relTime, sweep( batch ) ), m_batch( batch )
+    {
+    }
+
+    std::string name() const override
+    {
+        return ( m_batch == 0 ? std::string( "SweepAll" ) : "Sweep" + std::to_string( m_batch ) ) + CacheTimedCached::name();
+    }
+private:
+    static CacheOptions sweep( size_t batch )
+    {
+        CacheOptions options;
+        options.sweepBatch = batch;
+        return options;
+    }
+
+    size_t m_batch;
+};
+
+// Со слушателем удалений, который только считает события
+class CacheListenerTimedCached : public CacheTimedCached<>
+{
+public:
+    template< class Rep, class Period >
+    CacheListenerTimedCached( size_t size, const std::chrono::duration< Rep, Period >& relTime, ListenerOverflow overflow )
+        : CacheTimedCached( size, relTime ),
+        m_listener( [this]( const size_t&, const handle&, RemovalCause ) { ++m_removed; }, 4096, overflow ),
+        m_overflow( overflow )
+    {
+        cache().set_removal_listener( &m_listener );
+    }
+    ~CacheListenerTimedCached()
+    {
+        cache().set_removal_listener( nullptr );
+    }
+
+    std::string name() const override
+    {
+        return std::string( m_overflow == ListenerOverflow::Drop ? "DropListener" : "Listener" ) + CacheTimedCached::name();
+    }
+private:
+    using handle = TimedCache< size_t, std::string >::handle;
+
+    std::atomic< size_t > m_removed{ 0 };
+    RemovalListener< size_t, std::string > m_listener;
+    ListenerOverflow m_overflow;
+};
+
+// С кэшем первого уровня в каждом потоке (FrontCache)
+class CacheFrontTimedCached : public CacheTimedCached<>
+{
+public:
+    template< class Rep, class Period >
+    CacheFrontTimedCached( size_t size, const std::chrono::duration< Rep, Period >& relTime )
+        : CacheTimedCached( size, relTime, front() )
+    {
+    }
+
+    const std::string* get( const size_t& key ) override
+    {
+        m_value = local().get_handle( key );
+        return m_value.get();
+    }
+    bool contains( const size_t& key ) override
+    {
+        return local().get_handle( key ) != nullptr;
+    }
+    std::string name() const override
+    {
+        return "Front" + CacheTimedCached::name();
+    }
+private:
+    using Cache = TimedCache< size_t, std::string >;
+    using Local = FrontCache< Cache >;
+
+    static CacheOptions front()
+    {
+        CacheOptions options;
+        options.frontCache = true;
+        return options;
+    }
+    // FrontCache потока для этого адаптера. Номер, а не адрес: на месте
+    // разрушенного адаптера может оказаться новый.
+    Local& local()
     {
-        if( m_value = m_cache.get( key ); m_value.has_value() )
+        thread_local std::unique_ptr< Local > t_local;
+        thread_local uint64_t t_owner = 0;
+        if( t_owner != m_id )
         {
-            return &( m_value.value() );
+            t_local = std::make_unique< Local >( cache() );
+            t_owner = m_id;
         }
-        return nullptr;
+        return *t_local;
+    }
+
+    static inline std::atomic< uint64_t > s_ids{ 0 };
+    uint64_t m_id = ++s_ids;
+    Cache::handle m_value;
+};
+
+// Два уровня: память и журнал в файле во временном каталоге.
+// Задержка get() копится отдельно по уровню, который ответил (только для однопоточных замеров).
+class CacheTwoTierTimedCached : public ICache< size_t, std::string >
+{
+public:
+    template< class Rep, class Period >
+    CacheTwoTierTimedCached( size_t size, const std::chrono::duration< Rep, Period >& relTime, size_t spillBytes )
+        : m_cache( size, relTime, spillPath(), spillBytes ), m_dt( std::chrono::duration_cast< std::chrono::milliseconds >( relTime ) ),
+        m_spillBytes( spillBytes )
+    {
+    }
+
+    const std::string* get( const size_t& key ) override
+    {
+        CacheTier tier;
+        auto t0 = std::chrono::steady_clock::now();
+        m_value = m_cache.get_handle( key, tier );
+        auto dt = std::chrono::steady_clock::now() - t0;
+        m_latency[size_t( tier )].record( uint64_t( std::chrono::duration_cast< std::chrono::nanoseconds >( dt ).count() ) );
+        return m_value.get();
+    }
+    bool contains( const size_t& key ) override
+    {
+        return m_cache.get_handle( key ) != nullptr;
     }
     void set( const size_t& key, const std::string& value ) override
     {
         m_cache.set( key, value );
     }
+    size_t multi_get( const size_t* keys, size_t count, const std::string** out ) override
+    {
+        if( m_batch.size() < count )
+            m_batch.resize( count );
+        size_t found = 0;
+        for( size_t i = 0; i < count; ++i )
+        {
+            m_batch[i] = m_cache.get_handle( keys[i] );
+            out[i] = m_batch[i].get();
+            found += out[i] != nullptr;
+        }
+        return found;
+    }
+    void multi_set( const std::pair< size_t, std::string >* items, size_t count ) override
+    {
+        for( size_t i = 0; i < count; ++i )
+            m_cache.set( items[i].first, items[i].second );
+    }
     std::string name() const override
     {
-        return "TimedCache(" + std::to_string(capacity()) + "; dt= "+ std::to_string( m_dt.count() ) + "ms)";
+        return "TwoTier" + std::to_string( m_spillBytes >> 20 ) + "MB(" + std::to_string( capacity() ) + "; dt= " + std::to_string( m_dt.count() ) + "ms)";
     }
     size_t capacity() const override
     {
@@ -41,11 +268,264 @@ public:
     void clear() override
     {
         m_cache.clear();
+        for( auto& latency : m_latency )
+            latency.clear();
+        m_base = m_cache.tier_stats();
+    }
+    std::string details() const override
+    {
+        static const char* names[] = { "memory", "spill", "miss" };
+        TierStats stats = m_cache.tier_stats();
+        uint64_t total = 0;
+        for( auto& latency : m_latency )
+            total += latency.count();
+        std::string result;
+        for( size_t tier = 0; tier < m_latency.size(); ++tier )
+        {
+            const LatencyHistogram& latency = m_latency[tier];
+            result += "\t" + std::string( names[tier] ) + ": " + std::to_string( total == 0 ? 0.0 : double( latency.count() ) * 100.0 / double( total ) )
+                + "%, p50 " + std::to_string( latency.percentile( 0.5 ) ) + " ns, p99 " + std::to_string( latency.percentile( 0.99 ) ) + " ns\n";
+        }
+        result += "\tdemoted " + std::to_string( stats.demotions - m_base.demotions ) + ", overwritten in spill "
+            + std::to_string( stats.overwritten - m_base.overwritten ) + ", expired in spill " + std::to_string( stats.spillExpired - m_base.spillExpired ) + "\n";
+        return result;
     }
 private:
+    static std::string spillPath()
+    {
+        static std::atomic< int > counter{ 0 };
+        return ( std::filesystem::temp_directory_path() / ( "TimedCache" + std::to_string( ++counter ) + ".spill" ) ).string();
+    }
+
+    TwoTierCache< size_t, std::string > m_cache;
     std::chrono::milliseconds m_dt;
-    std::optional< std::string > m_value;
-    TimedCache< size_t, std::string > m_cache;
+    size_t m_spillBytes;
+    TwoTierCache< size_t, std::string >::handle m_value;
+    std::vector< TwoTierCache< size_t, std::string >::handle > m_batch;
+    std::array< LatencyHistogram, 3 > m_latency;
+    TierStats m_base;
+};
+
+class CacheLazyTimedCached : public CacheTimedCached<>
+{
+public:
+    template< class Rep, class Period >
+    CacheLazyTimedCached( size_t size, const std::chrono::duration< Rep, Period >& relTime )
+        : CacheTimedCached( size, relTime, lazy() )
+    {
+    }
+
+    std::string name() const override
+    {
+        return "Lazy" + CacheTimedCached::name();
+    }
+private:
+    static CacheOptions lazy()
+    {
+        CacheOptions options;
+        options.expiry = ExpiryMode::Lazy;
+        return options;
+    }
+};
+
+class CacheReadBufferedTimedCached : public CacheTimedCached<>
+{
+public:
+    template< class Rep, class Period >
+    CacheReadBufferedTimedCached( size_t size, const std::chrono::duration< Rep, Period >& relTime )
+        : CacheTimedCached( size, relTime, readBuffered() )
+    {
+    }
+
+    std::string name() const override
+    {
+        return "ReadBuffered" + CacheTimedCached::name();
+    }
+private:
+    static CacheOptions readBuffered()
+    {
+        CacheOptions options;
+        options.readBuffer = true;
+        return options;
+    }
+};
+
+class CachePoolTimedCached : public CacheTimedCached<>
+{
+public:
+    template< class Rep, class Period >
+    CachePoolTimedCached( size_t size, const std::chrono::duration< Rep, Period >& relTime )
+        : CacheTimedCached( size, relTime, slabPool() )
+    {
+    }
+
+    std::string name() const override
+    {
+        return "Pool" + CacheTimedCached::name();
+    }
+private:
+    static CacheOptions slabPool()
+    {
+        CacheOptions options;
+        options.slabPool = true;
+        return options;
+    }
+};
+
+class CacheWeightedTimedCached : public CacheTimedCached<>
+{
+public:
+    template< class Rep, class Period >
+    CacheWeightedTimedCached( size_t size, const std::chrono::duration< Rep, Period >& relTime, size_t maxWeight )
+        : CacheTimedCached( size, relTime, weighted( maxWeight ) ), m_maxWeight( maxWeight )
+    {
+    }
+
+    std::string name() const override
+    {
+        return "Weighted" + std::to_string( m_maxWeight >> 20 ) + "MB" + CacheTimedCached::name();
+    }
+private:
+    static CacheOptions weighted( size_t maxWeight )
+    {
+        CacheOptions options;
+        options.maxWeight = maxWeight;
+        return options;
+    }
+
+    size_t m_maxWeight;
+};
+
+class CacheTinyLfuTimedCached : public CacheTimedCached<>
+{
+public:
+    template< class Rep, class Period >
+    CacheTinyLfuTimedCached( size_t size, const std::chrono::duration< Rep, Period >& relTime )
+        : CacheTimedCached( size, relTime, tinyLfu() )
+    {
+    }
+
+    std::string name() const override
+    {
+        return "TinyLfu" + CacheTimedCached::name();
+    }
+private:
+    static CacheOptions tinyLfu()
+    {
+        CacheOptions options;
+        options.admission = Admission::TinyLfu;
+        return options;
+    }
+};
+
+template< class Stats >
+class CacheStatsTimedCached : public CacheTimedCached< TimedCache< size_t, std::string, PreciseClock, Stats > >
+{
+    using base = CacheTimedCached< TimedCache< size_t, std::string, PreciseClock, Stats > >;
+public:
+    using base::base;
+
+    std::string name() const override
+    {
+        return ( Stats::histograms ? "DetailedStats" : "Stats" ) + base::name();
+    }
+};
+
+template< class Clock >
+class CacheClockTimedCached : public CacheTimedCached< TimedCache< size_t, std::string, Clock > >
+{
+    using base = CacheTimedCached< TimedCache< size_t, std::string, Clock > >;
+public:
+    using base::base;
+
+    std::string name() const override
+    {
+        return Clock::name() + base::name();
+    }
+};
+
+// Кэш с политиками времени компиляции (CachePolicy.h)
+template< class Policy, class Clock = PreciseClock >
+class CachePolicyTimedCached : public CacheTimedCached< TimedCache< size_t, std::string, Clock, NoStats, Policy > >
+{
+    using base = CacheTimedCached< TimedCache< size_t, std::string, Clock, NoStats, Policy > >;
+public:
+    template< class Rep, class Period >
+    CachePolicyTimedCached( const std::string& prefix, size_t size, const std::chrono::duration< Rep, Period >& relTime )
+        : base( size, relTime ), m_prefix( prefix )
+    {
+    }
+
+    std::string name() const override
+    {
+        return m_prefix + base::name();
+    }
+private:
+    std::string m_prefix;
+};
+
+// Обычная хэш-таблица для сравнения: без срока жизни и без порядка вытеснения,
+// при переполнении удаляется первый попавшийся ключ. Только для одного потока.
+class CacheHashMap : public ICache< size_t, std::string >
+{
+public:
+    CacheHashMap( size_t size )
+        : m_capacity( size )
+    {
+        m_map.reserve( size );
+    }
+    const std::string* get( const size_t& key ) override
+    {
+        auto iter = m_map.find( key );
+        return iter != m_map.end() ? &iter->second : nullptr;
+    }
+    bool contains( const size_t& key ) override
+    {
+        return m_map.count( key ) != 0;
+    }
+    void set( const size_t& key, const std::string& value ) override
+    {
+        auto iter = m_map.find( key );
+        if( iter != m_map.end() )
+        {
+            iter->second = value;
+            return;
+        }
+        if( m_map.size() == m_capacity )
+            m_map.erase( m_map.begin() );
+        m_map.emplace( key, value );
+    }
+    size_t multi_get( const size_t* keys, size_t count, const std::string** out ) override
+    {
+        size_t found = 0;
+        for( size_t i = 0; i < count; ++i )
+        {
+            out[i] = get( keys[i] );
+            if( out[i] )
+                ++found;
+        }
+        return found;
+    }
+    void multi_set( const std::pair< size_t, std::string >* items, size_t count ) override
+    {
+        for( size_t i = 0; i < count; ++i )
+            set( items[i].first, items[i].second );
+    }
+    std::string name() const override
+    {
+        return "unordered_map(" + std::to_string( capacity() ) + ")";
+    }
+    size_t capacity() const override
+    {
+        return m_capacity;
+    }
+    void clear() override
+    {
+        m_map.clear();
+    }
+private:
+    size_t m_capacity;
+    std::unordered_map< size_t, std::string > m_map;
 };
 
 class CachePoco : public ICache< size_t, std::string >
@@ -55,15 +535,38 @@ public:
         : m_capacity( size ), m_cache( size )
     {}
     ~CachePoco() = default;
-    std::string* get( const size_t& key ) override
+    const std::string* get( const size_t& key ) override
     {
         m_string = m_cache.get( key );
         return m_string.get();
     }
+    bool contains( const size_t& key ) override
+    {
+        return m_cache.get( key ).get() != nullptr;
+    }
     void set( const size_t& key, const std::string& value ) override
     {
         m_cache.add( key, value );
     }
+    size_t multi_get( const size_t* keys, size_t count, const std::string** out ) override
+    {
+        if( m_batch.size() < count )
+            m_batch.resize( count );
+        size_t found = 0;
+        for( size_t i = 0; i < count; ++i )
+        {
+            m_batch[i] = m_cache.get( keys[i] );
+            out[i] = m_batch[i].get();
+            if( out[i] )
+                ++found;
+        }
+        return found;
+    }
+    void multi_set( const std::pair< size_t, std::string >* items, size_t count ) override
+    {
+        for( size_t i = 0; i < count; ++i )
+            m_cache.add( items[i].first, items[i].second );
+    }
     std::string name() const override
     {
         return "Poco(" + std::to_string( capacity() ) + ")";
@@ -79,34 +582,84 @@ public:
 private:
     size_t m_capacity;
     Poco::SharedPtr< std::string > m_string;
+    std::vector< Poco::SharedPtr< std::string > > m_batch;
     Poco::LRUCache< size_t, std::string > m_cache;
 };
 
-int main()
+// Без аргументов - все тесты. С аргументом - воспроизведение файла трассы (см. Workload.h).
+int main( int argc, char* argv[] )
 {
     std::unique_ptr<ICache< size_t, std::string >> ctc1K{
-        new CacheTimedCached( size_t( 1000 ), std::chrono::milliseconds( 1 ) )
+        new CacheTimedCached<>( size_t( 1000 ), std::chrono::milliseconds( 1 ) )
     };
     std::unique_ptr<ICache< size_t, std::string >> ctc10K{
-        new CacheTimedCached( size_t(10000), std::chrono::milliseconds( 1 ) )
+        new CacheTimedCached<>( size_t(10000), std::chrono::milliseconds( 1 ) )
     };
     std::unique_ptr<ICache< size_t, std::string >> ctc1K10{
-        new CacheTimedCached( size_t( 1000 ), std::chrono::milliseconds( 10 ) )
+        new CacheTimedCached<>( size_t( 1000 ), std::chrono::milliseconds( 10 ) )
     };
     std::unique_ptr<ICache< size_t, std::string >> ctc10K10{
-        new CacheTimedCached( size_t( 10000 ), std::chrono::milliseconds( 10 ) )
+        new CacheTimedCached<>( size_t( 10000 ), std::chrono::milliseconds( 10 ) )
     };
     std::unique_ptr<ICache< size_t, std::string >> ctc1K100{
-        new CacheTimedCached( size_t( 1000 ), std::chrono::milliseconds( 100 ) )
+        new CacheTimedCached<>( size_t( 1000 ), std::chrono::milliseconds( 100 ) )
     };
     std::unique_ptr<ICache< size_t, std::string >> ctc10K100{
-        new CacheTimedCached( size_t( 10000 ), std::chrono::milliseconds( 100 ) )
+        new CacheTimedCached<>( size_t( 10000 ), std::chrono::milliseconds( 100 ) )
     };
     std::unique_ptr<ICache< size_t, std::string >> ctc1K1000{
-    new CacheTimedCached( size_t( 1000 ), std::chrono::milliseconds( 1000 ) )
+    new CacheTimedCached<>( size_t( 1000 ), std::chrono::milliseconds( 1000 ) )
     };
     std::unique_ptr<ICache< size_t, std::string >> ctc10K1000{
-        new CacheTimedCached( size_t( 10000 ), std::chrono::milliseconds( 1000 ) )
+        new CacheTimedCached<>( size_t( 10000 ), std::chrono::milliseconds( 1000 ) )
+    };
+    std::unique_ptr<ICache< size_t, std::string >> sctc1K1000{
+        new CacheShardedTimedCached( size_t( 1000 ), std::chrono::milliseconds( 1000 ) )
+    };
+    std::unique_ptr<ICache< size_t, std::string >> sctc10K1000{
+        new CacheShardedTimedCached( size_t( 10000 ), std::chrono::milliseconds( 1000 ) )
+    };
+    std::unique_ptr<ICache< size_t, std::string >> wctc1K100{
+        new CacheWheelTimedCached( size_t( 1000 ), std::chrono::milliseconds( 100 ), std::chrono::milliseconds( 1 ) )
+    };
+    std::unique_ptr<ICache< size_t, std::string >> wctc10K100{
+        new CacheWheelTimedCached( size_t( 10000 ), std::chrono::milliseconds( 100 ), std::chrono::milliseconds( 1 ) )
+    };
+    std::unique_ptr<ICache< size_t, std::string >> lctc1K100{
+        new CacheLazyTimedCached( size_t( 1000 ), std::chrono::milliseconds( 100 ) )
+    };
+    std::unique_ptr<ICache< size_t, std::string >> lctc10K100{
+        new CacheLazyTimedCached( size_t( 10000 ), std::chrono::milliseconds( 100 ) )
+    };
+    std::unique_ptr<ICache< size_t, std::string >> cctc1K100{
+        new CacheClockTimedCached< CoarseClock >( size_t( 1000 ), std::chrono::milliseconds( 100 ) )
+    };
+    std::unique_ptr<ICache< size_t, std::string >> cctc10K100{
+        new CacheClockTimedCached< CoarseClock >( size_t( 10000 ), std::chrono::milliseconds( 100 ) )
+    };
+    std::unique_ptr<ICache< size_t, std::string >> tctc1K100{
+        new CacheClockTimedCached< TickerClock >( size_t( 1000 ), std::chrono::milliseconds( 100 ) )
+    };
+    std::unique_ptr<ICache< size_t, std::string >> tctc10K100{
+        new CacheClockTimedCached< TickerClock >( size_t( 10000 ), std::chrono::milliseconds( 100 ) )
+    };
+    std::unique_ptr<ICache< size_t, std::string >> rctc1K100{
+        new CacheClockTimedCached< TscClock >( size_t( 1000 ), std::chrono::milliseconds( 100 ) )
+    };
+    std::unique_ptr<ICache< size_t, std::string >> rctc10K100{
+        new CacheClockTimedCached< TscClock >( size_t( 10000 ), std::chrono::milliseconds( 100 ) )
+    };
+    std::unique_ptr<ICache< size_t, std::string >> bctc1K100{
+        new CacheReadBufferedTimedCached( size_t( 1000 ), std::chrono::milliseconds( 100 ) )
+    };
+    std::unique_ptr<ICache< size_t, std::string >> bctc10K100{
+        new CacheReadBufferedTimedCached( size_t( 10000 ), std::chrono::milliseconds( 100 ) )
+    };
+    std::unique_ptr<ICache< size_t, std::string >> pctc1K100{
+        new CachePoolTimedCached( size_t( 1000 ), std::chrono::milliseconds( 100 ) )
+    };
+    std::unique_ptr<ICache< size_t, std::string >> pctc10K100{
+        new CachePoolTimedCached( size_t( 10000 ), std::chrono::milliseconds( 100 ) )
     };
     std::unique_ptr<ICache< size_t, std::string >> pocoLRU1K{
         new CachePoco( size_t( 1000 ) )
@@ -114,6 +667,21 @@ int main()
     std::unique_ptr<ICache< size_t, std::string >> pocoLRU10K{
         new CachePoco( size_t( 10000 ) )
     };
+    if( argc > 1 )
+    {
+        /// Трасса: время и попадания кэшей, затем доля попаданий по размерам и временам жизни
+        TestPerfomance test;
+        test.PushCache( pocoLRU10K.get() );
+        test.PushCache( ctc10K1000.get() );
+        test.PushCache( sctc10K1000.get() );
+        // Второй аргумент paced - запросы по меткам времени трассы, иначе подряд
+        test.SetTrace( argv[1], argc > 2 && std::string( argv[2] ) == "paced" );
+        test.SetCurve( { 1000, 10000, 100000, 1000000 },
+            { std::chrono::milliseconds( 100 ), std::chrono::milliseconds( 1000 ), std::chrono::milliseconds( 10000 ), std::chrono::milliseconds( 100000 ) } );
+
+        test.Execute( std::cout );
+        return 0;
+    }
     {
         /// Кэш размером 1000
         TestPerfomance test;
@@ -121,7 +689,15 @@ int main()
         test.PushCache( ctc1K.get() );
         test.PushCache( ctc1K10.get() );
         test.PushCache( ctc1K100.get() );
+        test.PushCache( wctc1K100.get() );
+        test.PushCache( lctc1K100.get() );
+        test.PushCache( cctc1K100.get() );
+        test.PushCache( tctc1K100.get() );
+        test.PushCache( rctc1K100.get() );
+        test.PushCache( bctc1K100.get() );
+        test.PushCache( pctc1K100.get() );
         test.PushCache( ctc1K1000.get() );
+        test.PushCache( sctc1K1000.get() );
         test.SetParam( 10000, 1000000 );
 
         test.Execute( std::cout );
@@ -133,7 +709,15 @@ int main()
         test.PushCache( ctc10K.get() );
         test.PushCache( ctc10K10.get() );
         test.PushCache( ctc10K100.get() );
+        test.PushCache( wctc10K100.get() );
+        test.PushCache( lctc10K100.get() );
+        test.PushCache( cctc10K100.get() );
+        test.PushCache( tctc10K100.get() );
+        test.PushCache( rctc10K100.get() );
+        test.PushCache( bctc10K100.get() );
+        test.PushCache( pctc10K100.get() );
         test.PushCache( ctc10K1000.get() );
+        test.PushCache( sctc10K1000.get() );
         test.SetParam( 10000, 1000000 );
 
         test.Execute( std::cout );
@@ -145,7 +729,15 @@ int main()
         test.PushCache( ctc1K.get() );
         test.PushCache( ctc1K10.get() );
         test.PushCache( ctc1K100.get() );
+        test.PushCache( wctc1K100.get() );
+        test.PushCache( lctc1K100.get() );
+        test.PushCache( cctc1K100.get() );
+        test.PushCache( tctc1K100.get() );
+        test.PushCache( rctc1K100.get() );
+        test.PushCache( bctc1K100.get() );
+        test.PushCache( pctc1K100.get() );
         test.PushCache( ctc1K1000.get() );
+        test.PushCache( sctc1K1000.get() );
         test.SetParam( 100000, 1000000 );
 
         test.Execute( std::cout );
@@ -157,10 +749,259 @@ int main()
         test.PushCache( ctc10K.get() );
         test.PushCache( ctc10K10.get() );
         test.PushCache( ctc10K100.get() );
+        test.PushCache( wctc10K100.get() );
+        test.PushCache( lctc10K100.get() );
+        test.PushCache( cctc10K100.get() );
+        test.PushCache( tctc10K100.get() );
+        test.PushCache( rctc10K100.get() );
+        test.PushCache( bctc10K100.get() );
+        test.PushCache( pctc10K100.get() );
         test.PushCache( ctc10K1000.get() );
+        test.PushCache( sctc10K1000.get() );
         test.SetParam( 100000, 1000000 );
 
         test.Execute( std::cout );
     }
+    for( size_t batch : { size_t( 20 ), size_t( 200 ) } )
+    {
+        /// Пакетные запросы, кэш размером 10000
+        TestPerfomance test;
+        test.PushCache( pocoLRU10K.get() );
+        test.PushCache( ctc10K100.get() );
+        test.PushCache( cctc10K100.get() );
+        test.PushCache( ctc10K1000.get() );
+        test.PushCache( sctc10K1000.get() );
+        test.SetParam( 100000, 1000000 );
+        test.SetBatch( batch );
+
+        test.Execute( std::cout );
+    }
+    {
+        /// Частые ключи и проход по разовым: LRU против допуска TinyLFU
+        std::unique_ptr<ICache< size_t, std::string >> ctc1K1000scan{
+            new CacheTimedCached<>( size_t( 1000 ), std::chrono::milliseconds( 1000 ) )
+        };
+        std::unique_ptr<ICache< size_t, std::string >> tctc1K1000scan{
+            new CacheTinyLfuTimedCached( size_t( 1000 ), std::chrono::milliseconds( 1000 ) )
+        };
+        // hot = 0 - равномерно по 100000 ключей, как в первых тестах
+        for( size_t hot : { size_t( 500 ), size_t( 0 ) } )
+        {
+            TestPerfomance test;
+            test.PushCache( pocoLRU1K.get() );
+            test.PushCache( ctc1K1000scan.get() );
+            test.PushCache( tctc1K1000scan.get() );
+            test.SetParam( 100000, 1000000 );
+            test.SetScan( hot, 0.7 );
+
+            test.Execute( std::cout );
+        }
+    }
+    {
+        /// Распределения ключей, похожие на настоящую нагрузку
+        std::unique_ptr<ICache< size_t, std::string >> ctc10K1000w{
+            new CacheTimedCached<>( size_t( 10000 ), std::chrono::milliseconds( 1000 ) )
+        };
+        std::unique_ptr<ICache< size_t, std::string >> tctc10K1000w{
+            new CacheTinyLfuTimedCached( size_t( 10000 ), std::chrono::milliseconds( 1000 ) )
+        };
+        for( const Workload& workload : { Workload::zipf( 0.99 ), Workload::hotspot( 0.05, 0.9 ), Workload::scan(),
+            Workload::scanZipf( 0.99, 0.3 ), Workload::shifting( 0.99, 100000 ) } )
+        {
+            TestPerfomance test;
+            test.PushCache( pocoLRU10K.get() );
+            test.PushCache( ctc10K1000w.get() );
+            test.PushCache( tctc10K1000w.get() );
+            test.SetParam( 100000, 1000000 );
+            test.SetWorkload( workload );
+            // Кривая только для Zipf, остальные считаются так же
+            if( workload.kind == Workload::Kind::Zipf )
+                test.SetCurve( { 1000, 10000, 50000 }, { std::chrono::milliseconds( 10 ), std::chrono::milliseconds( 100 ), std::chrono::milliseconds( 1000 ) } );
+
+            test.Execute( std::cout );
+        }
+    }
+    {
+        /// Значения от 50 байт до 64 KB: ограничение по числу против ограничения по памяти.
+        /// Средний размер значения около 9 KB, 1000 значений - около 9 MB.
+        std::unique_ptr<ICache< size_t, std::string >> ctc1K1000mixed{
+            new CacheTimedCached<>( size_t( 1000 ), std::chrono::milliseconds( 1000 ) )
+        };
+        std::unique_ptr<ICache< size_t, std::string >> wctc9MB{
+            new CacheWeightedTimedCached( size_t( 10000 ), std::chrono::milliseconds( 1000 ), size_t( 9 ) << 20 )
+        };
+        TestPerfomance test;
+        test.PushCache( pocoLRU1K.get() );
+        test.PushCache( ctc1K1000mixed.get() );
+        test.PushCache( wctc9MB.get() );
+        test.SetParam( 10000, 200000 );
+        test.SetValueSizes( 50, 65536 );
+
+        test.Execute( std::cout );
+    }
+    {
+        /// Цена статистики: без нее, счетчики, счетчики и гистограммы
+        std::unique_ptr<ICache< size_t, std::string >> stctc10K1000{
+            new CacheStatsTimedCached< CacheStats >( size_t( 10000 ), std::chrono::milliseconds( 1000 ) )
+        };
+        std::unique_ptr<ICache< size_t, std::string >> dstctc10K1000{
+            new CacheStatsTimedCached< DetailedCacheStats >( size_t( 10000 ), std::chrono::milliseconds( 1000 ) )
+        };
+        TestPerfomance test;
+        test.PushCache( ctc10K1000.get() );
+        test.PushCache( stctc10K1000.get() );
+        test.PushCache( dstctc10K1000.get() );
+        test.SetParam( 12000, 2000000 );
+
+        test.Execute( std::cout );
+        test.SetConcurrent( { 1, 4 }, 0.9, std::chrono::milliseconds( 500 ) );
+        test.Execute( std::cout );
+    }
+    {
+        /// Несколько потоков: масштабирование и хвост задержек, 90% чтений
+        std::unique_ptr<ICache< size_t, std::string >> bctc10K1000{
+            new CacheReadBufferedTimedCached( size_t( 10000 ), std::chrono::milliseconds( 1000 ) )
+        };
+        TestPerfomance test;
+        test.PushCache( pocoLRU10K.get() );
+        test.PushCache( ctc10K1000.get() );
+        test.PushCache( sctc10K1000.get() );
+        test.PushCache( bctc10K1000.get() );
+        test.SetParam( 12000, 0 );
+        test.SetConcurrent( { 1, 2, 4, 8 }, 0.9, std::chrono::milliseconds( 500 ) );
+
+        test.Execute( std::cout );
+    }
+    {
+        /// Кэш первого уровня в потоках: Zipf, горячие ключи почти не доходят до общего кэша
+        std::unique_ptr<ICache< size_t, std::string >> fctc10K1000{
+            new CacheFrontTimedCached( size_t( 10000 ), std::chrono::milliseconds( 1000 ) )
+        };
+        std::unique_ptr<ICache< size_t, std::string >> bctc10K1000z{
+            new CacheReadBufferedTimedCached( size_t( 10000 ), std::chrono::milliseconds( 1000 ) )
+        };
+        TestPerfomance test;
+        test.PushCache( ctc10K1000.get() );
+        test.PushCache( sctc10K1000.get() );
+        test.PushCache( bctc10K1000z.get() );
+        test.PushCache( fctc10K1000.get() );
+        test.SetParam( 100000, 1000000 );
+        test.SetWorkload( Workload::zipf( 0.99 ) );
+
+        test.Execute( std::cout );
+        test.SetConcurrent( { 1, 4 }, 0.99, std::chrono::milliseconds( 500 ) );
+        test.Execute( std::cout );
+    }
+    {
+        /// Второй уровень в файле: 100000 ключей на 10000 мест в памяти, равномерно и по Zipf
+        std::unique_ptr<ICache< size_t, std::string >> ctc10K10000{
+            new CacheTimedCached<>( size_t( 10000 ), std::chrono::milliseconds( 10000 ) )
+        };
+        std::unique_ptr<ICache< size_t, std::string >> ttctc10K10000{
+            new CacheTwoTierTimedCached( size_t( 10000 ), std::chrono::milliseconds( 10000 ), size_t( 4 ) << 20 )
+        };
+        std::unique_ptr<ICache< size_t, std::string >> ttctc10K1000{
+            new CacheTwoTierTimedCached( size_t( 10000 ), std::chrono::milliseconds( 1000 ), size_t( 4 ) << 20 )
+        };
+        for( bool zipf : { false, true } )
+        {
+            TestPerfomance test;
+            test.PushCache( ctc10K10000.get() );
+            test.PushCache( ttctc10K10000.get() );
+            test.PushCache( ctc10K1000.get() );
+            test.PushCache( ttctc10K1000.get() );
+            test.SetParam( 100000, 1000000 );
+            if( zipf )
+                test.SetWorkload( Workload::zipf( 0.99 ) );
+
+            test.Execute( std::cout );
+        }
+    }
+    {
+        /// Цена слушателя удалений: 90% промахов, на каждый set - вытеснение
+        std::unique_ptr<ICache< size_t, std::string >> lctc10K1000{
+            new CacheListenerTimedCached( size_t( 10000 ), std::chrono::milliseconds( 1000 ), ListenerOverflow::Block )
+        };
+        std::unique_ptr<ICache< size_t, std::string >> dlctc10K1000{
+            new CacheListenerTimedCached( size_t( 10000 ), std::chrono::milliseconds( 1000 ), ListenerOverflow::Drop )
+        };
+        TestPerfomance test;
+        test.PushCache( ctc10K1000.get() );
+        test.PushCache( lctc10K1000.get() );
+        test.PushCache( dlctc10K1000.get() );
+        test.SetParam( 100000, 1000000 );
+
+        test.Execute( std::cout );
+        test.SetConcurrent( { 1, 4 }, 0.9, std::chrono::milliseconds( 500 ) );
+        test.Execute( std::cout );
+    }
+    {
+        /// Синхронное "протухание": пачки по 50000 ключей, чистка целиком против частями
+        std::unique_ptr<ICache< size_t, std::string >> sweepAll{
+            new CacheSweepTimedCached( size_t( 100000 ), std::chrono::milliseconds( 100 ), 0 )
+        };
+        std::unique_ptr<ICache< size_t, std::string >> sweep1024{
+            new CacheSweepTimedCached( size_t( 100000 ), std::chrono::milliseconds( 100 ), 1024 )
+        };
+        std::unique_ptr<ICache< size_t, std::string >> sweep128{
+            new CacheSweepTimedCached( size_t( 100000 ), std::chrono::milliseconds( 100 ), 128 )
+        };
+        TestPerfomance test;
+        test.PushCache( sweepAll.get() );
+        test.PushCache( sweep1024.get() );
+        test.PushCache( sweep128.get() );
+        test.SetParam( 10000, 0 );
+        test.SetConcurrent( { 1, 4 }, 0.9, std::chrono::milliseconds( 2000 ) );
+        test.SetBurst( 50000, std::chrono::milliseconds( 250 ) );
+
+        test.Execute( std::cout );
+    }
+    {
+        /// Один поток: политики времени компиляции против обычной хэш-таблицы
+        std::unique_ptr<ICache< size_t, std::string >> hash10K{
+            new CacheHashMap( size_t( 10000 ) )
+        };
+        std::unique_ptr<ICache< size_t, std::string >> local10K1000{
+            new CachePolicyTimedCached< SingleThreadedPolicy >( "Local", size_t( 10000 ), std::chrono::milliseconds( 1000 ) )
+        };
+        std::unique_ptr<ICache< size_t, std::string >> tlocal10K1000{
+            new CachePolicyTimedCached< SingleThreadedPolicy, TickerClock >( "TickerLocal", size_t( 10000 ), std::chrono::milliseconds( 1000 ) )
+        };
+        std::unique_ptr<ICache< size_t, std::string >> flocal10K1000{
+            new CachePolicyTimedCached< CachePolicy< NoLocking, LazyExpiry, FifoEviction >, TickerClock >( "TickerFifoLocal", size_t( 10000 ), std::chrono::milliseconds( 1000 ) )
+        };
+        std::unique_ptr<ICache< size_t, std::string >> lru10K{
+            new CachePolicyTimedCached< CachePolicy< NoLocking, NoExpiry > >( "NoExpiryLocal", size_t( 10000 ), std::chrono::milliseconds( 1000 ) )
+        };
+        TestPerfomance test;
+        test.PushCache( hash10K.get() );
+        test.PushCache( ctc10K1000.get() );
+        test.PushCache( local10K1000.get() );
+        test.PushCache( tlocal10K1000.get() );
+        test.PushCache( flocal10K1000.get() );
+        test.PushCache( lru10K.get() );
+        test.SetParam( 100000, 1000000 );
+
+        test.Execute( std::cout );
+    }
+    {
+        /// Быстрый старт из снимка
+        SnapshotSpeed< TimedCache< size_t, std::string > >( std::cout, "TimedCache.snapshot", 1000000, std::chrono::seconds( 100 ) );
+    }
+    {
+        /// Удаление по времени: список давности против колеса таймеров
+        std::cout << "\n\nExpiry accuracy. Count = 100000\n";
+        for( auto ttl : { std::chrono::milliseconds( 1 ), std::chrono::milliseconds( 100 ), std::chrono::milliseconds( 1000 ) } )
+        {
+            const std::string dt = "; dt= " + std::to_string( ttl.count() ) + "ms)";
+            TimedCache< size_t, std::string > list( 100000, ttl );
+            ExpiryAccuracy( std::cout, "list(100000" + dt, list, ttl, 100000 );
+            for( auto tick : { std::chrono::milliseconds( 1 ), std::chrono::milliseconds( 10 ) } )
+            {
+                TimedCache< size_t, std::string > wheel( 100000, ttl, CacheOptions{ tick } );
+                ExpiryAccuracy( std::cout, "wheel" + std::to_string( tick.count() ) + "ms(100000" + dt, wheel, ttl, 100000 );
+            }
+        }
+    }
     return 0;
 }